@@ -85,6 +85,10 @@ Activation *make_activation_sigmoid() {
     return act;
 }
 
+bool activation_is_sigmoid(const Activation *act) {
+    return act && act->forward == sigmoid_forward;
+}
+
 static float ttanh(float input, float second) {
     return tanh(input);
 }
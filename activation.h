@@ -18,6 +18,8 @@ Activation *make_activation_relu();
 
 Activation *make_activation_sigmoid();
 
+bool activation_is_sigmoid(const Activation *act);
+
 Activation *make_activation_tanh();
 
 Activation *make_activation_softmax();
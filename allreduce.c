@@ -0,0 +1,438 @@
+// shm_open, fork and, on Linux, sched_setaffinity and the futex syscall
+// under -std=c11
+#if defined(__linux__)
+#define _GNU_SOURCE
+#elif !defined(__APPLE__)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "allreduce.h"
+#include "simd_neon.h"
+
+// the header takes its own cache line, every region starts on one
+#define SHM_ALIGN 64
+#define SHM_ALIGN_FLOATS 16
+// polls before sleeping in the kernel, most barriers of a step are short
+#define SHM_SPIN 4096
+#define WORKER_POLL_NS 1000000
+#define CPU_LIST_LEN 1024
+#define SHM_NAME_LEN 64
+
+typedef struct {
+    atomic_int count;
+    atomic_int generation;
+} ShmBarrier;
+
+typedef struct {
+    int n_ranks;
+    // floats per region, max_floats rounded up to a cache line
+    int stride;
+    ShmBarrier barrier;
+} ShmHeader;
+
+typedef struct shm_group {
+    char *name;
+} ShmGroup;
+
+// the segment holds the header, one region per rank and the result
+typedef struct {
+    void *base;
+    size_t size;
+    ShmHeader *header;
+    float *regions;
+} ShmState;
+
+Transport *create_transport(int rank, int n_ranks,
+                            int (*allreduce) (Transport *, float *, int),
+                            int (*barrier) (Transport *),
+                            void (*destroy) (Transport *), void *state) {
+    assert(n_ranks > 0);
+    assert(rank >= 0 && rank < n_ranks);
+    assert(allreduce);
+    assert(barrier);
+    Transport *t = malloc(sizeof(Transport));
+    if (t == NULL) {
+        return NULL;
+    }
+    t->rank = rank;
+    t->n_ranks = n_ranks;
+    t->allreduce = allreduce;
+    t->barrier = barrier;
+    t->destroy = destroy;
+    t->state = state;
+    return t;
+}
+
+void destroy_transport(Transport *t) {
+    assert(t);
+    if (t->destroy) {
+        t->destroy(t);
+    }
+    free(t);
+}
+
+int transport_allreduce(Transport *t, float *data, int n) {
+    assert(t);
+    assert(data);
+    assert(n >= 0);
+    return t->allreduce(t, data, n);
+}
+
+int transport_barrier(Transport *t) {
+    assert(t);
+    return t->barrier(t);
+}
+
+static size_t shm_header_size(void) {
+    return (sizeof(ShmHeader) + SHM_ALIGN - 1) / SHM_ALIGN * SHM_ALIGN;
+}
+
+static size_t shm_size(int n_ranks, int stride) {
+    return shm_header_size() + sizeof(float) * (size_t) stride * (n_ranks + 1);
+}
+
+// returns once *word no longer holds value. Linux sleeps on a futex, the
+// word lives in shared memory so the wait is not process private
+static void wait_changed(atomic_int *word, int value) {
+    for (int i = 0; i < SHM_SPIN; i++) {
+        if (atomic_load(word) != value) {
+            return;
+        }
+    }
+    while (atomic_load(word) == value) {
+#ifdef __linux__
+        syscall(SYS_futex, (int *) word, FUTEX_WAIT, value, NULL, NULL, 0);
+#else
+        sched_yield();
+#endif
+    }
+}
+
+static void wake_all(atomic_int *word) {
+#ifdef __linux__
+    syscall(SYS_futex, (int *) word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+    (void) word;
+#endif
+}
+
+// the last rank to arrive resets the count before it moves the
+// generation on, nobody can arrive at the next barrier before that
+static int shm_barrier(Transport *t) {
+    ShmBarrier *b = &((ShmState *) t->state)->header->barrier;
+    int generation = atomic_load(&b->generation);
+    if (atomic_fetch_add(&b->count, 1) == t->n_ranks - 1) {
+        atomic_store(&b->count, 0);
+        atomic_fetch_add(&b->generation, 1);
+        wake_all(&b->generation);
+        return 0;
+    }
+    wait_changed(&b->generation, generation);
+    return 0;
+}
+
+// every rank publishes its buffer, sums one cache line aligned chunk of
+// all of them into the result and copies the whole result back. Each
+// element is summed by one rank in rank order, so all ranks get the same
+// bits. Two barriers a call: a rank can only overwrite its region or the
+// result after everybody got past the reads of the previous call
+static int shm_allreduce(Transport *t, float *data, int n) {
+    ShmState *s = t->state;
+    int stride = s->header->stride;
+    if (n > stride) {
+        return -1;
+    }
+    int n_ranks = t->n_ranks;
+    float *result = s->regions + (size_t) n_ranks * stride;
+    memcpy(s->regions + (size_t) t->rank * stride, data, sizeof(float) * n);
+    shm_barrier(t);
+    int chunk = (n + n_ranks - 1) / n_ranks;
+    chunk = (chunk + SHM_ALIGN_FLOATS - 1) / SHM_ALIGN_FLOATS *
+            SHM_ALIGN_FLOATS;
+    int lo = t->rank * chunk;
+    int hi = lo + chunk < n ? lo + chunk : n;
+    if (lo < hi) {
+        memcpy(result + lo, s->regions + lo, sizeof(float) * (hi - lo));
+        for (int r = 1; r < n_ranks; r++) {
+            float_add(result + lo, result + lo,
+                      s->regions + (size_t) r * stride + lo, hi - lo);
+        }
+    }
+    shm_barrier(t);
+    memcpy(data, result, sizeof(float) * n);
+    return 0;
+}
+
+static void shm_destroy(Transport *t) {
+    ShmState *s = t->state;
+    munmap(s->base, s->size);
+    free(s);
+}
+
+// creates the segment for n_ranks ranks summing up to max_floats floats.
+// name follows shm_open, a leading slash and no other, NULL picks one
+// unique to this process. Returns NULL when the segment exists already or
+// cannot be created
+ShmGroup *create_shm_group(const char *name, int n_ranks, int max_floats) {
+    assert(n_ranks > 0);
+    assert(max_floats > 0);
+    static atomic_int n_groups;
+    char unique[SHM_NAME_LEN];
+    if (name == NULL) {
+        snprintf(unique, sizeof(unique), "/nn-allreduce-%ld-%d",
+                 (long) getpid(), atomic_fetch_add(&n_groups, 1));
+        name = unique;
+    }
+    ShmGroup *g = malloc(sizeof(ShmGroup));
+    if (g == NULL) {
+        return NULL;
+    }
+    size_t len = strlen(name) + 1;
+    g->name = malloc(len);
+    if (g->name == NULL) {
+        free(g);
+        return NULL;
+    }
+    memcpy(g->name, name, len);
+    int stride = (max_floats + SHM_ALIGN_FLOATS - 1) / SHM_ALIGN_FLOATS *
+                 SHM_ALIGN_FLOATS;
+    size_t size = shm_size(n_ranks, stride);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        free(g->name);
+        free(g);
+        return NULL;
+    }
+    void *base = ftruncate(fd, (off_t) size) == 0
+                 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                 : MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED) {
+        shm_unlink(name);
+        free(g->name);
+        free(g);
+        return NULL;
+    }
+    // the new segment reads as zeros, the barrier starts out that way
+    ShmHeader *header = base;
+    header->n_ranks = n_ranks;
+    header->stride = stride;
+    munmap(base, size);
+    return g;
+}
+
+// removes the name, ranks still attached keep their mapping
+void destroy_shm_group(ShmGroup *g) {
+    assert(g);
+    shm_unlink(g->name);
+    free(g->name);
+    free(g);
+}
+
+const char *shm_group_get_name(const ShmGroup *g) {
+    assert(g);
+    return g->name;
+}
+
+// attaches rank to the group create_shm_group made under name
+Transport *create_shm_transport(const char *name, int rank) {
+    assert(name);
+    ShmState *s = malloc(sizeof(ShmState));
+    if (s == NULL) {
+        return NULL;
+    }
+    int fd = shm_open(name, O_RDWR, 0600);
+    if (fd < 0) {
+        free(s);
+        return NULL;
+    }
+    struct stat st;
+    s->base = fstat(fd, &st) == 0 && (size_t) st.st_size > shm_header_size()
+              ? mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0)
+              : MAP_FAILED;
+    close(fd);
+    if (s->base == MAP_FAILED) {
+        free(s);
+        return NULL;
+    }
+    s->size = (size_t) st.st_size;
+    s->header = s->base;
+    s->regions = (float *) ((char *) s->base + shm_header_size());
+    int n_ranks = s->header->n_ranks;
+    assert(s->size == shm_size(n_ranks, s->header->stride));
+    assert(rank >= 0 && rank < n_ranks);
+    Transport *t = create_transport(rank, n_ranks, shm_allreduce,
+                                    shm_barrier, shm_destroy, s);
+    if (t == NULL) {
+        munmap(s->base, s->size);
+        free(s);
+        return NULL;
+    }
+    return t;
+}
+
+// memory forked workers and their parent all see, zero filled
+void *create_shared_buffer(size_t n_bytes) {
+    assert(n_bytes > 0);
+    void *buffer = mmap(NULL, n_bytes, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    return buffer == MAP_FAILED ? NULL : buffer;
+}
+
+void destroy_shared_buffer(void *buffer, size_t n_bytes) {
+    assert(buffer);
+    munmap(buffer, n_bytes);
+}
+
+#ifdef __linux__
+// adds the CPUs of a "0-3,8-11" list to set
+static void parse_cpu_list(const char *list, cpu_set_t *set) {
+    char *end;
+    while (*list) {
+        long first = strtol(list, &end, 10);
+        if (end == list) {
+            return;
+        }
+        long last = first;
+        list = end;
+        if (*list == '-') {
+            last = strtol(list + 1, &end, 10);
+            list = end;
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET((int) cpu, set);
+        }
+        if (*list != ',') {
+            return;
+        }
+        list++;
+    }
+}
+
+// on a machine with several NUMA nodes worker rank runs on the CPUs of
+// node rank % n_nodes. Pages the worker writes from then on, its copy of
+// the network included, are first touched on that node
+static void pin_to_numa_node(int rank) {
+    char path[64];
+    int n_nodes = 0;
+    for (;; n_nodes++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+                 n_nodes);
+        if (access(path, R_OK) != 0) {
+            break;
+        }
+    }
+    if (n_nodes < 2) {
+        return;
+    }
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             rank % n_nodes);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return;
+    }
+    char list[CPU_LIST_LEN];
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (fgets(list, sizeof(list), f)) {
+        parse_cpu_list(list, &set);
+    }
+    fclose(f);
+    if (CPU_COUNT(&set) > 0) {
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+}
+#else
+// macOS offers no way to bind a process to cores
+static void pin_to_numa_node(int rank) {
+    (void) rank;
+}
+#endif
+
+static void kill_workers(const pid_t *pids, int n) {
+    for (int i = 0; i < n; i++) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGKILL);
+        }
+    }
+}
+
+// forks n_workers processes that each run worker(rank, ctx) and waits
+// for all of them. When one fails or dies the others are killed, they
+// would wait for it at the next barrier forever. Returns 0 when every
+// worker returned 0, else -1
+int run_workers(int n_workers, int (*worker) (int, void *), void *ctx) {
+    assert(n_workers > 0);
+    assert(worker);
+    pid_t *pids = malloc(sizeof(pid_t) * n_workers);
+    if (pids == NULL) {
+        return -1;
+    }
+    // buffered output would otherwise be written once per process
+    fflush(NULL);
+    int rc = 0;
+    int started = 0;
+    for (; started < n_workers; started++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            rc = -1;
+            kill_workers(pids, started);
+            break;
+        }
+        if (pid == 0) {
+            pin_to_numa_node(started);
+            int status = worker(started, ctx);
+            fflush(NULL);
+            _exit(status == 0 ? 0 : 1);
+        }
+        pids[started] = pid;
+    }
+    int running = started;
+    while (running > 0) {
+        bool reaped = false;
+        for (int i = 0; i < started; i++) {
+            int status = 0;
+            pid_t done = pids[i] ? waitpid(pids[i], &status, WNOHANG) : 0;
+            if (done == 0) {
+                continue;
+            }
+            pids[i] = 0;
+            running--;
+            reaped = true;
+            bool failed = done < 0 || !WIFEXITED(status) ||
+                          WEXITSTATUS(status) != 0;
+            if (rc == 0 && failed) {
+                rc = -1;
+                kill_workers(pids, started);
+            }
+        }
+        if (!reaped) {
+            struct timespec poll = {0, WORKER_POLL_NS};
+            nanosleep(&poll, NULL);
+        }
+    }
+    free(pids);
+    return rc;
+}
@@ -0,0 +1,49 @@
+#ifndef _ALLREDUCE_HEADER_
+#define _ALLREDUCE_HEADER_
+
+#include <stddef.h>
+
+// One rank's end of a group of processes that sum buffers together.
+// Implementations fill in the functions, state is theirs, so that other
+// transports (sockets between hosts) can plug in next to shared memory.
+typedef struct transport {
+    int rank;
+    int n_ranks;
+    // sums n floats element-wise over all ranks in place, every rank ends
+    // with the same bits. Returns 0 or -1
+    int (*allreduce) (struct transport *, float *, int);
+    int (*barrier) (struct transport *);
+    void (*destroy) (struct transport *);
+    void *state;
+} Transport;
+
+// A named POSIX shared memory segment the ranks of one host meet in,
+// created once before the workers attach to it by name.
+typedef struct shm_group ShmGroup;
+
+Transport *create_transport(int rank, int n_ranks,
+                            int (*allreduce) (Transport *, float *, int),
+                            int (*barrier) (Transport *),
+                            void (*destroy) (Transport *), void *state);
+
+void destroy_transport(Transport *t);
+
+int transport_allreduce(Transport *t, float *data, int n);
+
+int transport_barrier(Transport *t);
+
+ShmGroup *create_shm_group(const char *name, int n_ranks, int max_floats);
+
+void destroy_shm_group(ShmGroup *g);
+
+const char *shm_group_get_name(const ShmGroup *g);
+
+Transport *create_shm_transport(const char *name, int rank);
+
+void *create_shared_buffer(size_t n_bytes);
+
+void destroy_shared_buffer(void *buffer, size_t n_bytes);
+
+int run_workers(int n_workers, int (*worker) (int, void *), void *ctx);
+
+#endif
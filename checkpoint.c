@@ -0,0 +1,246 @@
+// fsync and fileno under -std=c11
+#ifndef __APPLE__
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "trace.h"
+
+#define CHECKPOINT_PATH_LEN 4096
+
+typedef struct checkpoint_writer {
+    char path[CHECKPOINT_PATH_LEN];
+    void *buffers[2];
+    size_t sizes[2];
+    size_t capacity;
+    // buffer indices, -1 when none
+    int filling;
+    int pending;
+    int writing;
+    int error;
+    bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} CheckpointWriter;
+
+// FNV-1a, appended to every file so a torn or corrupted file is rejected
+static uint64_t checksum(const void *data, size_t n_bytes) {
+    const unsigned char *bytes = data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < n_bytes; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// flushes the directory entry, so the rename itself survives a crash
+static int sync_parent_dir(const char *path) {
+    char dir[CHECKPOINT_PATH_LEN];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL) {
+        snprintf(dir, sizeof(dir), ".");
+    } else if (slash == dir) {
+        slash[1] = '\0';
+    } else {
+        *slash = '\0';
+    }
+    int fd = open(dir, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+// writes data and its checksum to path.tmp, syncs it and renames it over
+// path, so path always holds a complete snapshot. Returns 0 or -1
+int checkpoint_write(const char *path, const void *data, size_t n_bytes) {
+    assert(path);
+    assert(data);
+    char tmp_path[CHECKPOINT_PATH_LEN + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        return -1;
+    }
+    uint64_t hash = checksum(data, n_bytes);
+    bool ok = fwrite(data, 1, n_bytes, f) == n_bytes &&
+              fwrite(&hash, sizeof(hash), 1, f) == 1 &&
+              fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        return -1;
+    }
+    return sync_parent_dir(path);
+}
+
+// returns the snapshot stored at path, to be freed by the caller, or NULL
+// when the file is missing, truncated or fails its checksum
+void *checkpoint_read(const char *path, size_t *n_bytes) {
+    assert(path);
+    assert(n_bytes);
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    long len = -1;
+    if (fseek(f, 0, SEEK_END) == 0) {
+        len = ftell(f);
+    }
+    if (len < (long) sizeof(uint64_t) || fseek(f, 0, SEEK_SET) != 0) {
+        fclose(f);
+        return NULL;
+    }
+    size_t size = (size_t) len - sizeof(uint64_t);
+    void *data = malloc(size > 0 ? size : 1);
+    uint64_t hash = 0;
+    bool ok = data && fread(data, 1, size, f) == size &&
+              fread(&hash, sizeof(hash), 1, f) == 1;
+    fclose(f);
+    if (!ok || hash != checksum(data, size)) {
+        free(data);
+        return NULL;
+    }
+    *n_bytes = size;
+    return data;
+}
+
+static void *writer_thread(void *arg) {
+    CheckpointWriter *w = arg;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->pending < 0 && !w->stop) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        if (w->pending < 0) {
+            break;
+        }
+        int idx = w->pending;
+        w->pending = -1;
+        w->writing = idx;
+        pthread_mutex_unlock(&w->lock);
+        uint64_t start = trace_begin();
+        int rc = checkpoint_write(w->path, w->buffers[idx], w->sizes[idx]);
+        trace_end("checkpoint_write", -1, start);
+        pthread_mutex_lock(&w->lock);
+        w->writing = -1;
+        if (rc != 0) {
+            w->error = rc;
+        }
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// snapshots of up to capacity bytes are written to path
+CheckpointWriter *create_checkpoint_writer(const char *path,
+                                           size_t capacity) {
+    assert(path);
+    assert(strlen(path) < CHECKPOINT_PATH_LEN);
+    CheckpointWriter *w = calloc(1, sizeof(CheckpointWriter));
+    if (w == NULL) {
+        return NULL;
+    }
+    snprintf(w->path, sizeof(w->path), "%s", path);
+    w->capacity = capacity;
+    w->filling = -1;
+    w->pending = -1;
+    w->writing = -1;
+    w->buffers[0] = malloc(capacity > 0 ? capacity : 1);
+    w->buffers[1] = malloc(capacity > 0 ? capacity : 1);
+    if (w->buffers[0] == NULL || w->buffers[1] == NULL) {
+        free(w->buffers[0]);
+        free(w->buffers[1]);
+        free(w);
+        return NULL;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    if (pthread_create(&w->thread, NULL, writer_thread, w) != 0) {
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->cond);
+        free(w->buffers[0]);
+        free(w->buffers[1]);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+// finishes the pending write before tearing the thread down
+void destroy_checkpoint_writer(CheckpointWriter *w) {
+    assert(w);
+    pthread_mutex_lock(&w->lock);
+    w->stop = true;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    free(w->buffers[0]);
+    free(w->buffers[1]);
+    free(w);
+}
+
+// a buffer of capacity bytes that the thread is not writing, never blocks.
+// A snapshot still waiting in it is dropped in favour of the new one
+void *checkpoint_writer_begin(CheckpointWriter *w) {
+    assert(w);
+    pthread_mutex_lock(&w->lock);
+    assert(w->filling < 0);
+    int idx = w->writing == 0 ? 1 : 0;
+    if (w->pending == idx) {
+        w->pending = -1;
+    }
+    w->filling = idx;
+    pthread_mutex_unlock(&w->lock);
+    return w->buffers[idx];
+}
+
+// hands the first n_bytes of the buffer from checkpoint_writer_begin to
+// the writer thread
+void checkpoint_writer_commit(CheckpointWriter *w, size_t n_bytes) {
+    assert(w);
+    assert(n_bytes <= w->capacity);
+    pthread_mutex_lock(&w->lock);
+    assert(w->filling >= 0);
+    w->sizes[w->filling] = n_bytes;
+    w->pending = w->filling;
+    w->filling = -1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+size_t checkpoint_writer_get_capacity(const CheckpointWriter *w) {
+    assert(w);
+    return w->capacity;
+}
+
+// blocks until every committed snapshot is on disk, returns 0 or -1 when
+// any write failed
+int checkpoint_writer_wait(CheckpointWriter *w) {
+    assert(w);
+    pthread_mutex_lock(&w->lock);
+    while (w->pending >= 0 || w->writing >= 0) {
+        pthread_cond_wait(&w->cond, &w->lock);
+    }
+    int error = w->error;
+    pthread_mutex_unlock(&w->lock);
+    return error;
+}
@@ -0,0 +1,28 @@
+#ifndef _CHECKPOINT_HEADER_
+#define _CHECKPOINT_HEADER_
+
+#include <stddef.h>
+
+// Writes snapshots to disk on a background thread. The caller fills one
+// of two buffers while the other is being written, so taking a snapshot
+// costs a copy into memory. A snapshot committed while an older one still
+// waits for the thread replaces it, only the newest is written.
+typedef struct checkpoint_writer CheckpointWriter;
+
+CheckpointWriter *create_checkpoint_writer(const char *path, size_t capacity);
+
+void destroy_checkpoint_writer(CheckpointWriter *w);
+
+void *checkpoint_writer_begin(CheckpointWriter *w);
+
+void checkpoint_writer_commit(CheckpointWriter *w, size_t n_bytes);
+
+int checkpoint_writer_wait(CheckpointWriter *w);
+
+size_t checkpoint_writer_get_capacity(const CheckpointWriter *w);
+
+int checkpoint_write(const char *path, const void *data, size_t n_bytes);
+
+void *checkpoint_read(const char *path, size_t *n_bytes);
+
+#endif
@@ -5,4 +5,12 @@
 
 // #define DEBUG
 
+// back matrices of 2MB and more with huge pages (MAP_HUGETLB or
+// madvise(MADV_HUGEPAGE) on Linux)
+// #define HUGE_PAGES
+
+// read_csv keeps a binary copy of every CSV it parses next to it
+// (data.csv.cache) and maps that on later reads of the unchanged file
+#define CSV_CACHE
+
 #endif
\ No newline at end of file
@@ -0,0 +1,198 @@
+#include <assert.h>
+#include <stddef.h>
+#include <memory.h>
+
+#include "conv.h"
+#include "simd_neon.h"
+
+ConvShape make_conv_shape(int channels, int height, int width, int kernel,
+                          int stride, int padding) {
+    assert(channels > 0);
+    assert(kernel > 0);
+    assert(stride > 0);
+    assert(padding >= 0);
+    assert(height + 2 * padding >= kernel);
+    assert(width + 2 * padding >= kernel);
+    ConvShape s = {
+        .channels = channels,
+        .height = height,
+        .width = width,
+        .kernel = kernel,
+        .stride = stride,
+        .padding = padding,
+        .out_height = (height + 2 * padding - kernel) / stride + 1,
+        .out_width = (width + 2 * padding - kernel) / stride + 1,
+    };
+    return s;
+}
+
+int conv_shape_get_n_input(const ConvShape *s) {
+    assert(s);
+    return s->height * s->width * s->channels;
+}
+
+int conv_shape_get_n_patches(const ConvShape *s) {
+    assert(s);
+    return s->out_height * s->out_width;
+}
+
+int conv_shape_get_patch_size(const ConvShape *s) {
+    assert(s);
+    return s->kernel * s->kernel * s->channels;
+}
+
+// writes one row per output pixel holding its receptive field in
+// (ky, kx, c) order, zero filled where the window hangs over the padding
+void conv_im2row(float *patches, const float *image, const ConvShape *s) {
+    assert(patches);
+    assert(image);
+    assert(s);
+    int c = s->channels;
+    int k = s->kernel;
+    size_t pixel_size = sizeof(float) * c;
+    for (int oy = 0; oy < s->out_height; oy++) {
+        for (int ox = 0; ox < s->out_width; ox++) {
+            float *row = &patches[(oy * s->out_width + ox) * k * k * c];
+            for (int ky = 0; ky < k; ky++) {
+                int iy = oy * s->stride - s->padding + ky;
+                for (int kx = 0; kx < k; kx++) {
+                    int ix = ox * s->stride - s->padding + kx;
+                    float *dst = &row[(ky * k + kx) * c];
+                    if (iy < 0 || iy >= s->height || ix < 0 ||
+                        ix >= s->width) {
+                        memset(dst, 0, pixel_size);
+                    } else {
+                        memcpy(dst, &image[(iy * s->width + ix) * c],
+                               pixel_size);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// inverse of conv_im2row: accumulates every patch entry back onto the
+// pixel it was copied from, d_image must be zeroed by the caller
+void conv_row2im(float *d_image, const float *d_patches, const ConvShape *s) {
+    assert(d_image);
+    assert(d_patches);
+    assert(s);
+    int c = s->channels;
+    int k = s->kernel;
+    for (int oy = 0; oy < s->out_height; oy++) {
+        for (int ox = 0; ox < s->out_width; ox++) {
+            const float *row = &d_patches[(oy * s->out_width + ox) * k * k * c];
+            for (int ky = 0; ky < k; ky++) {
+                int iy = oy * s->stride - s->padding + ky;
+                if (iy < 0 || iy >= s->height) {
+                    continue;
+                }
+                for (int kx = 0; kx < k; kx++) {
+                    int ix = ox * s->stride - s->padding + kx;
+                    if (ix < 0 || ix >= s->width) {
+                        continue;
+                    }
+                    float *dst = &d_image[(iy * s->width + ix) * c];
+                    float_add(dst, dst, &row[(ky * k + kx) * c], c);
+                }
+            }
+        }
+    }
+}
+
+// argmax may be NULL when no backward pass follows
+void max_pool_forward(float *output, int *argmax, const float *input,
+                      const ConvShape *s) {
+    assert(output);
+    assert(input);
+    assert(s);
+    assert(s->padding == 0);
+    int c = s->channels;
+    for (int oy = 0; oy < s->out_height; oy++) {
+        for (int ox = 0; ox < s->out_width; ox++) {
+            int out_i = (oy * s->out_width + ox) * c;
+            int first = (oy * s->stride * s->width + ox * s->stride) * c;
+            for (int ch = 0; ch < c; ch++) {
+                output[out_i + ch] = input[first + ch];
+                if (argmax) {
+                    argmax[out_i + ch] = first + ch;
+                }
+            }
+            for (int ky = 0; ky < s->kernel; ky++) {
+                for (int kx = 0; kx < s->kernel; kx++) {
+                    int iy = oy * s->stride + ky;
+                    int ix = ox * s->stride + kx;
+                    int in_i = (iy * s->width + ix) * c;
+                    for (int ch = 0; ch < c; ch++) {
+                        if (input[in_i + ch] > output[out_i + ch]) {
+                            output[out_i + ch] = input[in_i + ch];
+                            if (argmax) {
+                                argmax[out_i + ch] = in_i + ch;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// routes each output gradient to the input that won the max,
+// d_input must be zeroed by the caller
+void max_pool_backward(float *d_input, const float *delta, const int *argmax,
+                       const ConvShape *s) {
+    assert(d_input);
+    assert(delta);
+    assert(argmax);
+    assert(s);
+    int n = conv_shape_get_n_patches(s) * s->channels;
+    for (int i = 0; i < n; i++) {
+        d_input[argmax[i]] += delta[i];
+    }
+}
+
+void avg_pool_forward(float *output, const float *input, const ConvShape *s) {
+    assert(output);
+    assert(input);
+    assert(s);
+    assert(s->padding == 0);
+    int c = s->channels;
+    float scale = 1.0f / (s->kernel * s->kernel);
+    for (int oy = 0; oy < s->out_height; oy++) {
+        for (int ox = 0; ox < s->out_width; ox++) {
+            float *out = &output[(oy * s->out_width + ox) * c];
+            memset(out, 0, sizeof(float) * c);
+            for (int ky = 0; ky < s->kernel; ky++) {
+                for (int kx = 0; kx < s->kernel; kx++) {
+                    int iy = oy * s->stride + ky;
+                    int ix = ox * s->stride + kx;
+                    float_axpy(out, &input[(iy * s->width + ix) * c], scale,
+                               c);
+                }
+            }
+        }
+    }
+}
+
+// spreads each output gradient evenly over its window,
+// d_input must be zeroed by the caller
+void avg_pool_backward(float *d_input, const float *delta, const ConvShape *s) {
+    assert(d_input);
+    assert(delta);
+    assert(s);
+    int c = s->channels;
+    float scale = 1.0f / (s->kernel * s->kernel);
+    for (int oy = 0; oy < s->out_height; oy++) {
+        for (int ox = 0; ox < s->out_width; ox++) {
+            const float *d_out = &delta[(oy * s->out_width + ox) * c];
+            for (int ky = 0; ky < s->kernel; ky++) {
+                for (int kx = 0; kx < s->kernel; kx++) {
+                    int iy = oy * s->stride + ky;
+                    int ix = ox * s->stride + kx;
+                    float_axpy(&d_input[(iy * s->width + ix) * c], d_out,
+                               scale, c);
+                }
+            }
+        }
+    }
+}
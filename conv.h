@@ -0,0 +1,40 @@
+#ifndef _CONV_HEADER_
+#define _CONV_HEADER_
+
+// Images are flattened in HWC order: element (y, x, c) lives at
+// (y * width + x) * channels + c, so every pixel's channels are contiguous.
+typedef struct conv_shape {
+    int channels;
+    int height;
+    int width;
+    int kernel;
+    int stride;
+    int padding;
+    int out_height;
+    int out_width;
+} ConvShape;
+
+ConvShape make_conv_shape(int channels, int height, int width, int kernel,
+                          int stride, int padding);
+
+int conv_shape_get_n_input(const ConvShape *s);
+
+int conv_shape_get_n_patches(const ConvShape *s);
+
+int conv_shape_get_patch_size(const ConvShape *s);
+
+void conv_im2row(float *patches, const float *image, const ConvShape *s);
+
+void conv_row2im(float *d_image, const float *d_patches, const ConvShape *s);
+
+void max_pool_forward(float *output, int *argmax, const float *input,
+                      const ConvShape *s);
+
+void max_pool_backward(float *d_input, const float *delta, const int *argmax,
+                       const ConvShape *s);
+
+void avg_pool_forward(float *output, const float *input, const ConvShape *s);
+
+void avg_pool_backward(float *d_input, const float *delta, const ConvShape *s);
+
+#endif
@@ -1,14 +1,30 @@
+// strdup, getline, mmap and stat under -std=c11
+#ifndef __APPLE__
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "csv.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <memory.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
-// TODO: Currently supports only numeric csv
+#include <math.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "trace.h"
+// TODO: Currently supports only numeric csv, strings only in the
+// categorical columns of read_csv_hashed
 // TODO: Does not support commas in a cell
 
 #define da_append(vals, val)                                           \
@@ -33,6 +49,15 @@ typedef struct {
   float *items;
   int count;
   int capacity;
+  // items point into the mapped cache file
+  bool mapped;
+  // running statistics of the first stats_n items, Welford's mean and
+  // sum of squared deviations
+  int stats_n;
+  double mean;
+  double m2;
+  float min;
+  float max;
 } ColumnDA;
 
 typedef struct csv {
@@ -41,9 +66,43 @@ typedef struct csv {
   int count;
   int capacity;
   int n_rows;
+  // the cache file the columns were loaded from, NULL after parsing
+  void *map;
+  size_t map_size;
+  // n_hashed categorical columns per row, hashed into n_buckets: row i
+  // holds bucket hashed_indices[i * n_hashed + k] with sign
+  // hashed_signs[i * n_hashed + k]
+  int n_hashed;
+  int n_buckets;
+  int *hashed_indices;
+  float *hashed_signs;
+  int hashed_capacity;
 } CSV;
 
 static const int DEFAULT_CAP = 256;
+// rows parsed per csv_parse region of a trace
+#define TRACE_CHUNK_ROWS 65536
+
+#define CACHE_MAGIC "NNCS"
+#define CACHE_VERSION 1
+#define CACHE_SUFFIX ".cache"
+// columns start on cache lines, so they can be read as aligned vectors
+#define CACHE_ALIGN 64
+
+// followed by the column names, each NUL terminated, and from
+// data_offset on by the columns, n_rows floats each padded with zeros to
+// a multiple of CACHE_ALIGN bytes
+typedef struct {
+  char magic[4];
+  int32_t version;
+  int32_t n_rows;
+  int32_t n_cols;
+  // the CSV the cache was made from, a different size or mtime makes it
+  // stale
+  int64_t source_size;
+  int64_t source_mtime;
+  int64_t data_offset;
+} CacheHeader;
 
 static char *make_col_name(const char *prefix, int number) {
     assert(prefix);
@@ -71,6 +130,10 @@ static ColumnDA *create_column(const char *name_str, int capacity) {
   col->capacity = capacity;
   col->col_name_str = strdup(name_str);
   col->count = 0;
+  col->mapped = false;
+  col->stats_n = 0;
+  col->mean = 0;
+  col->m2 = 0;
   if (col->col_name_str == NULL) {
     free(data);
     free(col->col_name_str);
@@ -80,9 +143,50 @@ static ColumnDA *create_column(const char *name_str, int capacity) {
   return col;
 }
 
+// a column over n floats of the mapped cache
+static ColumnDA *create_mapped_column(const char *name_str, float *items,
+                                      int n) {
+  assert(name_str);
+  ColumnDA *col = malloc(sizeof(ColumnDA));
+  if (col == NULL) {
+    return NULL;
+  }
+  col->col_name_str = strdup(name_str);
+  if (col->col_name_str == NULL) {
+    free(col);
+    return NULL;
+  }
+  col->items = items;
+  col->count = n;
+  col->capacity = n;
+  col->mapped = true;
+  col->stats_n = 0;
+  col->mean = 0;
+  col->m2 = 0;
+  return col;
+}
+
+static void stats_add(int *n, double *mean, double *m2, float *min,
+                      float *max, float value) {
+  if (*n == 0) {
+    *min = value;
+    *max = value;
+  } else if (value < *min) {
+    *min = value;
+  } else if (value > *max) {
+    *max = value;
+  }
+  (*n)++;
+  double delta = value - *mean;
+  *mean += delta / *n;
+  *m2 += delta * (value - *mean);
+}
+
 static void destroy_column(ColumnDA *col) {
   assert(col);
-  free(col->items);
+  if (!col->mapped) {
+    free(col->items);
+  }
   free(col->col_name_str);
   free(col);
 }
@@ -103,6 +207,13 @@ static CSV *create_csv(const char *filename_str, int capacity) {
   csv->capacity = capacity;
   csv->count = 0;
   csv->n_rows = 0;
+  csv->map = NULL;
+  csv->map_size = 0;
+  csv->n_hashed = 0;
+  csv->n_buckets = 0;
+  csv->hashed_indices = NULL;
+  csv->hashed_signs = NULL;
+  csv->hashed_capacity = 0;
   csv->filename_str = strdup(filename_str);
   if (csv->filename_str == NULL) {
     free(columns);
@@ -120,6 +231,11 @@ void destroy_csv(CSV *csv) {
   }
   free(csv->items);
   free(csv->filename_str);
+  if (csv->map) {
+    munmap(csv->map, csv->map_size);
+  }
+  free(csv->hashed_indices);
+  free(csv->hashed_signs);
   free(csv);
 }
 
@@ -175,32 +291,109 @@ static char *trim(char *str) {
   return str;
 }
 
-static int parse_line(CSV *csv, FILE *csv_file) {
+// how the fields of a line are stored: field i goes to column cols[i]
+// or, with slots[i] >= 0, is hashed into that slot of the row. Fields
+// with neither are skipped without being converted
+typedef struct {
+  int *cols;
+  int *slots;
+  int n_fields;
+  const char *const *slot_names;
+} FieldMap;
+
+// FNV-1a over the column name and the value, so equal values of two
+// columns land in different buckets
+static uint32_t hash_feature(const char *col_name_str, const char *value) {
+  uint32_t hash = 2166136261u;
+  for (const char *c = col_name_str; *c; c++) {
+    hash = (hash ^ (unsigned char) *c) * 16777619u;
+  }
+  hash = (hash ^ 0x1f) * 16777619u;
+  for (const char *c = value; *c; c++) {
+    hash = (hash ^ (unsigned char) *c) * 16777619u;
+  }
+  return hash;
+}
+
+// room for the hashed slots of one more row, zero until a field fills
+// them so a missing cell adds nothing
+static int grow_hashed(CSV *csv) {
+  if (csv->n_rows < csv->hashed_capacity) {
+    return 0;
+  }
+  int capacity = csv->hashed_capacity ? csv->hashed_capacity * 2
+                                      : DEFAULT_CAP;
+  size_t n = (size_t) capacity * csv->n_hashed;
+  int *indices = realloc(csv->hashed_indices, sizeof(int) * n);
+  if (indices == NULL) {
+    return -1;
+  }
+  csv->hashed_indices = indices;
+  float *signs = realloc(csv->hashed_signs, sizeof(float) * n);
+  if (signs == NULL) {
+    return -1;
+  }
+  csv->hashed_signs = signs;
+  size_t used = (size_t) csv->hashed_capacity * csv->n_hashed;
+  memset(indices + used, 0, sizeof(int) * (n - used));
+  memset(signs + used, 0, sizeof(float) * (n - used));
+  csv->hashed_capacity = capacity;
+  return 0;
+}
+
+// map NULL stores every field in its column
+static int parse_line(CSV *csv, FILE *csv_file, const FieldMap *map) {
   assert(csv_file);
   assert(csv);
   char *buffer = csv_read_line(csv_file);
   if (buffer == NULL) {
     return -1;
   }
+  if (csv->n_hashed > 0 && grow_hashed(csv) != 0) {
+    free(buffer);
+    return 1;
+  }
+  int n_fields = map ? map->n_fields : csv->count;
   char *cell_value = strtok(buffer, ",");
   int i = 0;
   while (cell_value != NULL) {
-    if (i >= csv->count) {
+    if (i >= n_fields) {
       break;
     }
-    ColumnDA *current_col = csv->items[i];
+    int col_i = map ? map->cols[i] : i;
+    int slot = map && map->slots ? map->slots[i] : -1;
+    if (slot >= 0) {
+      cell_value = trim(cell_value);
+      uint32_t hash = hash_feature(map->slot_names[slot], cell_value);
+      size_t k = (size_t) csv->n_rows * csv->n_hashed + slot;
+      csv->hashed_indices[k] = (hash & 0x7fffffff) % csv->n_buckets;
+      // the top bit picks the sign, collisions then cancel out on average
+      csv->hashed_signs[k] = hash >> 31 ? -1.0f : 1.0f;
+    }
+    if (col_i < 0) {
+      cell_value = strtok(NULL, ",");
+      i++;
+      continue;
+    }
+    ColumnDA *current_col = csv->items[col_i];
     char *endptr = NULL;
     cell_value = trim(cell_value);
     float value = strtof(cell_value, &endptr);
     if (*endptr != '\0') {
-      free(buffer);
       #ifndef DEBUG
         printf("[DEBUG] Could not convert the cell: '%s'\n", cell_value);
         printf("[DEBUG] (int) *endptr: %d\n", *endptr);
       #endif
+      free(buffer);
       return 1;
     }
     da_append(current_col, value);
+    // gathered while the value is in a register, fitting a scaler later
+    // does not read the column again
+    if (current_col->stats_n == current_col->count - 1) {
+      stats_add(&current_col->stats_n, &current_col->mean, &current_col->m2,
+                &current_col->min, &current_col->max, value);
+    }
     cell_value = strtok(NULL, ",");
     i++;
   }
@@ -208,8 +401,121 @@ static int parse_line(CSV *csv, FILE *csv_file) {
   return 0;
 }
 
-CSV *read_csv(const char *filename_str) {
-  assert(filename_str);
+// the columns a read keeps, by name or by index, in the order they are
+// stored in
+typedef struct {
+  const char *const *names;
+  const int *indices;
+  int n;
+} Projection;
+
+// keeps the projected columns of csv in projection order and destroys
+// the others. Returns the field to column map parse_line takes, or NULL
+// when a column does not exist or is asked for twice
+static int *project_columns(CSV *csv, const Projection *p) {
+  int n_fields = csv->count;
+  int *field_cols = malloc(sizeof(int) * n_fields);
+  ColumnDA **kept = malloc(sizeof(ColumnDA *) * (p->n > 0 ? p->n : 1));
+  if (field_cols == NULL || kept == NULL) {
+    free(field_cols);
+    free(kept);
+    return NULL;
+  }
+  for (int i = 0; i < n_fields; i++) {
+    field_cols[i] = -1;
+  }
+  for (int k = 0; k < p->n; k++) {
+    int field = p->names ? 0 : p->indices[k];
+    if (p->names) {
+      while (field < n_fields &&
+             strcmp(p->names[k], csv->items[field]->col_name_str) != 0) {
+        field++;
+      }
+    }
+    if (field < 0 || field >= n_fields || field_cols[field] >= 0) {
+      fprintf(stderr, "[ERROR] Column %d of the projection not found\n", k);
+      free(field_cols);
+      free(kept);
+      return NULL;
+    }
+    field_cols[field] = k;
+    kept[k] = csv->items[field];
+  }
+  for (int i = 0; i < n_fields; i++) {
+    if (field_cols[i] < 0) {
+      destroy_column(csv->items[i]);
+    }
+  }
+  memcpy(csv->items, kept, sizeof(ColumnDA *) * p->n);
+  csv->count = p->n;
+  free(kept);
+  return field_cols;
+}
+
+// the categorical columns of a hashed read and the number of buckets
+// their values are hashed into
+typedef struct {
+  const char *const *names;
+  int n;
+  int n_buckets;
+} Hashing;
+
+// takes the categorical columns out of the dense ones, which keep their
+// file order, and fills map. Returns -1 when a categorical column does
+// not exist or is named twice
+static int hash_columns(CSV *csv, const Hashing *h, FieldMap *map) {
+  int n_fields = csv->count;
+  int *slots = malloc(sizeof(int) * n_fields);
+  int *dense = malloc(sizeof(int) * n_fields);
+  if (slots == NULL || dense == NULL) {
+    free(slots);
+    free(dense);
+    return -1;
+  }
+  for (int i = 0; i < n_fields; i++) {
+    slots[i] = -1;
+  }
+  for (int k = 0; k < h->n; k++) {
+    int field = 0;
+    while (field < n_fields &&
+           strcmp(h->names[k], csv->items[field]->col_name_str) != 0) {
+      field++;
+    }
+    if (field == n_fields || slots[field] >= 0) {
+      fprintf(stderr, "[ERROR] Categorical column %s not found\n",
+              h->names[k]);
+      free(slots);
+      free(dense);
+      return -1;
+    }
+    slots[field] = k;
+  }
+  int n_dense = 0;
+  for (int i = 0; i < n_fields; i++) {
+    if (slots[i] < 0) {
+      dense[n_dense++] = i;
+    }
+  }
+  Projection p = {.indices = dense, .n = n_dense};
+  map->cols = project_columns(csv, &p);
+  free(dense);
+  if (map->cols == NULL) {
+    free(slots);
+    return -1;
+  }
+  map->slots = slots;
+  map->slot_names = h->names;
+  csv->n_hashed = h->n;
+  csv->n_buckets = h->n_buckets;
+  return 0;
+}
+
+// with a projection only its columns are converted and stored, the
+// other fields are skipped and the rest of a line after the last one
+// is not looked at. With hashing the categorical fields are hashed
+// instead of converted
+static CSV *parse_csv(const char *filename_str, const Projection *p,
+                      const Hashing *h) {
   FILE *csv_file = fopen(filename_str, "r");
   if (csv_file == NULL) {
     fprintf(stderr, "[ERROR] %s (errno: %d)\n", strerror(errno), errno);
@@ -222,20 +528,356 @@ CSV *read_csv(const char *filename_str) {
     fprintf(stderr, "[ERROR] Could not parse header\n");
     return NULL;
   }
+  FieldMap map = {.n_fields = csv->count};
+  bool ok = true;
+  if (p) {
+    map.cols = project_columns(csv, p);
+    ok = map.cols != NULL;
+  } else if (h) {
+    ok = hash_columns(csv, h, &map) == 0;
+  }
+  if (!ok) {
+    destroy_csv(csv);
+    fclose(csv_file);
+    return NULL;
+  }
+  while (map.n_fields > 0 && map.cols && map.cols[map.n_fields - 1] < 0 &&
+         (map.slots == NULL || map.slots[map.n_fields - 1] < 0)) {
+    map.n_fields--;
+  }
   int result = 0;
-  while ((result = parse_line(csv, csv_file)) != -1) {
+  uint64_t start = trace_begin();
+  while ((result = parse_line(csv, csv_file, map.cols ? &map : NULL)) != -1) {
     if (result == 1) {
       destroy_csv(csv);
       fclose(csv_file);
+      free(map.cols);
+      free(map.slots);
       fprintf(stderr, "[ERROR] Found invalid data\n");
       return NULL;
     }
     csv->n_rows++;
+    if (csv->n_rows % TRACE_CHUNK_ROWS == 0) {
+      trace_end("csv_parse", csv->n_rows / TRACE_CHUNK_ROWS - 1, start);
+      start = trace_begin();
+    }
   }
+  trace_end("csv_parse", csv->n_rows / TRACE_CHUNK_ROWS, start);
   fclose(csv_file);
+  free(map.cols);
+  free(map.slots);
   return csv;
 }
 
+static size_t align_up(size_t n) {
+  return (n + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+}
+
+static char *make_cache_path(const char *filename_str, const char *suffix) {
+  size_t len = strlen(filename_str) + strlen(suffix) + 1;
+  char *path = malloc(len);
+  if (path) {
+    snprintf(path, len, "%s%s", filename_str, suffix);
+  }
+  return path;
+}
+
+static bool source_stat(const char *filename_str, int64_t *size,
+                        int64_t *mtime) {
+  struct stat st;
+  if (stat(filename_str, &st) != 0) {
+    return false;
+  }
+  *size = (int64_t) st.st_size;
+  // in nanoseconds, an edit within the same second still counts
+#ifdef __APPLE__
+  *mtime = (int64_t) st.st_mtimespec.tv_sec * 1000000000 +
+           st.st_mtimespec.tv_nsec;
+#else
+  *mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+  return true;
+}
+
+// maps the cache and lets the columns point into it, NULL when it is
+// missing, stale or damaged
+static CSV *load_csv_cache(const char *filename_str, const char *path,
+                           int64_t size, int64_t mtime) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(CacheHeader)) {
+    close(fd);
+    return NULL;
+  }
+  size_t map_size = (size_t) st.st_size;
+  // private, so writes to the columns never reach the file
+  char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                   0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+  const CacheHeader *header = (const CacheHeader *) map;
+  size_t stride = align_up(sizeof(float) * (size_t) header->n_rows);
+  bool ok = memcmp(header->magic, CACHE_MAGIC, 4) == 0 &&
+            header->version == CACHE_VERSION && header->n_rows >= 0 &&
+            header->n_cols > 0 && header->source_size == size &&
+            header->source_mtime == mtime &&
+            header->data_offset >= (int64_t) sizeof(CacheHeader) &&
+            header->data_offset % CACHE_ALIGN == 0 &&
+            (size_t) header->data_offset +
+            stride * (size_t) header->n_cols == map_size;
+  int n_cols = ok ? header->n_cols : 0;
+  CSV *csv = ok ? create_csv(filename_str,
+                             n_cols > DEFAULT_CAP ? n_cols : DEFAULT_CAP)
+                : NULL;
+  if (csv == NULL) {
+    munmap(map, map_size);
+    return NULL;
+  }
+  csv->map = map;
+  csv->map_size = map_size;
+  csv->n_rows = header->n_rows;
+  const char *name = map + sizeof(CacheHeader);
+  const char *names_end = map + header->data_offset;
+  for (int i = 0; i < n_cols; i++) {
+    const char *name_end = memchr(name, '\0', names_end - name);
+    float *items = (float *) (map + header->data_offset + stride * i);
+    ColumnDA *col = name_end ? create_mapped_column(name, items,
+                                                    header->n_rows)
+                             : NULL;
+    if (col == NULL) {
+      destroy_csv(csv);
+      return NULL;
+    }
+    da_append(csv, col);
+    name = name_end + 1;
+  }
+  return csv;
+}
+
+// writes next to the source and renames into place, so a reader never
+// maps a half written cache. The temporary name carries the process id
+// and a counter, processes and threads caching the same file at once
+// each write their own and the last rename wins. Failing is harmless,
+// the next read parses the CSV again
+static void write_csv_cache(const CSV *csv, const char *path, int64_t size,
+                            int64_t mtime) {
+  static atomic_uint n_written;
+  char suffix[48];
+  snprintf(suffix, sizeof(suffix), ".%ld.%u.tmp", (long) getpid(),
+           atomic_fetch_add(&n_written, 1));
+  char *tmp_path = make_cache_path(path, suffix);
+  if (tmp_path == NULL) {
+    return;
+  }
+  // O_EXCL never appends to a file some other writer left behind
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+  FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+  if (f == NULL) {
+    if (fd >= 0) {
+      close(fd);
+      remove(tmp_path);
+    }
+    free(tmp_path);
+    return;
+  }
+  size_t names_size = 0;
+  for (int i = 0; i < csv->count; i++) {
+    names_size += strlen(csv->items[i]->col_name_str) + 1;
+  }
+  CacheHeader header = {
+    .magic = CACHE_MAGIC,
+    .version = CACHE_VERSION,
+    .n_rows = csv->n_rows,
+    .n_cols = csv->count,
+    .source_size = size,
+    .source_mtime = mtime,
+    .data_offset = (int64_t) align_up(sizeof(CacheHeader) + names_size),
+  };
+  static const char zeros[CACHE_ALIGN];
+  size_t bytes = sizeof(float) * (size_t) csv->n_rows;
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+  for (int i = 0; ok && i < csv->count; i++) {
+    const char *name = csv->items[i]->col_name_str;
+    ok = fwrite(name, strlen(name) + 1, 1, f) == 1;
+  }
+  size_t pad = header.data_offset - sizeof(CacheHeader) - names_size;
+  ok = ok && fwrite(zeros, 1, pad, f) == pad;
+  for (int i = 0; ok && i < csv->count; i++) {
+    pad = align_up(bytes) - bytes;
+    ok = fwrite(csv->items[i]->items, 1, bytes, f) == bytes &&
+         fwrite(zeros, 1, pad, f) == pad;
+  }
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(tmp_path, path) != 0) {
+    remove(tmp_path);
+  }
+  free(tmp_path);
+}
+
+// A projected read takes its columns from a cache of the whole file when
+// there is one, the pages of the other columns are never touched. It
+// does not write a cache itself, that would only hold some columns. The
+// cache only holds numbers, a hashed read always parses
+static CSV *load_csv(const char *filename_str, const Projection *p,
+                     const Hashing *h) {
+  if (h) {
+    return parse_csv(filename_str, NULL, h);
+  }
+#ifdef CSV_CACHE
+  int64_t size = 0;
+  int64_t mtime = 0;
+  char *path = source_stat(filename_str, &size, &mtime)
+               ? make_cache_path(filename_str, CACHE_SUFFIX)
+               : NULL;
+  uint64_t start = trace_begin();
+  CSV *cached = path ? load_csv_cache(filename_str, path, size, mtime)
+                     : NULL;
+  trace_end("csv_cache_load", -1, start);
+  if (cached) {
+    free(path);
+    int *field_cols = p ? project_columns(cached, p) : NULL;
+    if (p && field_cols == NULL) {
+      destroy_csv(cached);
+      return NULL;
+    }
+    free(field_cols);
+    return cached;
+  }
+#endif
+  CSV *csv = parse_csv(filename_str, p, NULL);
+#ifdef CSV_CACHE
+  if (csv && path && p == NULL) {
+    start = trace_begin();
+    write_csv_cache(csv, path, size, mtime);
+    trace_end("csv_cache_write", -1, start);
+  }
+  free(path);
+#endif
+  return csv;
+}
+
+// parses a numeric CSV. With CSV_CACHE the columns are also written to
+// filename_str.cache the first time, and later reads of the unchanged
+// file map that instead of parsing the text again
+CSV *read_csv(const char *filename_str) {
+  assert(filename_str);
+  return load_csv(filename_str, NULL, NULL);
+}
+
+// reads only the named columns, in the order given. Fields of other
+// columns are skipped without being converted, so parse time and memory
+// follow the columns kept. NULL when a name is not in the header
+CSV *read_csv_cols(const char *filename_str, const char *const *col_names_str,
+                   int cols_len) {
+  assert(filename_str);
+  assert(col_names_str);
+  assert(cols_len > 0);
+  Projection p = {.names = col_names_str, .n = cols_len};
+  return load_csv(filename_str, &p, NULL);
+}
+
+// read_csv_cols with zero based column positions instead of names
+CSV *read_csv_col_indices(const char *filename_str, const int *col_indices,
+                          int cols_len) {
+  assert(filename_str);
+  assert(col_indices);
+  assert(cols_len > 0);
+  Projection p = {.indices = col_indices, .n = cols_len};
+  return load_csv(filename_str, &p, NULL);
+}
+
+// reads a CSV whose named columns hold categories, as strings or
+// numbers. Each of their values is hashed with its column name into one
+// of n_buckets buckets and a sign instead of being converted, the other
+// columns are read as numbers. The categorical columns are not columns of
+// the result, csv_hashed_as_sparse and csv_get_hashed_* return them.
+// NULL when a categorical column is not in the header
+CSV *read_csv_hashed(const char *filename_str,
+                     const char *const *cat_names_str, int cat_len,
+                     int n_buckets) {
+  assert(filename_str);
+  assert(cat_names_str);
+  assert(cat_len > 0);
+  assert(n_buckets > 0);
+  Hashing h = {.names = cat_names_str, .n = cat_len, .n_buckets = n_buckets};
+  return load_csv(filename_str, NULL, &h);
+}
+
+int csv_get_n_hashed(const CSV *csv) {
+  assert(csv);
+  return csv->n_hashed;
+}
+
+int csv_get_n_buckets(const CSV *csv) {
+  assert(csv);
+  return csv->n_buckets;
+}
+
+// the csv_get_n_hashed buckets of row row_i, one per categorical column
+// in the order they were named
+const int *csv_get_hashed_indices(const CSV *csv, int row_i) {
+  assert(csv);
+  assert(csv->n_hashed > 0);
+  assert(csv->n_rows > row_i && row_i >= 0);
+  return &csv->hashed_indices[(size_t) row_i * csv->n_hashed];
+}
+
+// +1 or -1 for every bucket of the row, 0 where its cell was missing
+const float *csv_get_hashed_signs(const CSV *csv, int row_i) {
+  assert(csv);
+  assert(csv->n_hashed > 0);
+  assert(csv->n_rows > row_i && row_i >= 0);
+  return &csv->hashed_signs[(size_t) row_i * csv->n_hashed];
+}
+
+// the hashed features as an n_rows x n_buckets matrix, signs of one row
+// that share a bucket are summed and missing cells left out
+SparseMatrix *csv_hashed_as_sparse(const CSV *csv) {
+  assert(csv);
+  assert(csv->n_hashed > 0);
+  int n_rows = csv->n_rows;
+  int n_hashed = csv->n_hashed;
+  size_t n = (size_t) n_rows * n_hashed;
+  int *row_ptr = malloc(sizeof(int) * (n_rows + 1));
+  int *col_idx = malloc(sizeof(int) * (n > 0 ? n : 1));
+  float *values = malloc(sizeof(float) * (n > 0 ? n : 1));
+  SparseMatrix *s = NULL;
+  if (row_ptr && col_idx && values) {
+    int nnz = 0;
+    for (int i = 0; i < n_rows; i++) {
+      row_ptr[i] = nnz;
+      const int *idx = csv_get_hashed_indices(csv, i);
+      const float *signs = csv_get_hashed_signs(csv, i);
+      for (int k = 0; k < n_hashed; k++) {
+        if (signs[k] == 0) {
+          continue;
+        }
+        int j = row_ptr[i];
+        while (j < nnz && col_idx[j] != idx[k]) {
+          j++;
+        }
+        if (j == nnz) {
+          col_idx[nnz] = idx[k];
+          values[nnz++] = 0;
+        }
+        values[j] += signs[k];
+      }
+    }
+    row_ptr[n_rows] = nnz;
+    s = create_sparse_matrix_csr(n_rows, csv->n_buckets, row_ptr, col_idx,
+                                 values);
+  }
+  free(row_ptr);
+  free(col_idx);
+  free(values);
+  return s;
+}
+
 int csv_get_n_rows(const CSV *csv) {
   assert(csv);
   return csv->n_rows;
@@ -285,6 +927,19 @@ void csv_col_as_vec(Vector *v, const char *col_name_str, const CSV *csv) {
   }
 }
 
+// a view of the column without copying, NULL when there is no such
+// column. Columns read from the cache are cache line aligned
+Vector *csv_col_view(const CSV *csv, const char *col_name_str) {
+  assert(csv);
+  assert(col_name_str);
+  for (int i = 0; i < csv->count; i++) {
+    if (strcmp(col_name_str, csv->items[i]->col_name_str) == 0) {
+      return create_vector_view(csv->items[i]->items, csv->n_rows, true);
+    }
+  }
+  return NULL;
+}
+
 void csv_cols_as_mat(Matrix *m, const char *const *col_names_str, int cols_len,
                      const CSV *csv) {
   assert(m);
@@ -309,6 +964,98 @@ void csv_cols_as_mat(Matrix *m, const char *const *col_names_str, int cols_len,
   }
 }
 
+static ColumnDA *find_column(const CSV *csv, const char *col_name_str) {
+  for (int i = 0; i < csv->count; i++) {
+    if (strcmp(col_name_str, csv->items[i]->col_name_str) == 0) {
+      return csv->items[i];
+    }
+  }
+  return NULL;
+}
+
+// fits a scaler to the named columns, all columns in order when
+// col_names_str is NULL. Columns parsed from text carry their statistics
+// already, the others (cached, one-hot) take one pass. A constant column
+// is only shifted. NULL when a column does not exist
+Scaler *csv_fit_scaler(const CSV *csv, const char *const *col_names_str,
+                       int cols_len, ScaleKind kind) {
+  assert(csv);
+  int n = col_names_str ? cols_len : csv->count;
+  assert(n > 0);
+  float *offsets = malloc(sizeof(float) * n);
+  float *scales = malloc(sizeof(float) * n);
+  Scaler *s = NULL;
+  int j = 0;
+  for (; offsets && scales && j < n; j++) {
+    const ColumnDA *col = col_names_str ? find_column(csv, col_names_str[j])
+                                        : csv->items[j];
+    if (col == NULL || col->count == 0) {
+      break;
+    }
+    int stats_n = col->stats_n;
+    double mean = col->mean;
+    double m2 = col->m2;
+    float min = col->min;
+    float max = col->max;
+    for (int i = stats_n; i < col->count; i++) {
+      stats_add(&stats_n, &mean, &m2, &min, &max, col->items[i]);
+    }
+    double spread = kind == SCALE_STANDARD ? sqrt(m2 / stats_n)
+                                           : (double) max - min;
+    offsets[j] = kind == SCALE_STANDARD ? (float) mean : min;
+    scales[j] = spread > 0 ? (float) (1.0 / spread) : 1.0f;
+  }
+  if (j == n) {
+    s = create_scaler(kind, offsets, scales, n);
+  }
+  free(offsets);
+  free(scales);
+  return s;
+}
+
+// csv_cols_as_mat applying s while the columns are copied, so scaling
+// costs no pass of its own. s holds one feature per column of m
+void csv_cols_as_mat_scaled(Matrix *m, const char *const *col_names_str,
+                            int cols_len, const CSV *csv, const Scaler *s) {
+  assert(m);
+  assert(col_names_str);
+  assert(csv);
+  assert(s);
+  int n_rows = csv->n_rows;
+  assert(matrix_get_n_cols(m) == cols_len);
+  assert(matrix_get_n_rows(m) == n_rows);
+  assert(scaler_get_n(s) == cols_len);
+  for (int j = 0; j < cols_len; j++) {
+    const ColumnDA *col = find_column(csv, col_names_str[j]);
+    assert(col);
+    float offset = scaler_get_offset(s, j);
+    float scale = scaler_get_scale(s, j);
+    for (int i = 0; i < n_rows; i++) {
+      matrix_get_row_mut(m, i)[j] = (col->items[i] - offset) * scale;
+    }
+  }
+}
+
+// csv_as_matrix applying s, fitted to all columns, on the way
+void csv_as_matrix_scaled(Matrix *m, const CSV *csv, const Scaler *s) {
+  assert(m);
+  assert(csv);
+  assert(s);
+  int n_cols = csv->count;
+  int n_rows = csv->n_rows;
+  assert(matrix_get_n_cols(m) == n_cols);
+  assert(matrix_get_n_rows(m) == n_rows);
+  assert(scaler_get_n(s) == n_cols);
+  for (int j = 0; j < n_cols; j++) {
+    const float *items = csv->items[j]->items;
+    float offset = scaler_get_offset(s, j);
+    float scale = scaler_get_scale(s, j);
+    for (int i = 0; i < n_rows; i++) {
+      matrix_get_row_mut(m, i)[j] = (items[i] - offset) * scale;
+    }
+  }
+}
+
 // TODO: very inefficient
 static int *column_unique(ColumnDA *col, int *n_unique, int *rmin) {
     assert(col);
@@ -338,6 +1085,7 @@ static int *column_unique(ColumnDA *col, int *n_unique, int *rmin) {
         }
     }
     *n_unique = count - 1;
+    *rmin = min;
     free(seen);
     return map;
 }
@@ -397,6 +1145,34 @@ void csv_one_hot(CSV *csv, const char *col_name_str) {
     csv_remove_col_at(csv, encode_col_i);
 }
 
+// replaces the values of a categorical column by category indices 0, 1,
+// ... in order of first appearance, the input of an embedding layer.
+// Returns the number of categories, -1 when there is no such column or
+// when out of memory
+int csv_index_col(CSV *csv, const char *col_name_str) {
+  assert(csv);
+  assert(col_name_str);
+  ColumnDA *col = find_column(csv, col_name_str);
+  if (col == NULL) {
+    return -1;
+  }
+  int count = 0;
+  int min = 0;
+  int *map = column_unique(col, &count, &min);
+  if (map == NULL) {
+    return -1;
+  }
+  for (int i = 0; i < col->count; i++) {
+    col->items[i] = map[(int) col->items[i] - min] - 1;
+  }
+  free(map);
+  // the statistics were of the raw values
+  col->stats_n = 0;
+  col->mean = 0;
+  col->m2 = 0;
+  return count;
+}
+
 void csv_remove_col(CSV *csv, const char *col_name_str) {
   assert(csv);
   assert(col_name_str);
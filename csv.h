@@ -3,28 +3,62 @@
 
 #include "matrix.h"
 #include "vector.h"
+#include "sparse.h"
+#include "scaler.h"
 
 typedef struct csv CSV;
 
 CSV *read_csv(const char *filename_str);
 
+CSV *read_csv_cols(const char *filename_str, const char *const *col_names_str,
+                   int cols_len);
+
+CSV *read_csv_col_indices(const char *filename_str, const int *col_indices,
+                          int cols_len);
+
+CSV *read_csv_hashed(const char *filename_str,
+                     const char *const *cat_names_str, int cat_len,
+                     int n_buckets);
+
 void destroy_csv(CSV *csv);
 
 int csv_get_n_rows(const CSV *csv);
 
 int csv_get_n_cols(const CSV *csv);
 
+int csv_get_n_hashed(const CSV *csv);
+
+int csv_get_n_buckets(const CSV *csv);
+
+const int *csv_get_hashed_indices(const CSV *csv, int row_i);
+
+const float *csv_get_hashed_signs(const CSV *csv, int row_i);
+
+SparseMatrix *csv_hashed_as_sparse(const CSV *csv);
+
 void csv_row_as_vec(Vector *row, const CSV *csv, int row_i);
 
 void csv_as_matrix(Matrix *m, const CSV *csv);
 
 void csv_col_as_vec(Vector *v, const char *col_name_str, const CSV *csv);
 
+Vector *csv_col_view(const CSV *csv, const char *col_name_str);
+
 void csv_cols_as_mat(Matrix *m, const char *const *col_names_str, int cols_len,
                      const CSV *csv);
 
+Scaler *csv_fit_scaler(const CSV *csv, const char *const *col_names_str,
+                       int cols_len, ScaleKind kind);
+
+void csv_as_matrix_scaled(Matrix *m, const CSV *csv, const Scaler *s);
+
+void csv_cols_as_mat_scaled(Matrix *m, const char *const *col_names_str,
+                            int cols_len, const CSV *csv, const Scaler *s);
+
 void csv_one_hot(CSV *csv, const char *col_name_str);
 
+int csv_index_col(CSV *csv, const char *col_name_str);
+
 void csv_remove_col_at(CSV *csv, int index);
 
 void csv_remove_col(CSV *csv, const char *col_name_str);
@@ -0,0 +1,336 @@
+// sched_getaffinity and sched_setaffinity on Linux under -std=c11
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "gemv_pool.h"
+
+// spins before a waiting thread sleeps on a condition variable
+#define GEMV_SPINS 4096
+
+typedef enum {
+    GEMV_JOB_COPY,
+    GEMV_JOB_MUL,
+    GEMV_JOB_STOP,
+} GemvJob;
+
+// one thread's rows of one matrix
+typedef struct {
+    Matrix *rows;
+    // the result rows, pointed at the caller's vector by every product
+    Vector *out;
+    int first;
+} GemvShard;
+
+typedef struct {
+    int n_rows;
+    int n_cols;
+    GemvKernel kernel;
+    GemvShard *shards;
+} PoolMatrix;
+
+typedef struct {
+    struct gemv_pool *pool;
+    int index;
+} GemvWorker;
+
+struct gemv_pool {
+    int n_threads;
+    pthread_t *threads;
+    GemvWorker *workers;
+    PoolMatrix *matrices;
+    int n_matrices;
+    int capacity;
+    // the current round's job, written before round is bumped
+    GemvJob job;
+    int matrix_i;
+    const Matrix *src;
+    const Vector *v;
+    Vector *res;
+    atomic_long round;
+    // keeps the counters the caller and the threads write apart
+    char pad[64];
+    atomic_int n_done;
+    atomic_bool failed;
+    // threads that stopped spinning, woken under lock only when set
+    pthread_mutex_t lock;
+    pthread_cond_t round_cond;
+    pthread_cond_t done_cond;
+    atomic_int n_parked;
+    atomic_bool caller_parked;
+};
+
+#ifdef __linux__
+// worker index runs on the index-th CPU the process may use, so its
+// shards are first touched on that CPU's NUMA node. The first CPU is
+// left free for the caller, which computes shard 0. The caller is not
+// pinned here, as that would change its affinity for the rest of the
+// program, so shard 0 is local only if the caller pins itself there
+static void pin_to_cpu(int index) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return;
+    }
+    int seen = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        if (seen++ == index) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            sched_setaffinity(0, sizeof(set), &set);
+            return;
+        }
+    }
+}
+#else
+// macOS offers no way to bind a thread to a core
+static void pin_to_cpu(int index) {
+    (void) index;
+}
+#endif
+
+// rows of thread index: shards are whole groups of four rows, what the
+// multi-row kernel computes at once, so splitting does not change a bit
+static void shard_range(const GemvPool *p, int n_rows, int index, int *first,
+                        int *n) {
+    int groups = (n_rows + 3) / 4;
+    int per_thread = (groups + p->n_threads - 1) / p->n_threads * 4;
+    *first = index * per_thread < n_rows ? index * per_thread : n_rows;
+    *n = n_rows - *first < per_thread ? n_rows - *first : per_thread;
+}
+
+static void copy_shard(GemvPool *p, int index) {
+    PoolMatrix *pm = &p->matrices[p->matrix_i];
+    GemvShard *s = &pm->shards[index];
+    int n;
+    shard_range(p, pm->n_rows, index, &s->first, &n);
+    if (n == 0) {
+        return;
+    }
+    s->rows = create_matrix(n, pm->n_cols);
+    s->out = create_vector_view(NULL, n, true);
+    if (s->rows == NULL || s->out == NULL) {
+        atomic_store(&p->failed, true);
+        return;
+    }
+    matrix_copy_rows(s->rows, p->src, s->first);
+}
+
+static void run_job(GemvPool *p, int index) {
+    if (p->job == GEMV_JOB_COPY) {
+        copy_shard(p, index);
+        return;
+    }
+    PoolMatrix *pm = &p->matrices[p->matrix_i];
+    GemvShard *s = &pm->shards[index];
+    if (s->rows == NULL) {
+        return;
+    }
+    vector_set_data(s->out, vector_get_data_mut(p->res) + s->first,
+                    matrix_get_n_rows(s->rows));
+    matrix_vec_mul_with(s->rows, p->v, s->out, pm->kernel);
+}
+
+// spins for a round after seen, then sleeps until the caller starts one.
+// The counter and the flag are sequentially consistent, so either the
+// caller sees n_parked or the thread sees the new round before it sleeps
+static void wait_round(GemvPool *p, long seen) {
+    for (int spins = 0; spins < GEMV_SPINS; spins++) {
+        if (atomic_load_explicit(&p->round, memory_order_acquire) != seen) {
+            return;
+        }
+    }
+    pthread_mutex_lock(&p->lock);
+    atomic_fetch_add(&p->n_parked, 1);
+    while (atomic_load(&p->round) == seen) {
+        pthread_cond_wait(&p->round_cond, &p->lock);
+    }
+    atomic_fetch_sub(&p->n_parked, 1);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// the same for the caller waiting on the last thread of a round
+static void wait_done(GemvPool *p) {
+    int n = p->n_threads - 1;
+    for (int spins = 0; spins < GEMV_SPINS; spins++) {
+        if (atomic_load_explicit(&p->n_done, memory_order_acquire) == n) {
+            return;
+        }
+    }
+    pthread_mutex_lock(&p->lock);
+    atomic_store(&p->caller_parked, true);
+    while (atomic_load(&p->n_done) < n) {
+        pthread_cond_wait(&p->done_cond, &p->lock);
+    }
+    atomic_store(&p->caller_parked, false);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void *gemv_worker(void *arg) {
+    GemvWorker *w = arg;
+    GemvPool *p = w->pool;
+    pin_to_cpu(w->index);
+    long seen = 0;
+    for (;;) {
+        wait_round(p, seen);
+        seen++;
+        if (p->job == GEMV_JOB_STOP) {
+            return NULL;
+        }
+        run_job(p, w->index);
+        if (atomic_fetch_add(&p->n_done, 1) + 1 == p->n_threads - 1 &&
+            atomic_load(&p->caller_parked)) {
+            pthread_mutex_lock(&p->lock);
+            pthread_cond_signal(&p->done_cond);
+            pthread_mutex_unlock(&p->lock);
+        }
+    }
+}
+
+// hands job to the threads, does shard 0 and waits for the others
+static void run_round(GemvPool *p, GemvJob job) {
+    p->job = job;
+    atomic_store_explicit(&p->n_done, 0, memory_order_relaxed);
+    atomic_fetch_add(&p->round, 1);
+    if (atomic_load(&p->n_parked) > 0) {
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_broadcast(&p->round_cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+    if (job == GEMV_JOB_STOP) {
+        return;
+    }
+    run_job(p, 0);
+    wait_done(p);
+}
+
+static void free_shards(const GemvPool *p, PoolMatrix *pm) {
+    for (int i = 0; i < p->n_threads; i++) {
+        if (pm->shards[i].rows) {
+            destroy_matrix(pm->shards[i].rows);
+        }
+        if (pm->shards[i].out) {
+            destroy_vector(pm->shards[i].out);
+        }
+    }
+    free(pm->shards);
+}
+
+// n_threads counts the calling thread, which takes part in every product
+GemvPool *create_gemv_pool(int n_threads) {
+    assert(n_threads > 0);
+    GemvPool *p = calloc(1, sizeof(GemvPool));
+    if (p == NULL) {
+        return NULL;
+    }
+    p->n_threads = n_threads;
+    p->threads = malloc(sizeof(pthread_t) * n_threads);
+    p->workers = malloc(sizeof(GemvWorker) * n_threads);
+    if (p->threads == NULL || p->workers == NULL) {
+        free(p->threads);
+        free(p->workers);
+        free(p);
+        return NULL;
+    }
+    atomic_init(&p->round, 0);
+    atomic_init(&p->n_done, 0);
+    atomic_init(&p->failed, false);
+    atomic_init(&p->n_parked, 0);
+    atomic_init(&p->caller_parked, false);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->round_cond, NULL);
+    pthread_cond_init(&p->done_cond, NULL);
+    for (int i = 1; i < n_threads; i++) {
+        p->workers[i] = (GemvWorker) {.pool = p, .index = i};
+        if (pthread_create(&p->threads[i], NULL, gemv_worker,
+                           &p->workers[i]) != 0) {
+            p->n_threads = i;
+            destroy_gemv_pool(p);
+            return NULL;
+        }
+    }
+    return p;
+}
+
+void destroy_gemv_pool(GemvPool *p) {
+    assert(p);
+    run_round(p, GEMV_JOB_STOP);
+    for (int i = 1; i < p->n_threads; i++) {
+        pthread_join(p->threads[i], NULL);
+    }
+    for (int i = 0; i < p->n_matrices; i++) {
+        free_shards(p, &p->matrices[i]);
+    }
+    free(p->matrices);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->round_cond);
+    pthread_cond_destroy(&p->done_cond);
+    free(p->threads);
+    free(p->workers);
+    free(p);
+}
+
+int gemv_pool_get_n_threads(const GemvPool *p) {
+    assert(p);
+    return p->n_threads;
+}
+
+// splits the rows of m over the threads, each copies its own. Later
+// changes to m are not seen, add it to a new pool then. Returns the
+// index gemv_pool_mul takes or -1 when out of memory
+int gemv_pool_add_matrix(GemvPool *p, const Matrix *m, GemvKernel kernel) {
+    assert(p);
+    assert(m);
+    if (p->n_matrices == p->capacity) {
+        int capacity = p->capacity > 0 ? 2 * p->capacity : 8;
+        PoolMatrix *matrices = realloc(p->matrices,
+                                       sizeof(PoolMatrix) * capacity);
+        if (matrices == NULL) {
+            return -1;
+        }
+        p->matrices = matrices;
+        p->capacity = capacity;
+    }
+    PoolMatrix *pm = &p->matrices[p->n_matrices];
+    pm->n_rows = matrix_get_n_rows(m);
+    pm->n_cols = matrix_get_n_cols(m);
+    pm->kernel = kernel;
+    pm->shards = calloc(p->n_threads, sizeof(GemvShard));
+    if (pm->shards == NULL) {
+        return -1;
+    }
+    p->matrix_i = p->n_matrices;
+    p->src = m;
+    atomic_store(&p->failed, false);
+    run_round(p, GEMV_JOB_COPY);
+    if (atomic_load(&p->failed)) {
+        free_shards(p, pm);
+        return -1;
+    }
+    return p->n_matrices++;
+}
+
+// res = m v for matrix matrix_i, bit for bit what matrix_vec_mul_with
+// gives. One product runs at a time
+void gemv_pool_mul(GemvPool *p, int matrix_i, const Vector *v, Vector *res) {
+    assert(p);
+    assert(v);
+    assert(res);
+    assert(matrix_i >= 0 && matrix_i < p->n_matrices);
+    assert(p->matrices[matrix_i].n_cols == vector_get_n(v));
+    assert(p->matrices[matrix_i].n_rows == vector_get_n(res));
+    p->matrix_i = matrix_i;
+    p->v = v;
+    p->res = res;
+    run_round(p, GEMV_JOB_MUL);
+}
@@ -0,0 +1,27 @@
+#ifndef _GEMV_POOL_HEADER_
+#define _GEMV_POOL_HEADER_
+
+#include "matrix.h"
+#include "vector.h"
+
+// Persistent threads that split matrix-vector products by rows, for
+// single-row latency on matrices too big for one core's share of the
+// memory bandwidth. Each thread keeps a copy of its rows of every added
+// matrix, written from that thread so that it is local to its core's
+// NUMA node. Between products the threads spin for a while and then
+// sleep, so an idle pool takes no CPU. The calling thread computes the
+// first shard and waits for the others once per product; it is not
+// pinned, the first CPU it may use is left free for it.
+typedef struct gemv_pool GemvPool;
+
+GemvPool *create_gemv_pool(int n_threads);
+
+void destroy_gemv_pool(GemvPool *p);
+
+int gemv_pool_get_n_threads(const GemvPool *p);
+
+int gemv_pool_add_matrix(GemvPool *p, const Matrix *m, GemvKernel kernel);
+
+void gemv_pool_mul(GemvPool *p, int matrix_i, const Vector *v, Vector *res);
+
+#endif
@@ -5,6 +5,11 @@
 
 #include "loss.h"
 #include "vector.h"
+#include "simd_neon.h"
+
+// predictions are clamped this far from 0 and 1, as close as a float
+// next to 1 gets
+#define BCE_EPSILON 1e-7f
 
 Loss *create_loss(float (*forward) (const Vector *, const Vector *),
                   void (*backward) (Vector *, const Vector *, const Vector *)) {
@@ -18,6 +23,9 @@ Loss *create_loss(float (*forward) (const Vector *, const Vector *),
     if (backward != NULL) {
         l->backward = backward;
     }
+    l->forward_batch = NULL;
+    l->backward_batch = NULL;
+    l->from_logits = false;
     return l;
 }
 
@@ -32,18 +40,11 @@ static float mse_forward(const Vector *pred, const Vector *target) {
     int n = vector_get_n(pred);
     assert(n == vector_get_n(target));
     assert(vector_get_is_column(pred) == vector_get_is_column(target));
-    float total = 0;
-    const float *pred_data = vector_get_data(pred);
-    const float *target_data = vector_get_data(target);
-    for (int i = 0; i < n; i++) {
-        float diff = pred_data[i] - target_data[i];
-        total += diff * diff;
-    }
-    total /= n;
-    return total;
+    return float_sq_dist(vector_get_data(pred), vector_get_data(target), n) /
+           n;
 }
 
-static void mse_backward(Vector *delta, const Vector *pred, 
+static void mse_backward(Vector *delta, const Vector *pred,
                          const Vector *target) {
     assert(delta);
     assert(pred);
@@ -51,15 +52,53 @@ static void mse_backward(Vector *delta, const Vector *pred,
     int n = vector_get_n(pred);
     assert(n == vector_get_n(target));
     assert(n == vector_get_n(delta));
-    const float *pred_data = vector_get_data(pred);
-    const float *target_data = vector_get_data(target);
-    for (int i = 0; i < n; i++) {
-        vector_set(delta, (2.0 / n) * (pred_data[i] - target_data[i]), i);
+    float_sub_scaled(vector_get_data_mut(delta), vector_get_data(pred),
+                     vector_get_data(target), 2.0f / n, n);
+}
+
+static float mse_forward_batch(const Matrix *pred, const Matrix *target) {
+    int n_rows = matrix_get_n_rows(pred);
+    int n = matrix_get_n_cols(pred);
+    assert(n_rows == matrix_get_n_rows(target));
+    assert(n == matrix_get_n_cols(target));
+    float total = 0;
+    for (int i = 0; i < n_rows; i++) {
+        total += float_sq_dist(matrix_get_row(pred, i),
+                               matrix_get_row(target, i), n) / n;
+    }
+    return total;
+}
+
+static void mse_backward_batch(Matrix *delta, const Matrix *pred,
+                               const Matrix *target) {
+    int n_rows = matrix_get_n_rows(pred);
+    int n = matrix_get_n_cols(pred);
+    assert(n_rows == matrix_get_n_rows(target));
+    assert(n_rows == matrix_get_n_rows(delta));
+    for (int i = 0; i < n_rows; i++) {
+        float_sub_scaled(matrix_get_row_mut(delta, i), matrix_get_row(pred, i),
+                         matrix_get_row(target, i), 2.0f / n, n);
     }
 }
 
 Loss *make_mse() {
-    return create_loss(mse_forward, mse_backward);
+    Loss *l = create_loss(mse_forward, mse_backward);
+    if (l) {
+        l->forward_batch = mse_forward_batch;
+        l->backward_batch = mse_backward_batch;
+    }
+    return l;
+}
+
+// mean binary cross-entropy of one sample, in float
+static float bce(const float *pred, const float *target, int n) {
+    float total = 0;
+    for (int i = 0; i < n; i++) {
+        float y = target[i];
+        float y_hat = fminf(fmaxf(pred[i], BCE_EPSILON), 1.0f - BCE_EPSILON);
+        total += y * logf(y_hat) + (1 - y) * logf(1 - y_hat);
+    }
+    return -total / n;
 }
 
 static float ceb_forward(const Vector *pred, const Vector *target) {
@@ -68,22 +107,10 @@ static float ceb_forward(const Vector *pred, const Vector *target) {
     int n = vector_get_n(pred);
     assert(n == vector_get_n(target));
     assert(vector_get_is_column(pred) == vector_get_is_column(target));
-    float total = 0;
-    const float *pred_data = vector_get_data(pred);
-    const float *target_data = vector_get_data(target);
-    const float epsilon = 1e-12;
-    float y = 0;
-    float y_hat = 0;
-    for (int i = 0; i < n; i++) {
-        y = target_data[i];
-        y_hat = fmax(fmin(pred_data[i], 1.0 - epsilon), epsilon);
-        total += y * log(y_hat) + (1 - y) * log(1 - y_hat);
-    }
-    total /= n;
-    return -total;
+    return bce(vector_get_data(pred), vector_get_data(target), n);
 }
 
-static void ceb_backward(Vector *delta, const Vector *pred, 
+static void ceb_backward(Vector *delta, const Vector *pred,
                          const Vector *target) {
     assert(delta);
     assert(pred);
@@ -91,20 +118,100 @@ static void ceb_backward(Vector *delta, const Vector *pred,
     int n = vector_get_n(pred);
     assert(n == vector_get_n(target));
     assert(n == vector_get_n(delta));
-    const float *pred_data = vector_get_data(pred);
-    const float *target_data = vector_get_data(target);
-    const float epsilon = 1e-12;
-    float value = 0;
-    float y = 0;
-    float y_hat = 0;
-    for (int i = 0; i < n; i++) {
-        y = target_data[i];
-        y_hat = fmax(fmin(pred_data[i], 1.0 - epsilon), epsilon);
-        value = y / y_hat - (1.0 - y) / (1.0 - y_hat);
-        vector_set(delta, -value / n, i);
+    float_bce_grad(vector_get_data_mut(delta), vector_get_data(pred),
+                   vector_get_data(target), BCE_EPSILON, 1.0f / n, n);
+}
+
+static float ceb_forward_batch(const Matrix *pred, const Matrix *target) {
+    int n_rows = matrix_get_n_rows(pred);
+    int n = matrix_get_n_cols(pred);
+    assert(n_rows == matrix_get_n_rows(target));
+    assert(n == matrix_get_n_cols(target));
+    float total = 0;
+    for (int i = 0; i < n_rows; i++) {
+        total += bce(matrix_get_row(pred, i), matrix_get_row(target, i), n);
+    }
+    return total;
+}
+
+static void ceb_backward_batch(Matrix *delta, const Matrix *pred,
+                               const Matrix *target) {
+    int n_rows = matrix_get_n_rows(pred);
+    int n = matrix_get_n_cols(pred);
+    assert(n_rows == matrix_get_n_rows(target));
+    assert(n_rows == matrix_get_n_rows(delta));
+    for (int i = 0; i < n_rows; i++) {
+        float_bce_grad(matrix_get_row_mut(delta, i), matrix_get_row(pred, i),
+                       matrix_get_row(target, i), BCE_EPSILON, 1.0f / n, n);
     }
 }
 
 Loss *make_ceb() {
-    return create_loss(ceb_forward, ceb_backward);
-}
\ No newline at end of file
+    Loss *l = create_loss(ceb_forward, ceb_backward);
+    if (l) {
+        l->forward_batch = ceb_forward_batch;
+        l->backward_batch = ceb_backward_batch;
+    }
+    return l;
+}
+
+// the per-sample callbacks see sigmoid outputs: the loss is plain binary
+// cross-entropy and since p = sigmoid(z) the delta for z is p - y
+static void bce_logits_backward(Vector *delta, const Vector *pred,
+                                const Vector *target) {
+    assert(delta);
+    assert(pred);
+    assert(target);
+    int n = vector_get_n(pred);
+    assert(n == vector_get_n(target));
+    assert(n == vector_get_n(delta));
+    float_sub_scaled(vector_get_data_mut(delta), vector_get_data(pred),
+                     vector_get_data(target), 1.0f / n, n);
+}
+
+// max(z, 0) - z y + log(1 + e^-|z|) equals the cross-entropy of
+// sigmoid(z) without ever taking the log of a rounded probability
+static float bce_logits_forward_batch(const Matrix *logits,
+                                      const Matrix *target) {
+    int n_rows = matrix_get_n_rows(logits);
+    int n = matrix_get_n_cols(logits);
+    assert(n_rows == matrix_get_n_rows(target));
+    assert(n == matrix_get_n_cols(target));
+    float total = 0;
+    for (int i = 0; i < n_rows; i++) {
+        const float *z = matrix_get_row(logits, i);
+        const float *y = matrix_get_row(target, i);
+        float row = 0;
+        for (int j = 0; j < n; j++) {
+            row += fmaxf(z[j], 0) - z[j] * y[j] + log1pf(expf(-fabsf(z[j])));
+        }
+        total += row / n;
+    }
+    return total;
+}
+
+static void bce_logits_backward_batch(Matrix *delta, const Matrix *pred,
+                                      const Matrix *target) {
+    int n_rows = matrix_get_n_rows(pred);
+    int n = matrix_get_n_cols(pred);
+    assert(n_rows == matrix_get_n_rows(target));
+    assert(n_rows == matrix_get_n_rows(delta));
+    for (int i = 0; i < n_rows; i++) {
+        float_sub_scaled(matrix_get_row_mut(delta, i), matrix_get_row(pred, i),
+                         matrix_get_row(target, i), 1.0f / n, n);
+    }
+}
+
+// binary cross-entropy fused with a sigmoid output layer: training
+// computes the loss from the logits and the gradient is sigmoid(z) - y,
+// with no clamping, logarithm or division in the backward pass.
+// Predictions stay probabilities
+Loss *make_bce_logits() {
+    Loss *l = create_loss(ceb_forward, bce_logits_backward);
+    if (l) {
+        l->forward_batch = bce_logits_forward_batch;
+        l->backward_batch = bce_logits_backward_batch;
+        l->from_logits = true;
+    }
+    return l;
+}
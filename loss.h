@@ -1,11 +1,22 @@
 #ifndef _LOSS_HEADER_
 #define _LOSS_HEADER_
 
+#include <stdbool.h>
+
 #include "vector.h"
+#include "matrix.h"
 
 typedef struct loss {
     float (*forward) (const Vector *, const Vector *);
     void (*backward) (Vector *, const Vector *, const Vector *);
+    // mini-batch forms with one sample per row, forward_batch returns the
+    // loss summed over the rows. NULL falls back to the per-row callbacks
+    float (*forward_batch) (const Matrix *, const Matrix *);
+    void (*backward_batch) (Matrix *, const Matrix *, const Matrix *);
+    // forward_batch is given the output layer's pre-activations and the
+    // deltas are taken with respect to them, the output activation's own
+    // derivative is skipped
+    bool from_logits;
 } Loss;
 
 Loss *create_loss(float (*forward) (const Vector *, const Vector *),
@@ -17,4 +28,6 @@ Loss *make_mse();
 
 Loss *make_ceb();
 
+Loss *make_bce_logits();
+
 #endif
\ No newline at end of file
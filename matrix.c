@@ -6,23 +6,90 @@
 
 #include "matrix.h"
 #include "simd_neon.h"
+#include "config.h"
+
+#ifdef HUGE_PAGES
+#include <sys/mman.h>
+#endif
+
+// every row starts on its own 64 byte cache line
+#define MATRIX_ALIGN 64
+#define ROW_ALIGN_FLOATS (MATRIX_ALIGN / sizeof(float))
+#define SIMD_WIDTH 4
+// buffers at least this big are backed by huge pages with HUGE_PAGES
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
 
 typedef struct matrix {
     float *data;
     int n_rows;
     int n_cols;
+    // floats between the starts of two rows, the padding reads as zero
+    int stride;
+    // bytes mapped for huge page backed data, 0 when allocated on the heap
+    size_t mapped;
+    // views borrow the data of another matrix or buffer
+    bool owns_data;
+    // the stride padding past n_cols reads as zero
+    bool zero_padded;
 } Matrix;
 
-Matrix *create_matrix(int n_rows, int n_cols) {
+static int round_up(int n, int multiple) {
+    return (n + multiple - 1) / multiple * multiple;
+}
+
+static float *alloc_matrix_data(size_t bytes, size_t *mapped) {
+    *mapped = 0;
+#ifdef HUGE_PAGES
+    if (bytes >= HUGE_PAGE_SIZE) {
+        size_t len = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE *
+                     HUGE_PAGE_SIZE;
+        void *data = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        data = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if (data == MAP_FAILED) {
+            // no reserved huge pages, ask for transparent ones instead
+            data = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+            if (data != MAP_FAILED) {
+                madvise(data, len, MADV_HUGEPAGE);
+            }
+#endif
+        }
+        if (data != MAP_FAILED) {
+            // anonymous mappings are already zero filled
+            *mapped = len;
+            return data;
+        }
+    }
+#endif
+    float *data = NULL;
+    if (posix_memalign((void **) &data, MATRIX_ALIGN, bytes) != 0 ||
+        data == NULL) {
+        return NULL;
+    }
+    memset(data, 0, bytes);
+    return data;
+}
+
+static Matrix *create_matrix_with_stride(int n_rows, int n_cols,
+                                         int stride) {
     Matrix *m = malloc(sizeof(Matrix));
     if (m == NULL) {
         return NULL;
     }
     m->n_cols = n_cols;
     m->n_rows = n_rows;
-    float *data = NULL;
-    if (posix_memalign((void **) &data, 16,
-        sizeof(float) * n_cols * n_rows) != 0 || data == NULL) {
+    m->stride = stride;
+    m->owns_data = true;
+    m->zero_padded = stride >= round_up(n_cols, SIMD_WIDTH);
+    size_t bytes = sizeof(float) * stride * n_rows;
+    // keep the allocation a whole number of cache lines
+    bytes = round_up(bytes > 0 ? bytes : 1, MATRIX_ALIGN);
+    float *data = alloc_matrix_data(bytes, &m->mapped);
+    if (data == NULL) {
         free(m);
         return NULL;
     }
@@ -30,12 +97,138 @@ Matrix *create_matrix(int n_rows, int n_cols) {
     return m;
 }
 
+// rows are padded to whole cache lines, so the kernels below can run
+// every row to a multiple of the SIMD width without a scalar tail
+Matrix *create_matrix(int n_rows, int n_cols) {
+    return create_matrix_with_stride(n_rows, n_cols,
+                                     round_up(n_cols, ROW_ALIGN_FLOATS));
+}
+
+// rows are stored back to back, for buffers that are reshaped or handed
+// out as one flat array
+Matrix *create_matrix_packed(int n_rows, int n_cols) {
+    return create_matrix_with_stride(n_rows, n_cols, n_cols);
+}
+
+// rows of n_cols floats starting stride floats apart in data, which
+// stays owned by the caller
+Matrix *create_matrix_view(float *data, int n_rows, int n_cols, int stride) {
+    assert(data);
+    assert(stride >= n_cols);
+    Matrix *m = malloc(sizeof(Matrix));
+    if (m == NULL) {
+        return NULL;
+    }
+    m->data = data;
+    m->n_rows = n_rows;
+    m->n_cols = n_cols;
+    m->stride = stride;
+    m->mapped = 0;
+    m->owns_data = false;
+    m->zero_padded = false;
+    return m;
+}
+
+// floats of storage a create_matrix_in matrix of this shape takes
+size_t matrix_storage_floats(int n_rows, int n_cols) {
+    return (size_t) n_rows * round_up(n_cols, ROW_ALIGN_FLOATS);
+}
+
+// the padded layout of create_matrix placed in zero filled storage of
+// matrix_storage_floats floats, which stays owned by the caller
+Matrix *create_matrix_in(float *data, int n_rows, int n_cols) {
+    Matrix *m = create_matrix_view(data, n_rows, n_cols,
+                                   round_up(n_cols, ROW_ALIGN_FLOATS));
+    if (m) {
+        m->zero_padded = true;
+    }
+    return m;
+}
+
+// rows [start_row, start_row + n_rows) and columns
+// [start_col, start_col + n_cols) of m without copying
+Matrix *matrix_view_block(const Matrix *m, int start_row, int n_rows,
+                          int start_col, int n_cols) {
+    assert(m);
+    assert(start_row >= 0 && n_rows >= 0 && start_row + n_rows <= m->n_rows);
+    assert(start_col >= 0 && n_cols >= 0 && start_col + n_cols <= m->n_cols);
+    Matrix *view = create_matrix_view(
+        &m->data[start_row * m->stride + start_col], n_rows, n_cols,
+        m->stride);
+    if (view == NULL) {
+        return NULL;
+    }
+    // only full width views keep the zeroed padding of their parent
+    view->zero_padded = m->zero_padded && n_cols == m->n_cols;
+    return view;
+}
+
+Matrix *matrix_view_rows(const Matrix *m, int start_row, int n_rows) {
+    assert(m);
+    return matrix_view_block(m, start_row, n_rows, 0, m->n_cols);
+}
+
+// slides a row view over m to begin at start_row, keeping its shape
+void matrix_view_move_rows(Matrix *view, const Matrix *m, int start_row) {
+    assert(view);
+    assert(m);
+    assert(!view->owns_data);
+    assert(view->stride == m->stride);
+    assert(view->n_cols == m->n_cols);
+    assert(start_row >= 0 && start_row + view->n_rows <= m->n_rows);
+    view->data = &m->data[start_row * m->stride];
+}
+
+Vector *matrix_row_view(const Matrix *m, int row_i) {
+    assert(m);
+    assert(m->n_rows > row_i && row_i >= 0);
+    return create_vector_view(&m->data[row_i * m->stride], m->n_cols, true);
+}
+
+bool matrix_is_view(const Matrix *m) {
+    assert(m);
+    return !m->owns_data;
+}
+
 void destroy_matrix(Matrix *m) {
     assert(m);
+    if (!m->owns_data) {
+        free(m);
+        return;
+    }
+#ifdef HUGE_PAGES
+    if (m->mapped) {
+        munmap(m->data, m->mapped);
+        free(m);
+        return;
+    }
+#endif
     free(m->data);
     free(m);
 }
 
+// how far row kernels may run: up to the SIMD width when the padding is
+// there to absorb it, the exact width for packed matrices
+static int row_len(const Matrix *m) {
+    return m->zero_padded ? round_up(m->n_cols, SIMD_WIDTH) : m->n_cols;
+}
+
+static int shared_row_len(const Matrix *a, const Matrix *b) {
+    int len_a = row_len(a);
+    int len_b = row_len(b);
+    return len_a < len_b ? len_a : len_b;
+}
+
+static void zero_rows(Matrix *m) {
+    for (int i = 0; i < m->n_rows; i++) {
+        memset(&m->data[i * m->stride], 0, sizeof(float) * row_len(m));
+    }
+}
+
+static bool is_packed(const Matrix *m) {
+    return m->stride == m->n_cols || m->n_rows <= 1;
+}
+
 int matrix_get_n_elem(const Matrix *m) {
     assert(m);
     return m->n_cols * m->n_rows;
@@ -51,14 +244,42 @@ int matrix_get_n_cols(const Matrix *m) {
     return m->n_cols;
 }
 
-// makes dst->data a pointer to the start of the row of m
+const float *matrix_get_row(const Matrix *m, int row_i) {
+    assert(m);
+    assert(m->n_rows > row_i && row_i >= 0);
+    return &m->data[row_i * m->stride];
+}
+
+float *matrix_get_row_mut(Matrix *m, int row_i) {
+    assert(m);
+    assert(m->n_rows > row_i && row_i >= 0);
+    return &m->data[row_i * m->stride];
+}
+
+// reinterprets the same data with a new shape, m must be packed
+void matrix_reshape(Matrix *m, int n_rows, int n_cols) {
+    assert(m);
+    assert(is_packed(m));
+    assert(n_rows * n_cols == m->n_rows * m->n_cols);
+    m->n_rows = n_rows;
+    m->n_cols = n_cols;
+    m->stride = n_cols;
+    m->zero_padded = n_cols % SIMD_WIDTH == 0;
+}
+
+int matrix_get_stride(const Matrix *m) {
+    assert(m);
+    return m->stride;
+}
+
+// makes dst a view of the row of m, dst gives up any data it owned
 void matrix_row_as_vec(Vector *dst, const Matrix *m, int row_i) {
     assert(m);
     assert(dst);
     assert(m->n_rows > row_i && row_i >= 0);
     int n = vector_get_n(dst);
     assert(n == matrix_get_n_cols(m));
-    vector_set_data(dst, &m->data[row_i * n], n);
+    vector_set_data(dst, &m->data[row_i * m->stride], n);
 }
 
 void matrix_copy(Matrix *dst_m, const Matrix *src_m) {
@@ -66,8 +287,16 @@ void matrix_copy(Matrix *dst_m, const Matrix *src_m) {
     assert(src_m);
     assert(dst_m->n_cols == src_m->n_cols);
     assert(dst_m->n_rows == src_m->n_rows);
-    memcpy(dst_m->data, src_m->data,
-           sizeof(float) * dst_m->n_cols * dst_m->n_rows);
+    if (dst_m->stride == src_m->stride && dst_m->owns_data &&
+        src_m->owns_data) {
+        memcpy(dst_m->data, src_m->data,
+               sizeof(float) * dst_m->stride * dst_m->n_rows);
+        return;
+    }
+    for (int i = 0; i < dst_m->n_rows; i++) {
+        memcpy(&dst_m->data[i * dst_m->stride], &src_m->data[i * src_m->stride],
+               sizeof(float) * dst_m->n_cols);
+    }
 }
 
 void matrix_copy_head(Matrix *dst_m, const Matrix *src_m, int rows) {
@@ -76,15 +305,56 @@ void matrix_copy_head(Matrix *dst_m, const Matrix *src_m, int rows) {
     assert(dst_m->n_cols == src_m->n_cols);
     assert(rows > 0 && rows <= dst_m->n_rows);
     assert(dst_m->n_rows == rows);
-    memcpy(dst_m->data, src_m->data,
-           sizeof(float) * dst_m->n_cols * rows);
+    for (int i = 0; i < rows; i++) {
+        memcpy(&dst_m->data[i * dst_m->stride], &src_m->data[i * src_m->stride],
+               sizeof(float) * dst_m->n_cols);
+    }
+}
+
+// fills dst_m with the dst_m->n_rows rows of src_m starting at start_row
+void matrix_copy_rows(Matrix *dst_m, const Matrix *src_m, int start_row) {
+    assert(dst_m);
+    assert(src_m);
+    assert(dst_m->n_cols == src_m->n_cols);
+    assert(start_row >= 0);
+    assert(start_row + dst_m->n_rows <= src_m->n_rows);
+    for (int i = 0; i < dst_m->n_rows; i++) {
+        memcpy(&dst_m->data[i * dst_m->stride],
+               &src_m->data[(start_row + i) * src_m->stride],
+               sizeof(float) * dst_m->n_cols);
+    }
+}
+
+// dst_m row i becomes src_m row rows[i]
+void matrix_gather_rows(Matrix *dst_m, const Matrix *src_m, const int *rows) {
+    assert(dst_m);
+    assert(src_m);
+    assert(rows);
+    assert(dst_m->n_cols == src_m->n_cols);
+    int n = dst_m->n_cols;
+    for (int i = 0; i < dst_m->n_rows; i++) {
+        assert(src_m->n_rows > rows[i] && rows[i] >= 0);
+        memcpy(&dst_m->data[i * dst_m->stride],
+               &src_m->data[rows[i] * src_m->stride], sizeof(float) * n);
+    }
+}
+
+// data holds the rows back to back
+void matrix_copy_data(Matrix *m, const float *data, int n_elem) {
+    assert(m);
+    assert(data);
+    assert(n_elem == m->n_rows * m->n_cols);
+    for (int i = 0; i < m->n_rows; i++) {
+        memcpy(&m->data[i * m->stride], &data[i * m->n_cols],
+               sizeof(float) * m->n_cols);
+    }
 }
 
 void matrix_set(Matrix *m, float val, int row, int col) {
     assert(m);
     assert(m->n_rows > row && row >= 0);
     assert(m->n_cols > col && col >= 0);
-    m->data[row * m->n_cols + col] = val;
+    m->data[row * m->stride + col] = val;
 }
 
 void matrix_set_row(Matrix *m, const Vector *src, int row) {
@@ -93,9 +363,8 @@ void matrix_set_row(Matrix *m, const Vector *src, int row) {
     assert(m->n_rows > row && row >= 0);
     int n = vector_get_n(src);
     assert(n == m->n_cols);
-    for (int i = 0; i < n; i++) {
-        m->data[row * n + i] = vector_get(src, i);
-    }
+    memcpy(&m->data[row * m->stride], vector_get_data(src),
+           sizeof(float) * n);
 }
 
 void matrix_vec_mul(const Matrix *m, const Vector *v, Vector *res) {
@@ -109,14 +378,29 @@ void matrix_vec_mul(const Matrix *m, const Vector *v, Vector *res) {
     assert(vector_get_is_column(v));
     assert(vector_get_is_column(res));
 
+    matrix_vec_mul_with(m, v, res, GEMV_MULTI_ROW);
+}
+
+// matrix_vec_mul with an explicit kernel, GEMV_SINGLE_ROW takes one dot
+// product per row and can win on matrices with very few columns
+void matrix_vec_mul_with(const Matrix *m, const Vector *v, Vector *res,
+                         GemvKernel kernel) {
+    assert(m);
+    assert(v);
+    assert(res);
+    assert(v != res);
+    assert(m->n_cols == vector_get_n(v));
+    assert(m->n_rows == vector_get_n(res));
+
     const float *data = vector_get_data(v);
-    float total = 0;
+    float *out = vector_get_data_mut(res);
+    if (kernel == GEMV_MULTI_ROW && m->zero_padded) {
+        float_gemv(out, m->data, m->stride, m->n_rows, data, m->n_cols);
+        return;
+    }
+    // the rows of views may end on foreign data, so stop at n_cols
     for (int i = 0; i < m->n_rows; i++) {
-        for (int j = 0; j < m->n_cols; j++) {
-            total += m->data[i * m->n_cols + j] * data[j];
-        }
-        total = float_dot(&m->data[i * m->n_cols], data, m->n_cols);
-        vector_set(res, total, i);
+        out[i] = float_dot(&m->data[i * m->stride], data, m->n_cols);
     }
 }
 
@@ -135,12 +419,149 @@ void matrix_T_vec_mul(const Matrix *m, const Vector *v, Vector *res) {
     for (int i = 0; i < m->n_cols; i++) {
         float total = 0;
         for (int j = 0; j < m->n_rows; j++) {
-            total += m->data[j * m->n_cols + i] * data[j];
+            total += m->data[j * m->stride + i] * data[j];
         }
         vector_set(res, total, i);
     }
 }
 
+void matrix_mul(const Matrix *a, const Matrix *b, Matrix *res) {
+    matrix_mul_blocked(a, b, res, MATRIX_MUL_BLOCK);
+}
+
+// res = a * b, accumulating rows of b scaled by a[i][k] one block of
+// block rows of b at a time
+void matrix_mul_blocked(const Matrix *a, const Matrix *b, Matrix *res,
+                        int block) {
+    assert(a);
+    assert(block > 0);
+    assert(b);
+    assert(res);
+    assert(a != res && b != res);
+    assert(a->n_cols == b->n_rows);
+    assert(res->n_rows == a->n_rows);
+    assert(res->n_cols == b->n_cols);
+
+    int n = shared_row_len(b, res);
+    zero_rows(res);
+    for (int kk = 0; kk < a->n_cols; kk += block) {
+        int k_end = kk + block < a->n_cols ? kk + block : a->n_cols;
+        for (int i = 0; i < a->n_rows; i++) {
+            const float *a_row = &a->data[i * a->stride];
+            float *res_row = &res->data[i * res->stride];
+            for (int k = kk; k < k_end; k++) {
+                if (a_row[k] != 0) {
+                    float_axpy(res_row, &b->data[k * b->stride], a_row[k], n);
+                }
+            }
+        }
+    }
+}
+
+void matrix_mul_T(const Matrix *a, const Matrix *b, Matrix *res) {
+    matrix_mul_T_blocked(a, b, res, MATRIX_MUL_BLOCK);
+}
+
+// res = a * b^T, tiled so a block of b rows stays in cache while
+// a block of a rows is streamed against it
+void matrix_mul_T_blocked(const Matrix *a, const Matrix *b, Matrix *res,
+                          int block) {
+    assert(a);
+    assert(block > 0);
+    assert(b);
+    assert(res);
+    assert(a != res && b != res);
+    assert(a->n_cols == b->n_cols);
+    assert(res->n_rows == a->n_rows);
+    assert(res->n_cols == b->n_rows);
+
+    int n = shared_row_len(a, b);
+    for (int jj = 0; jj < b->n_rows; jj += block) {
+        int j_end = jj + block < b->n_rows ? jj + block : b->n_rows;
+        for (int ii = 0; ii < a->n_rows; ii += block) {
+            int i_end = ii + block < a->n_rows ? ii + block : a->n_rows;
+            for (int i = ii; i < i_end; i++) {
+                const float *a_row = &a->data[i * a->stride];
+                float *res_row = &res->data[i * res->stride];
+                for (int j = jj; j < j_end; j++) {
+                    res_row[j] = float_dot(a_row, &b->data[j * b->stride], n);
+                }
+            }
+        }
+    }
+}
+
+void matrix_T_mul(const Matrix *a, const Matrix *b, Matrix *res) {
+    matrix_T_mul_blocked(a, b, res, MATRIX_MUL_BLOCK);
+}
+
+// res = a^T * b, same blocking as matrix_mul over the shared rows
+void matrix_T_mul_blocked(const Matrix *a, const Matrix *b, Matrix *res,
+                          int block) {
+    assert(res);
+    zero_rows(res);
+    matrix_T_mul_acc_blocked(a, b, res, block);
+}
+
+// res += a^T * b. Every element sums its products in row order onto
+// what res held, so splitting the rows of a and b over several calls
+// gives the same bits as one call over all of them
+void matrix_T_mul_acc_blocked(const Matrix *a, const Matrix *b, Matrix *res,
+                              int block) {
+    assert(a);
+    assert(block > 0);
+    assert(b);
+    assert(res);
+    assert(a != res && b != res);
+    assert(a->n_rows == b->n_rows);
+    assert(res->n_rows == a->n_cols);
+    assert(res->n_cols == b->n_cols);
+
+    int n = shared_row_len(b, res);
+    for (int kk = 0; kk < a->n_rows; kk += block) {
+        int k_end = kk + block < a->n_rows ? kk + block : a->n_rows;
+        for (int i = 0; i < a->n_cols; i++) {
+            float *res_row = &res->data[i * res->stride];
+            for (int k = kk; k < k_end; k++) {
+                float scale = a->data[k * a->stride + i];
+                if (scale != 0) {
+                    float_axpy(res_row, &b->data[k * b->stride], scale, n);
+                }
+            }
+        }
+    }
+}
+
+// adds v to every row of m
+void matrix_add_row_vec(Matrix *m, const Vector *v) {
+    assert(m);
+    assert(v);
+    assert(m->n_cols == vector_get_n(v));
+    const float *data = vector_get_data(v);
+    for (int i = 0; i < m->n_rows; i++) {
+        float *row = &m->data[i * m->stride];
+        float_add(row, row, data, m->n_cols);
+    }
+}
+
+// res[j] = sum of m[i][j] over all rows i
+void matrix_sum_rows(const Matrix *m, Vector *res) {
+    assert(res);
+    memset(vector_get_data_mut(res), 0, sizeof(float) * vector_get_n(res));
+    matrix_sum_rows_acc(m, res);
+}
+
+// res[j] += m[i][j] for the rows i in order
+void matrix_sum_rows_acc(const Matrix *m, Vector *res) {
+    assert(m);
+    assert(res);
+    assert(m->n_cols == vector_get_n(res));
+    float *data = vector_get_data_mut(res);
+    for (int i = 0; i < m->n_rows; i++) {
+        float_add(data, data, &m->data[i * m->stride], m->n_cols);
+    }
+}
+
 void matrix_outer_mul(Matrix *dst, const Vector *left, const Vector *right) {
     assert(dst);
     assert(left);
@@ -155,7 +576,7 @@ void matrix_outer_mul(Matrix *dst, const Vector *left, const Vector *right) {
     const float *right_data = vector_get_data(right);
     for (int i = 0; i < dst->n_rows; i++) {
         for (int j = 0; j < dst->n_cols; j++) {
-            dst->data[i * dst->n_cols + j] = left_data[i] * right_data[j];
+            dst->data[i * dst->stride + j] = left_data[i] * right_data[j];
         }
     }
 }
@@ -167,10 +588,23 @@ void matrix_scaled_sub(Matrix *dst, const Matrix *m, float scale) {
     int rows = dst->n_rows;
     assert(cols == m->n_cols);
     assert(rows == m->n_rows);
+    int n = shared_row_len(dst, m);
     for (int i = 0; i < rows; i++) {
-        for (int j = 0; j < cols; j++) {
-            dst->data[i * cols + j] -= scale * m->data[i * cols + j];
-        }
+        float_axpy(&dst->data[i * dst->stride], &m->data[i * m->stride],
+                   -scale, n);
+    }
+}
+
+// dst *= m element by element
+void matrix_hadamard(Matrix *dst, const Matrix *m) {
+    assert(dst);
+    assert(m);
+    assert(dst->n_cols == m->n_cols);
+    assert(dst->n_rows == m->n_rows);
+    int n = shared_row_len(dst, m);
+    for (int i = 0; i < dst->n_rows; i++) {
+        float *row = &dst->data[i * dst->stride];
+        float_mul(row, row, &m->data[i * m->stride], n);
     }
 }
 
@@ -179,8 +613,10 @@ Matrix *matrix_make_from_k(int k, int n_rows, int n_cols) {
     if (m == NULL) {
         return NULL;
     }
-    for (int i = 0; i < n_rows * n_cols; i++) {
-        m->data[i] = k;
+    for (int i = 0; i < n_rows; i++) {
+        for (int j = 0; j < n_cols; j++) {
+            m->data[i * m->stride + j] = k;
+        }
     }
     return m;
 }
@@ -188,8 +624,10 @@ Matrix *matrix_make_from_k(int k, int n_rows, int n_cols) {
 void matrix_initialize(Matrix *m, float (*const method) (int, int)) {
     assert(m);
     assert(method);
-    for (int i = 0; i < m->n_cols * m->n_rows; i++) {
-        m->data[i] = method(m->n_cols, m->n_rows);
+    for (int i = 0; i < m->n_rows; i++) {
+        for (int j = 0; j < m->n_cols; j++) {
+            m->data[i * m->stride + j] = method(m->n_cols, m->n_rows);
+        }
     }
 }
 
@@ -200,7 +638,7 @@ void matrix_print(const Matrix *m) {
             if (j > 0) {
                 printf(" ");
             }
-            printf("%.2f", m->data[i * m->n_cols + j]);
+            printf("%.2f", m->data[i * m->stride + j]);
         }
         printf("\n");
     }
@@ -1,12 +1,41 @@
 #ifndef _MATRIX_HEADER_
 #define _MATRIX_HEADER_
 
+#include <stddef.h>
+
 #include "vector.h"
 
 typedef struct matrix Matrix;
 
+// default rows per tile in the blocked matrix products
+#define MATRIX_MUL_BLOCK 64
+
+typedef enum {
+    GEMV_MULTI_ROW,
+    GEMV_SINGLE_ROW,
+} GemvKernel;
+
 Matrix *create_matrix(int n_rows, int n_cols);
 
+Matrix *create_matrix_packed(int n_rows, int n_cols);
+
+Matrix *create_matrix_view(float *data, int n_rows, int n_cols, int stride);
+
+size_t matrix_storage_floats(int n_rows, int n_cols);
+
+Matrix *create_matrix_in(float *data, int n_rows, int n_cols);
+
+Matrix *matrix_view_block(const Matrix *m, int start_row, int n_rows,
+                          int start_col, int n_cols);
+
+Matrix *matrix_view_rows(const Matrix *m, int start_row, int n_rows);
+
+void matrix_view_move_rows(Matrix *view, const Matrix *m, int start_row);
+
+Vector *matrix_row_view(const Matrix *m, int row_i);
+
+bool matrix_is_view(const Matrix *m);
+
 void destroy_matrix(Matrix *m);
 
 int matrix_get_n_elem(const Matrix *m);
@@ -15,24 +44,67 @@ int matrix_get_n_rows(const Matrix *m);
 
 int matrix_get_n_cols(const Matrix *m);
 
+int matrix_get_stride(const Matrix *m);
+
+const float *matrix_get_row(const Matrix *m, int row_i);
+
+float *matrix_get_row_mut(Matrix *m, int row_i);
+
+void matrix_reshape(Matrix *m, int n_rows, int n_cols);
+
 void matrix_row_as_vec(Vector *dst, const Matrix *m, int row_i);
 
 void matrix_copy(Matrix *dst_m, const Matrix *src_m);
 
 void matrix_copy_head(Matrix *dst_m, const Matrix *src_m, int rows);
 
+void matrix_copy_rows(Matrix *dst_m, const Matrix *src_m, int start_row);
+
+void matrix_copy_data(Matrix *m, const float *data, int n_elem);
+
+void matrix_gather_rows(Matrix *dst_m, const Matrix *src_m, const int *rows);
+
 void matrix_set(Matrix *m, float val, int row, int col);
 
 void matrix_set_row(Matrix *m, const Vector *src, int row);
 
 void matrix_vec_mul(const Matrix *m, const Vector *v, Vector *res);
 
+void matrix_vec_mul_with(const Matrix *m, const Vector *v, Vector *res,
+                         GemvKernel kernel);
+
 void matrix_T_vec_mul(const Matrix *m, const Vector *v, Vector *res);
 
+void matrix_mul(const Matrix *a, const Matrix *b, Matrix *res);
+
+void matrix_mul_blocked(const Matrix *a, const Matrix *b, Matrix *res,
+                        int block);
+
+void matrix_mul_T(const Matrix *a, const Matrix *b, Matrix *res);
+
+void matrix_mul_T_blocked(const Matrix *a, const Matrix *b, Matrix *res,
+                          int block);
+
+void matrix_T_mul(const Matrix *a, const Matrix *b, Matrix *res);
+
+void matrix_T_mul_blocked(const Matrix *a, const Matrix *b, Matrix *res,
+                          int block);
+
+void matrix_T_mul_acc_blocked(const Matrix *a, const Matrix *b, Matrix *res,
+                              int block);
+
+void matrix_add_row_vec(Matrix *m, const Vector *v);
+
+void matrix_sum_rows(const Matrix *m, Vector *res);
+
+void matrix_sum_rows_acc(const Matrix *m, Vector *res);
+
 void matrix_outer_mul(Matrix *dst, const Vector *left, const Vector *right);
 
 void matrix_scaled_sub(Matrix *dst, const Matrix *m, float scale);
 
+void matrix_hadamard(Matrix *dst, const Matrix *m);
+
 Matrix *matrix_make_from_k(int k, int n_rows, int n_cols);
 
 void matrix_initialize(Matrix *m, float (*const method) (int, int));
@@ -1,34 +1,177 @@
 #include <stddef.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <memory.h>
 #include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sched.h>
 
 #include "nn.h"
 #include "rand_distr.h"
+#include "simd_neon.h"
+#include "conv.h"
+#include "sparse.h"
+#include "tune.h"
+#include "checkpoint.h"
+#include "allreduce.h"
+#include "trace.h"
+#include "gemv_pool.h"
 #include "config.h"
 
+// the activation after the layer is its output
 typedef struct {
     Vector *prev;
     Vector *pre_act;
-    Vector *post_act;
     Vector *delta;
 } Cache;
 
+#define BN_MOMENTUM 0.9f
+#define BN_EPSILON 1e-5f
+// net_predict splits the GEMV of dense layers with at least this many
+// weights over the threads of net_set_predict_threads
+#define PREDICT_SPLIT_WEIGHTS (1 << 20)
+
+typedef enum {
+    LAYER_DENSE,
+    LAYER_CONV2D,
+    LAYER_MAX_POOL2D,
+    LAYER_AVG_POOL2D,
+    LAYER_BATCHNORM,
+    LAYER_RECURRENT,
+    LAYER_EMBEDDING,
+} LayerKind;
+
+// per step workspace of a recurrent layer for a block of rows, laid out
+// time major: row t * n_rows + b holds step t of row b, so each step is
+// a block of rows the recurrent product runs on
+typedef struct {
+    int n_rows;
+    // inputs of every step, their gradient after the backward pass
+    Matrix *x;
+    // gate inputs of every step, activated in place by the cells
+    Matrix *gates;
+    Matrix *gates_h;
+    // states after every step behind a zero block for the initial state
+    Matrix *h;
+    Matrix *c;
+    Matrix *d_gates;
+    Matrix *d_gates_h;
+    // gradients flowing back to the previous step
+    Matrix *d_h;
+    Matrix *d_h_rec;
+    Matrix *d_c;
+    // n_rows row views moved along h and d_gates_h, and the states every
+    // step started from
+    Matrix *h_step;
+    Matrix *d_gates_h_step;
+    Matrix *h_prev;
+} SeqBuffers;
+
 typedef struct layer {
+    LayerKind kind;
     Matrix *weights;
     Vector *bias;
+    Matrix *d_weights;
+    Vector *d_bias;
+    // single row output and cache, made by the first net_backpropagation
     Vector *output;
     int n;
+    int n_input;
     Activation *act;
     Cache *cache;
+    // convolution and pooling geometry and workspace
+    ConvShape shape;
+    Matrix *patches;
+    // n_patches x n_filters views of output and cache->delta
+    Matrix *output_view;
+    Matrix *delta_view;
+    int *argmax;
+    // batch norm keeps gamma as a 1 x n weights matrix and beta as bias
+    Vector *running_mean;
+    Vector *running_var;
+    Vector *batch_mean;
+    Vector *batch_inv_std;
+    // recurrent layers keep the input and recurrent weights of all gates
+    // side by side in weights, these are views of the two column blocks
+    RnnShape rnn;
+    Matrix *w_input;
+    Matrix *w_hidden;
+    Matrix *dw_input;
+    Matrix *dw_hidden;
+    // single row workspace and views for net_predict and backpropagation,
+    // the views made together with the cache
+    SeqBuffers *seq;
+    Matrix *prev_view;
+    Matrix *d_input;
+    // embedding rows with a gradient since the last update, each listed
+    // once, the gradient rows of all others stay zero
+    int *touched;
+    bool *is_touched;
+    int n_touched;
+    // pruned weights stay zero while the mask entry is zero
+    Matrix *mask;
+    // compressed weights of a sparsified dense layer, replaces weights
+    SparseMatrix *sparse;
+    // kernel choices, set by net_autotune
+    int mul_block;
+    GemvKernel gemv;
+    // the predict threads of its network hold a copy of weights
+    bool predict_copy;
 } Layer;
 
+// net_predict's activations while some layer has no cache: a copy of the
+// input, and the layer outputs alternating between two vectors, with the
+// views of every layer into them
+typedef struct {
+    int n_layers;
+    Vector *input;
+    Vector *slots[2];
+    Vector **output;
+    Matrix **output_view;
+    Matrix **input_view;
+} PredictSlots;
+
 typedef struct network {
     Layer **layers;
     int n_layers;
+    // single row arenas the layer weights, biases and their gradients
+    // are views into once net_pack_parameters ran
+    Matrix *params;
+    Matrix *grads;
     Loss *loss;
     float learning_rate;
+    int batch_size;
+    // gradual pruning reaches prune_sparsity at the end of epoch prune_end
+    float prune_sparsity;
+    int prune_start;
+    int prune_end;
+    // threads net_evaluate uses when asked for 0, set by net_autotune
+    int eval_threads;
+    // net_train snapshots to checkpoint_path every checkpoint_every steps
+    char *checkpoint_path;
+    int checkpoint_every;
+    // position restored by net_load_checkpoint for the next net_train
+    int *resume_indices;
+    int resume_n;
+    int resume_epoch;
+    int resume_row;
+    long resume_step;
+    // replicas training together average their gradients through it
+    Transport *transport;
+    // the wide dense layers of net_predict, predict_matrix[i] is layer
+    // i's matrix in the pool or -1
+    GemvPool *predict_pool;
+    int *predict_matrix;
+    // never NULL, empty until net_predict needs it
+    PredictSlots *predict_slots;
+    // set by net_set_deterministic, shuffles are keyed by seed and epoch
+    bool deterministic;
+    uint64_t seed;
 } Network;
 
 Cache *create_cache(int n_input, int n_output) {
@@ -54,15 +197,6 @@ Cache *create_cache(int n_input, int n_output) {
         free(cache);
         return NULL;
     }
-    Vector *post_act = create_vector(n_output, true);
-    if (post_act == NULL) {
-        destroy_vector(delta);
-        destroy_vector(prev);
-        destroy_vector(pre_act);
-        free(cache);
-        return NULL;
-    }
-    cache->post_act = post_act;
     cache->pre_act = pre_act;
     cache->delta = delta;
     cache->prev = prev;
@@ -74,57 +208,464 @@ void destroy_cache(Cache *cache) {
     destroy_vector(cache->delta);
     destroy_vector(cache->prev);
     destroy_vector(cache->pre_act);
-    destroy_vector(cache->post_act);
     free(cache);
 }
 
+static void destroy_seq_buffers(SeqBuffers *sb) {
+    assert(sb);
+    Matrix *matrices[] = {sb->x, sb->gates, sb->gates_h, sb->h, sb->c,
+                          sb->d_gates, sb->d_gates_h, sb->d_h, sb->d_h_rec,
+                          sb->d_c, sb->h_step, sb->d_gates_h_step,
+                          sb->h_prev};
+    for (size_t i = 0; i < sizeof(matrices) / sizeof(matrices[0]); i++) {
+        if (matrices[i]) {
+            destroy_matrix(matrices[i]);
+        }
+    }
+    free(sb);
+}
+
+// buffers for every step of n_rows sequences, allocated once for the
+// whole sequence length. The gradients are only needed for training
+static SeqBuffers *create_seq_buffers(const RnnShape *s, int n_rows,
+                                      bool training) {
+    SeqBuffers *sb = calloc(1, sizeof(SeqBuffers));
+    if (sb == NULL) {
+        return NULL;
+    }
+    int steps = s->seq_len * n_rows;
+    int n_gates = rnn_shape_get_n_gates(s) * s->n_hidden;
+    sb->n_rows = n_rows;
+    // packed so that all steps of all rows go through one product
+    sb->x = create_matrix_packed(steps, s->n_input);
+    sb->gates = create_matrix(steps, n_gates);
+    sb->gates_h = create_matrix(n_rows, n_gates);
+    sb->h = create_matrix(steps + n_rows, s->n_hidden);
+    sb->c = create_matrix(steps + n_rows, s->n_hidden);
+    bool ok = sb->x && sb->gates && sb->gates_h && sb->h && sb->c;
+    if (ok) {
+        sb->h_step = matrix_view_rows(sb->h, 0, n_rows);
+        sb->h_prev = matrix_view_rows(sb->h, 0, steps);
+        ok = sb->h_step && sb->h_prev;
+    }
+    if (ok && training) {
+        sb->d_gates = create_matrix(steps, n_gates);
+        sb->d_gates_h = create_matrix(steps, n_gates);
+        sb->d_h = create_matrix(n_rows, s->n_hidden);
+        sb->d_h_rec = create_matrix(n_rows, s->n_hidden);
+        sb->d_c = create_matrix(n_rows, s->n_hidden);
+        ok = sb->d_gates && sb->d_gates_h && sb->d_h && sb->d_h_rec &&
+             sb->d_c;
+        if (ok) {
+            sb->d_gates_h_step = matrix_view_rows(sb->d_gates_h, 0, n_rows);
+            ok = sb->d_gates_h_step != NULL;
+        }
+    }
+    if (!ok) {
+        destroy_seq_buffers(sb);
+        return NULL;
+    }
+    return sb;
+}
+
+// floats create_seq_buffers allocates
+static size_t seq_buffers_floats(const RnnShape *s, int n_rows,
+                                 bool training) {
+    int steps = s->seq_len * n_rows;
+    int n_gates = rnn_shape_get_n_gates(s) * s->n_hidden;
+    size_t floats = (size_t) steps * s->n_input +
+                    matrix_storage_floats(steps, n_gates) +
+                    matrix_storage_floats(n_rows, n_gates) +
+                    2 * matrix_storage_floats(steps + n_rows, s->n_hidden);
+    if (training) {
+        floats += 2 * matrix_storage_floats(steps, n_gates) +
+                  3 * matrix_storage_floats(n_rows, s->n_hidden);
+    }
+    return floats;
+}
+
+static void layer_destroy_row_state(Layer *l) {
+    if (l->output) {
+        destroy_vector(l->output);
+    }
+    if (l->cache) {
+        destroy_cache(l->cache);
+    }
+    Matrix *views[] = {l->output_view, l->delta_view, l->prev_view,
+                       l->d_input};
+    for (int i = 0; i < 4; i++) {
+        if (views[i]) {
+            destroy_matrix(views[i]);
+        }
+    }
+    l->output = NULL;
+    l->cache = NULL;
+    l->output_view = NULL;
+    l->delta_view = NULL;
+    l->prev_view = NULL;
+    l->d_input = NULL;
+}
+
+// the single row output and cache net_backpropagation needs, with the
+// conv and recurrent views of them. Inference only networks never make
+// them. Returns -1 when out of memory
+static int layer_create_row_state(Layer *l) {
+    l->output = create_vector(l->n, true);
+    l->cache = create_cache(l->n_input, l->n);
+    bool ok = l->output && l->cache;
+    if (ok && l->kind == LAYER_CONV2D) {
+        int n_patches = conv_shape_get_n_patches(&l->shape);
+        int n_filters = matrix_get_n_rows(l->weights);
+        l->output_view = create_matrix_view(vector_get_data_mut(l->output),
+                                            n_patches, n_filters, n_filters);
+        l->delta_view = create_matrix_view(
+            vector_get_data_mut(l->cache->delta), n_patches, n_filters,
+            n_filters);
+        ok = l->output_view && l->delta_view;
+    }
+    if (ok && l->kind == LAYER_RECURRENT) {
+        l->prev_view = create_matrix_view(vector_get_data_mut(l->cache->prev),
+                                          1, l->n_input, l->n_input);
+        l->d_input = create_matrix(1, l->n_input);
+        l->output_view = create_matrix_view(vector_get_data_mut(l->output), 1,
+                                            l->n, l->n);
+        l->delta_view = create_matrix_view(
+            vector_get_data_mut(l->cache->delta), 1, l->n, l->n);
+        ok = l->prev_view && l->d_input && l->output_view && l->delta_view;
+    }
+    if (!ok) {
+        layer_destroy_row_state(l);
+        return -1;
+    }
+    return 0;
+}
+
+void destroy_layer(Layer *l) {
+    assert(l);
+    if (l->weights) {
+        destroy_matrix(l->weights);
+    }
+    if (l->bias) {
+        destroy_vector(l->bias);
+    }
+    if (l->d_weights) {
+        destroy_matrix(l->d_weights);
+    }
+    if (l->d_bias) {
+        destroy_vector(l->d_bias);
+    }
+    layer_destroy_row_state(l);
+    if (l->patches) {
+        destroy_matrix(l->patches);
+    }
+    if (l->mask) {
+        destroy_matrix(l->mask);
+    }
+    if (l->sparse) {
+        destroy_sparse_matrix(l->sparse);
+    }
+    free(l->argmax);
+    free(l->touched);
+    free(l->is_touched);
+    Vector *stats[] = {l->running_mean, l->running_var, l->batch_mean,
+                       l->batch_inv_std};
+    for (int i = 0; i < 4; i++) {
+        if (stats[i]) {
+            destroy_vector(stats[i]);
+        }
+    }
+    Matrix *recurrent[] = {l->w_input, l->w_hidden, l->dw_input,
+                           l->dw_hidden};
+    for (int i = 0; i < 4; i++) {
+        if (recurrent[i]) {
+            destroy_matrix(recurrent[i]);
+        }
+    }
+    if (l->seq) {
+        destroy_seq_buffers(l->seq);
+    }
+    free(l);
+}
+
+// layers without parameters pass weight_rows = 0, without bias n_bias = 0
+static Layer *create_layer_of_kind(LayerKind kind, int n_input, int n_output,
+                                   int weight_rows, int weight_cols,
+                                   int n_bias) {
+    Layer *l = calloc(1, sizeof(Layer));
+    if (l == NULL) {
+        return NULL;
+    }
+    l->kind = kind;
+    l->n = n_output;
+    l->n_input = n_input;
+    l->act = NULL;
+    l->mul_block = MATRIX_MUL_BLOCK;
+    l->gemv = GEMV_MULTI_ROW;
+    bool ok = true;
+    if (weight_rows > 0) {
+        l->weights = create_matrix(weight_rows, weight_cols);
+        l->d_weights = create_matrix(weight_rows, weight_cols);
+        ok = ok && l->weights && l->d_weights;
+    }
+    if (n_bias > 0) {
+        l->bias = create_vector(n_bias, true);
+        l->d_bias = create_vector(n_bias, true);
+        ok = ok && l->bias && l->d_bias;
+    }
+    if (!ok) {
+        destroy_layer(l);
+        return NULL;
+    }
+    return l;
+}
+
 Layer *create_layer(int n_input, int n_output) {
-    Matrix *weights = create_matrix(n_output, n_input);
-    if (weights == NULL) {
+    return create_layer_of_kind(LAYER_DENSE, n_input, n_output, n_output,
+                                n_input, n_output);
+}
+
+// the weights hold one row of kernel * kernel * channels taps per filter
+Layer *create_conv_layer(int channels, int height, int width, int n_filters,
+                         int kernel, int stride, int padding) {
+    assert(n_filters > 0);
+    ConvShape shape = make_conv_shape(channels, height, width, kernel, stride,
+                                      padding);
+    int n_patches = conv_shape_get_n_patches(&shape);
+    int patch_size = conv_shape_get_patch_size(&shape);
+    Layer *l = create_layer_of_kind(LAYER_CONV2D,
+                                    conv_shape_get_n_input(&shape),
+                                    n_patches * n_filters, n_filters,
+                                    patch_size, n_filters);
+    if (l == NULL) {
         return NULL;
     }
-    Vector *bias = create_vector(n_output, true);
-    if (bias == NULL) {
-        destroy_matrix(weights);
+    l->shape = shape;
+    // im2row writes the patches as one flat array
+    l->patches = create_matrix_packed(n_patches, patch_size);
+    if (l->patches == NULL) {
+        destroy_layer(l);
         return NULL;
     }
-    Vector *output = create_vector(n_output, true);
-    if (output == NULL) {
-        destroy_matrix(weights);
-        destroy_vector(bias);
+    return l;
+}
+
+static Layer *create_pool_layer(LayerKind kind, int channels, int height,
+                                int width, int size, int stride) {
+    ConvShape shape = make_conv_shape(channels, height, width, size, stride,
+                                      0);
+    int n_output = conv_shape_get_n_patches(&shape) * channels;
+    Layer *l = create_layer_of_kind(kind, conv_shape_get_n_input(&shape),
+                                    n_output, 0, 0, 0);
+    if (l == NULL) {
         return NULL;
     }
-    Layer *l = malloc(sizeof(Layer));
+    l->shape = shape;
+    if (kind == LAYER_MAX_POOL2D) {
+        l->argmax = malloc(sizeof(int) * n_output);
+        if (l->argmax == NULL) {
+            destroy_layer(l);
+            return NULL;
+        }
+    }
+    return l;
+}
+
+Layer *create_max_pool_layer(int channels, int height, int width, int size,
+                             int stride) {
+    return create_pool_layer(LAYER_MAX_POOL2D, channels, height, width, size,
+                             stride);
+}
+
+Layer *create_avg_pool_layer(int channels, int height, int width, int size,
+                             int stride) {
+    return create_pool_layer(LAYER_AVG_POOL2D, channels, height, width, size,
+                             stride);
+}
+
+// constant initializers, matrix_initialize passes the shape and
+// vector_initialize the length, which they do not need
+static float one_initializator(int n_input, int n_output) {
+    (void) n_input;
+    (void) n_output;
+    return 1;
+}
+
+static float zero_initializator(int n) {
+    (void) n;
+    return 0;
+}
+
+static float unit_initializator(int n) {
+    (void) n;
+    return 1;
+}
+
+// normalizes each of the n features, place it between a dense layer
+// without activation and the activation itself so it can be folded
+Layer *create_batchnorm_layer(int n) {
+    Layer *l = create_layer_of_kind(LAYER_BATCHNORM, n, n, 1, n, n);
     if (l == NULL) {
-        destroy_matrix(weights);
-        destroy_vector(bias);
-        destroy_vector(output);
         return NULL;
     }
-    Cache *cache = create_cache(n_input, n_output);
-    if (cache == NULL) {
-        destroy_matrix(weights);
-        destroy_vector(bias);
-        destroy_vector(output);
-        free(l);
+    l->running_mean = create_vector(n, true);
+    l->running_var = create_vector(n, true);
+    l->batch_mean = create_vector(n, true);
+    l->batch_inv_std = create_vector(n, true);
+    if (l->running_mean == NULL || l->running_var == NULL ||
+        l->batch_mean == NULL || l->batch_inv_std == NULL) {
+        destroy_layer(l);
         return NULL;
     }
-    l->n = n_output;
-    l->weights = weights;
-    l->bias = bias;
-    l->output = output;
-    l->act = NULL;
-    l->cache = cache;
+    matrix_initialize(l->weights, &one_initializator);
+    vector_initialize(l->bias, &zero_initializator);
+    vector_initialize(l->running_mean, &zero_initializator);
+    vector_initialize(l->running_var, &unit_initializator);
     return l;
 }
 
-void destroy_layer(Layer *l) {
-    assert(l);
-    destroy_matrix(l->weights);
-    destroy_vector(l->bias);
-    destroy_vector(l->output);
-    destroy_cache(l->cache);
-    free(l);
+// looks up n_fields category indices per row, stored as floats, in one
+// table of n_categories rows of dim floats and outputs the n_fields rows
+// side by side. A step only reads and updates the rows a batch used, so
+// the table stays out of the parameter arena. One more row is kept for
+// indices outside 0 .. n_categories - 1, see embedding_index
+Layer *create_embedding_layer(int n_fields, int n_categories, int dim) {
+    assert(n_fields > 0);
+    assert(n_categories > 0);
+    assert(dim > 0);
+    int n_rows = n_categories + 1;
+    Layer *l = create_layer_of_kind(LAYER_EMBEDDING, n_fields, n_fields * dim,
+                                    n_rows, dim, 0);
+    if (l == NULL) {
+        return NULL;
+    }
+    // a batch touches at most every row once
+    l->touched = malloc(sizeof(int) * n_rows);
+    l->is_touched = calloc(n_rows, sizeof(bool));
+    if (l->touched == NULL || l->is_touched == NULL) {
+        destroy_layer(l);
+        return NULL;
+    }
+    return l;
+}
+
+// the input and recurrent weight blocks of a recurrent layer as views of
+// weights and d_weights, NULL views when out of memory
+static void recurrent_weight_views(const RnnShape *s, const Matrix *weights,
+                                   const Matrix *d_weights, Matrix **views) {
+    int rows = rnn_shape_get_n_gates(s) * s->n_hidden;
+    views[0] = matrix_view_block(weights, 0, rows, 0, s->n_input);
+    views[1] = matrix_view_block(weights, 0, rows, s->n_input, s->n_hidden);
+    views[2] = matrix_view_block(d_weights, 0, rows, 0, s->n_input);
+    views[3] = matrix_view_block(d_weights, 0, rows, s->n_input,
+                                 s->n_hidden);
+}
+
+// a plain RNN, GRU or LSTM over sequences of seq_len steps of n_input
+// features flattened into one row. It outputs the last hidden state, or
+// the hidden states of all steps with return_sequences. The weights hold
+// one row per gate unit, the gate's input weights followed by its
+// recurrent weights, so the input part of all gates and all steps of a
+// batch is a single product
+Layer *create_recurrent_layer(CellKind cell, int seq_len, int n_input,
+                              int n_hidden, bool return_sequences) {
+    RnnShape shape = make_rnn_shape(cell, seq_len, n_input, n_hidden,
+                                    return_sequences);
+    int n_gates = rnn_shape_get_n_gates(&shape) * n_hidden;
+    Layer *l = create_layer_of_kind(LAYER_RECURRENT,
+                                    rnn_shape_get_n_input(&shape),
+                                    rnn_shape_get_n_output(&shape), n_gates,
+                                    n_input + n_hidden, n_gates);
+    if (l == NULL) {
+        return NULL;
+    }
+    l->rnn = shape;
+    Matrix *views[4];
+    recurrent_weight_views(&shape, l->weights, l->d_weights, views);
+    l->w_input = views[0];
+    l->w_hidden = views[1];
+    l->dw_input = views[2];
+    l->dw_hidden = views[3];
+    l->seq = create_seq_buffers(&shape, 1, true);
+    if (l->w_input == NULL || l->w_hidden == NULL || l->dw_input == NULL ||
+        l->dw_hidden == NULL || l->seq == NULL) {
+        destroy_layer(l);
+        return NULL;
+    }
+    return l;
+}
+
+static void drop_predict_slots(PredictSlots *s) {
+    Vector *vectors[] = {s->input, s->slots[0], s->slots[1]};
+    for (int i = 0; i < 3; i++) {
+        if (vectors[i]) {
+            destroy_vector(vectors[i]);
+        }
+    }
+    for (int i = 0; i < s->n_layers; i++) {
+        if (s->output[i]) {
+            destroy_vector(s->output[i]);
+        }
+        Matrix *views[] = {s->output_view[i], s->input_view[i]};
+        for (int v = 0; v < 2; v++) {
+            if (views[v]) {
+                destroy_matrix(views[v]);
+            }
+        }
+    }
+    free(s->output);
+    free(s->output_view);
+    free(s->input_view);
+    memset(s, 0, sizeof(PredictSlots));
+}
+
+// layer i writes slots[i % 2] and reads the input copy or the slot the
+// layer before wrote. Returns -1 when out of memory
+static int create_predict_slots(const Network *net, PredictSlots *s) {
+    int n_layers = net->n_layers;
+    int n_max = 0;
+    for (int i = 0; i < n_layers; i++) {
+        n_max = net->layers[i]->n > n_max ? net->layers[i]->n : n_max;
+    }
+    s->n_layers = n_layers;
+    s->input = create_vector(net->layers[0]->n_input, true);
+    s->slots[0] = create_vector(n_max, true);
+    s->slots[1] = create_vector(n_max, true);
+    s->output = calloc(n_layers, sizeof(Vector *));
+    s->output_view = calloc(n_layers, sizeof(Matrix *));
+    s->input_view = calloc(n_layers, sizeof(Matrix *));
+    if (s->input == NULL || s->slots[0] == NULL || s->slots[1] == NULL ||
+        s->output == NULL || s->output_view == NULL ||
+        s->input_view == NULL) {
+        s->n_layers = 0;
+        drop_predict_slots(s);
+        return -1;
+    }
+    bool ok = true;
+    for (int i = 0; i < n_layers && ok; i++) {
+        const Layer *l = net->layers[i];
+        float *out = vector_get_data_mut(s->slots[i % 2]);
+        float *in = vector_get_data_mut(i == 0 ? s->input
+                                               : s->slots[(i - 1) % 2]);
+        s->output[i] = create_vector_view(out, l->n, true);
+        ok = s->output[i] != NULL;
+        if (l->kind == LAYER_CONV2D) {
+            int n_filters = matrix_get_n_rows(l->weights);
+            s->output_view[i] = create_matrix_view(
+                out, conv_shape_get_n_patches(&l->shape), n_filters,
+                n_filters);
+            ok = ok && s->output_view[i];
+        } else if (l->kind == LAYER_RECURRENT) {
+            s->output_view[i] = create_matrix_view(out, 1, l->n, l->n);
+            s->input_view[i] = create_matrix_view(in, 1, l->n_input,
+                                                  l->n_input);
+            ok = ok && s->output_view[i] && s->input_view[i];
+        }
+    }
+    if (!ok) {
+        drop_predict_slots(s);
+        return -1;
+    }
+    return 0;
 }
 
 Network *create_network(int n_layers, float lr) {
@@ -133,13 +674,33 @@ Network *create_network(int n_layers, float lr) {
         return NULL;
     }
     Network *net = malloc(sizeof(Network));
-    if (net == NULL) {
+    PredictSlots *slots = calloc(1, sizeof(PredictSlots));
+    if (net == NULL || slots == NULL) {
         free(layers);
+        free(net);
+        free(slots);
         return NULL;
     }
     net->layers = layers;
     net->n_layers = n_layers;
     net->learning_rate = lr;
+    net->batch_size = 1;
+    net->params = NULL;
+    net->grads = NULL;
+    net->prune_sparsity = 0;
+    net->prune_start = 0;
+    net->prune_end = 0;
+    net->eval_threads = 1;
+    net->checkpoint_path = NULL;
+    net->checkpoint_every = 0;
+    net->resume_indices = NULL;
+    net->resume_n = 0;
+    net->transport = NULL;
+    net->predict_pool = NULL;
+    net->predict_matrix = NULL;
+    net->predict_slots = slots;
+    net->deterministic = false;
+    net->seed = 0;
     return net;
 }
 
@@ -152,8 +713,17 @@ static void destroy_network_layers(Network *net) {
 
 void destroy_network(Network *net) {
     assert(net);
+    net_set_predict_threads(net, 1);
     destroy_network_layers(net);
+    if (net->params) {
+        destroy_matrix(net->params);
+        destroy_matrix(net->grads);
+    }
+    drop_predict_slots(net->predict_slots);
+    free(net->predict_slots);
     free(net->layers);
+    free(net->checkpoint_path);
+    free(net->resume_indices);
     free(net);
 }
 
@@ -164,6 +734,12 @@ int net_get_n_output(const Network *net) {
 
 int layer_get_n_weights(const Layer *l) {
     assert(l);
+    if (l->sparse) {
+        return sparse_matrix_get_nnz(l->sparse);
+    }
+    if (l->weights == NULL) {
+        return 0;
+    }
     return matrix_get_n_elem(l->weights);
 }
 
@@ -174,7 +750,9 @@ const Matrix *layer_get_weights(const Layer *l) {
 
 void layer_set_weights(const Layer *l, const Matrix *new_weights) {
     assert(l);
+    assert(l->weights);
     assert(new_weights);
+    assert(!l->predict_copy);
     matrix_copy(l->weights, new_weights);
 }
 
@@ -198,16 +776,26 @@ void layer_initialize_weights(const Layer *l,
                               float (*const method) (int, int)) {
     assert(l);
     assert(method);
-    matrix_initialize(l->weights, method);
-}
-
-static float zero_initializator(int n) {
-    return 0;
+    assert(!l->predict_copy);
+    if (l->kind == LAYER_BATCHNORM) {
+        matrix_initialize(l->weights, &one_initializator);
+    } else if (l->weights) {
+        matrix_initialize(l->weights, method);
+    }
 }
 
 void layer_initialize_bias(const Layer *l) {
     assert(l);
-    vector_initialize(l->bias, &zero_initializator);
+    if (l->bias) {
+        vector_initialize(l->bias, &zero_initializator);
+    }
+    // an LSTM starts out keeping its cell state, forget gates open
+    if (l->kind == LAYER_RECURRENT && l->rnn.cell == CELL_LSTM) {
+        float *forget = vector_get_data_mut(l->bias) + l->rnn.n_hidden;
+        for (int j = 0; j < l->rnn.n_hidden; j++) {
+            forget[j] = 1;
+        }
+    }
 }
 
 void layer_initialize(const Layer *l, float (*const method) (int, int)) {
@@ -216,182 +804,3964 @@ void layer_initialize(const Layer *l, float (*const method) (int, int)) {
     layer_initialize_bias(l);
 }
 
+void net_set_batch_size(Network *net, int batch_size) {
+    assert(net);
+    assert(batch_size > 0);
+    net->batch_size = batch_size;
+}
+
+// in deterministic mode training gives the same bits whatever the
+// threads, stages or micro-batches. Epoch orders are permutations keyed
+// by seed and the epoch instead of draws from the global generator, and
+// losses are summed row by row in sample order
+void net_set_deterministic(Network *net, bool on, uint64_t seed) {
+    assert(net);
+    net->deterministic = on;
+    net->seed = seed;
+}
+
+// the sample order of epoch, stream -1 picks the shards of
+// net_train_parallel
+static void net_shuffle(const Network *net, int *indices, int n,
+                        long stream) {
+    if (net->deterministic) {
+        shuffle_keyed(indices, n, rand_hash(net->seed, (uint64_t) stream));
+    } else {
+        shuffle(indices, n);
+    }
+}
+
+// stops the predict threads, whose copies of the weights go stale as
+// soon as anything writes them
+static void drop_predict_pool(Network *net) {
+    if (net->predict_pool) {
+        for (int i = 0; i < net->n_layers; i++) {
+            net->layers[i]->predict_copy = false;
+        }
+        destroy_gemv_pool(net->predict_pool);
+        free(net->predict_matrix);
+        net->predict_pool = NULL;
+        net->predict_matrix = NULL;
+    }
+}
+
 void net_set_layer(Network *net, Layer *l, int index) {
     assert(net);
     assert(l);
     assert(index < net->n_layers);
     assert(index >= 0);
+    // packed arenas are laid out for the layers they were built from
+    assert(net->params == NULL);
+    drop_predict_pool(net);
+    // the slots are sized for the layers they were made for
+    drop_predict_slots(net->predict_slots);
     net->layers[index] = l;
 }
 
-static void layer_apply(Layer *l, const Vector *input) {
-    assert(l);
-    assert(input);
-    vector_copy(l->cache->prev, input);
-    matrix_vec_mul(l->weights, input, l->output);
-    vector_add(l->output, l->bias, l->output);
-    vector_copy(l->cache->pre_act, l->output);
-    if (l->act) {
-        l->act->forward(l->output);
+// embedding tables are updated row by row on their own
+static bool layer_in_arena(const Layer *l) {
+    return l->weights && l->kind != LAYER_EMBEDDING;
+}
+
+// floats a layer takes in each arena, every piece starts on a cache line
+static size_t layer_arena_floats(const Layer *l) {
+    if (!layer_in_arena(l)) {
+        return 0;
     }
-    vector_copy(l->cache->post_act, l->output);
+    return matrix_storage_floats(matrix_get_n_rows(l->weights),
+                                 matrix_get_n_cols(l->weights)) +
+           matrix_storage_floats(1, vector_get_n(l->bias));
 }
 
-void net_predict(const Network *net, const Vector *input, Vector *output) {
-    assert(net);
-    assert(input);
-    assert(output);
+// columns of the packed arenas, at least one
+static int net_arena_floats(const Network *net) {
+    size_t total = 0;
     for (int i = 0; i < net->n_layers; i++) {
-        Layer *current_layer = net->layers[i];
-        layer_apply(current_layer, input);
-        input = current_layer->output;
+        total += layer_arena_floats(net->layers[i]);
     }
-    assert(vector_get_n(output) == vector_get_n(input));
-    vector_copy_data(output, vector_get_data(input), vector_get_n(input));
+    return total > 0 ? (int) total : 1;
 }
 
-float net_forward_loss(const Network *net, const Vector *prediction,
-                        const Vector *target) {
-    assert(net);
-    assert(prediction);
-    assert(target);
-    assert(net->loss);
-    return net->loss->forward(prediction, target);
-}
+typedef struct {
+    Matrix *weights;
+    Vector *bias;
+    Matrix *d_weights;
+    Vector *d_bias;
+    // recurrent weight block views, see recurrent_weight_views
+    Matrix *views[4];
+} PackedLayer;
 
-static void layer_update(const Layer *l, const Matrix *dW, const Vector *db,
-                        float lr) {
-    assert(l);
-    assert(dW);
-    assert(db);
-    matrix_scaled_sub(l->weights, dW, lr);
-    vector_scaled_sub(l->bias, db, lr);
+static void destroy_packed_layer(PackedLayer *p) {
+    for (int i = 0; i < 4; i++) {
+        if (p->views[i]) {
+            destroy_matrix(p->views[i]);
+        }
+    }
+    if (p->weights) {
+        destroy_matrix(p->weights);
+    }
+    if (p->bias) {
+        destroy_vector(p->bias);
+    }
+    if (p->d_weights) {
+        destroy_matrix(p->d_weights);
+    }
+    if (p->d_bias) {
+        destroy_vector(p->d_bias);
+    }
 }
 
-void net_backpropagation(const Network *net, const Vector *prediciton,
-                         const Vector *target) {
+// moves every weight and bias into one aligned parameter arena and every
+// gradient into a second one, the layers keep views into them. Whole
+// model updates, reductions and snapshots then run over two flat arrays.
+// Layers must all be set, packing again is a no-op. Returns 0 or -1 when
+// out of memory, leaving the network unchanged
+int net_pack_parameters(Network *net) {
     assert(net);
-    assert(prediciton);
-    assert(target);
-    assert(net->loss);
-
-    int n_layers = net->n_layers;
-    int n_out = vector_get_n(target);
-    assert(n_out == vector_get_n(prediciton));
-
-    Vector *delta = net->layers[n_layers - 1]->cache->delta;
-    assert(n_out == vector_get_n(delta));
-
-    net->loss->backward(delta, prediciton, target);
-    for (int i = n_layers - 1; i >= 0; i--) {
-        Layer *current_layer = net->layers[i];
-        Cache *cache = current_layer->cache;
-        delta = cache->delta;
-        assert(delta);
-        Matrix *dW = create_matrix(current_layer->n,
-                                   vector_get_n(cache->prev));
-        if (current_layer->act) {
-            current_layer->act->update_delta(delta, cache->pre_act,
-                                        cache->post_act);
+    if (net->params) {
+        return 0;
+    }
+    int n_floats = net_arena_floats(net);
+    Matrix *params = create_matrix(1, n_floats);
+    Matrix *grads = create_matrix(1, n_floats);
+    PackedLayer *packed = calloc(net->n_layers, sizeof(PackedLayer));
+    bool ok = params && grads && packed;
+    float *p = ok ? matrix_get_row_mut(params, 0) : NULL;
+    float *g = ok ? matrix_get_row_mut(grads, 0) : NULL;
+    for (int i = 0; ok && i < net->n_layers; i++) {
+        Layer *l = net->layers[i];
+        if (!layer_in_arena(l)) {
+            continue;
         }
-        vector_transpose(cache->prev);
-        matrix_outer_mul(dW, delta, cache->prev);
-        vector_transpose(cache->prev);
-        if (i > 0) {
-            matrix_T_vec_mul(current_layer->weights, delta,
-                             net->layers[i - 1]->cache->delta);
+        int rows = matrix_get_n_rows(l->weights);
+        int cols = matrix_get_n_cols(l->weights);
+        int n_bias = vector_get_n(l->bias);
+        size_t w_floats = matrix_storage_floats(rows, cols);
+        size_t b_floats = matrix_storage_floats(1, n_bias);
+        PackedLayer *pl = &packed[i];
+        pl->weights = create_matrix_in(p, rows, cols);
+        pl->d_weights = create_matrix_in(g, rows, cols);
+        pl->bias = create_vector_view(p + w_floats, n_bias, true);
+        pl->d_bias = create_vector_view(g + w_floats, n_bias, true);
+        ok = pl->weights && pl->d_weights && pl->bias && pl->d_bias;
+        if (ok && l->kind == LAYER_RECURRENT) {
+            recurrent_weight_views(&l->rnn, pl->weights, pl->d_weights,
+                                   pl->views);
+            ok = pl->views[0] && pl->views[1] && pl->views[2] &&
+                 pl->views[3];
+        }
+        p += w_floats + b_floats;
+        g += w_floats + b_floats;
+    }
+    if (!ok) {
+        for (int i = 0; packed && i < net->n_layers; i++) {
+            destroy_packed_layer(&packed[i]);
+        }
+        free(packed);
+        if (params) {
+            destroy_matrix(params);
+        }
+        if (grads) {
+            destroy_matrix(grads);
         }
-        layer_update(current_layer, dW, cache->delta, net->learning_rate);
-        destroy_matrix(dW);
+        return -1;
     }
+    for (int i = 0; i < net->n_layers; i++) {
+        Layer *l = net->layers[i];
+        if (!layer_in_arena(l)) {
+            continue;
+        }
+        PackedLayer *pl = &packed[i];
+        matrix_copy(pl->weights, l->weights);
+        vector_copy(pl->bias, l->bias);
+        // the old storage goes, the arena views take its place
+        PackedLayer old = {l->weights, l->bias, l->d_weights, l->d_bias,
+                           {l->w_input, l->w_hidden, l->dw_input,
+                            l->dw_hidden}};
+        destroy_packed_layer(&old);
+        l->weights = pl->weights;
+        l->bias = pl->bias;
+        l->d_weights = pl->d_weights;
+        l->d_bias = pl->d_bias;
+        l->w_input = pl->views[0];
+        l->w_hidden = pl->views[1];
+        l->dw_input = pl->views[2];
+        l->dw_hidden = pl->views[3];
+    }
+    free(packed);
+    net->params = params;
+    net->grads = grads;
+    return 0;
 }
 
-void net_predict_batch(const Network *net, const Matrix *X, Matrix *Y_hat) {
+// the parameter arena and its length in floats, NULL before packing.
+// The padding between layers reads as zero
+float *net_get_parameters(Network *net, int *n_floats) {
     assert(net);
-    assert(X);
-    assert(Y_hat);
-    int n = matrix_get_n_rows(X);
-    assert(n == matrix_get_n_rows(Y_hat));
-    Vector *row = create_vector(matrix_get_n_cols(X), true);
-    Vector *pred = create_vector(matrix_get_n_cols(Y_hat), true);
-    vector_free_data(row);
-    for (int i = 0; i < n; i++) {
-        matrix_row_as_vec(row, X, i);
-        net_predict(net, row, pred);
-        matrix_set_row(Y_hat, pred, i);
+    assert(n_floats);
+    if (net->params == NULL) {
+        *n_floats = 0;
+        return NULL;
     }
-    free(row);
-    destroy_vector(pred);
+    *n_floats = matrix_get_n_cols(net->params);
+    return matrix_get_row_mut(net->params, 0);
 }
 
-float net_loss_batch(const Network *net, const Matrix *Y_hat, const Matrix *Y) {
+// the gradient arena laid out like the parameter arena
+float *net_get_gradients(Network *net, int *n_floats) {
     assert(net);
-    assert(Y_hat);
-    assert(Y);
-    int n = matrix_get_n_rows(Y_hat);
-    assert(n == matrix_get_n_rows(Y));
-    int n_cols = matrix_get_n_cols(Y_hat);
-    assert(n_cols == matrix_get_n_cols(Y));
-    Vector *pred = create_vector(n_cols, true);
-    Vector *target = create_vector(n_cols, true);
-    vector_free_data(pred);
-    vector_free_data(target);
-    float total = 0;
-    for (int i = 0; i < n; i++) {
-        matrix_row_as_vec(pred, Y_hat, i);
-        matrix_row_as_vec(target, Y, i);
-        total += net_forward_loss(net, pred, target);
+    assert(n_floats);
+    if (net->grads == NULL) {
+        *n_floats = 0;
+        return NULL;
     }
-    free(pred);
-    free(target);
-    return total / n;
+    *n_floats = matrix_get_n_cols(net->grads);
+    return matrix_get_row_mut(net->grads, 0);
 }
 
-void net_train(const Network *net, const Matrix *X, const Matrix *Y,
-    int epochs) {
-    assert(net);
-    assert(X);
-    assert(Y);
-    int n = matrix_get_n_rows(X);
-    assert(n == matrix_get_n_rows(Y));
-    int *indices = malloc(sizeof(int) * n);
-    for (int i = 0; i < n; i++) {
-        indices[i] = i;
+// single samples are normalized with the running statistics
+static void batchnorm_forward(const Layer *l, const float *x, float *y) {
+    const float *gamma = matrix_get_row(l->weights, 0);
+    const float *beta = vector_get_data(l->bias);
+    const float *mean = vector_get_data(l->running_mean);
+    const float *var = vector_get_data(l->running_var);
+    for (int j = 0; j < l->n; j++) {
+        float inv_std = 1.0f / sqrtf(var[j] + BN_EPSILON);
+        y[j] = gamma[j] * (x[j] - mean[j]) * inv_std + beta[j];
     }
-    int x_cols = matrix_get_n_cols(X);
-    int y_cols = matrix_get_n_cols(Y);
-    Vector *input = create_vector(x_cols, true);
-    Vector *target = create_vector(y_cols, true);
-    Vector *output = create_vector(y_cols, true);
-    vector_free_data(input);
-    vector_free_data(target); 
-    for (int i = 0; i < epochs; i++) {
-        #ifdef VERBOSE
-            printf("--------------\n");
-            printf("EPOCH: %d\n", i);
-        #endif
-        shuffle(indices, n);
-        float total_loss = 0;
-        for (int j = 0; j < n; j++) {
-            int k = indices[j];
-            matrix_row_as_vec(input, X, k);
-            matrix_row_as_vec(target, Y, k);
-            net_predict(net, input, output);
-            float loss = net_forward_loss(net, output, target);
-            #ifdef DEBUG
-                printf("Predicted Vector:\n");
-                vector_print(output);
-                printf("Loss: %.2f\n", loss);
+}
+
+// runs the sequences in the rows of input through a recurrent layer,
+// keeping every step's gates and states in sb for the backward pass
+static void recurrent_forward(const Layer *l, const Matrix *input,
+                              Matrix *output, SeqBuffers *sb) {
+    const RnnShape *s = &l->rnn;
+    int n_rows = matrix_get_n_rows(input);
+    assert(n_rows == sb->n_rows);
+    int n_in = s->n_input;
+    int n_hidden = s->n_hidden;
+    for (int b = 0; b < n_rows; b++) {
+        const float *seq = matrix_get_row(input, b);
+        for (int t = 0; t < s->seq_len; t++) {
+            memcpy(matrix_get_row_mut(sb->x, t * n_rows + b), &seq[t * n_in],
+                   sizeof(float) * n_in);
+        }
+    }
+    // the input part of all gates of all steps at once
+    matrix_mul_T_blocked(sb->x, l->w_input, sb->gates, l->mul_block);
+    matrix_add_row_vec(sb->gates, l->bias);
+    for (int t = 0; t < s->seq_len; t++) {
+        // the initial state is zero, and so is its projection
+        if (t == 0) {
+            for (int b = 0; b < n_rows; b++) {
+                memset(matrix_get_row_mut(sb->gates_h, b), 0,
+                       sizeof(float) * matrix_get_n_cols(sb->gates_h));
+            }
+        } else {
+            matrix_view_move_rows(sb->h_step, sb->h, t * n_rows);
+            matrix_mul_T_blocked(sb->h_step, l->w_hidden, sb->gates_h,
+                                 l->mul_block);
+        }
+        for (int b = 0; b < n_rows; b++) {
+            int prev = t * n_rows + b;
+            int next = prev + n_rows;
+            rnn_cell_forward(s, matrix_get_row_mut(sb->gates, prev),
+                             matrix_get_row(sb->gates_h, b),
+                             matrix_get_row(sb->h, prev),
+                             matrix_get_row_mut(sb->h, next),
+                             matrix_get_row(sb->c, prev),
+                             matrix_get_row_mut(sb->c, next));
+        }
+    }
+    for (int b = 0; b < n_rows; b++) {
+        float *out = matrix_get_row_mut(output, b);
+        int first = s->return_sequences ? 0 : s->seq_len - 1;
+        for (int t = first; t < s->seq_len; t++) {
+            memcpy(&out[(t - first) * n_hidden],
+                   matrix_get_row(sb->h, (t + 1) * n_rows + b),
+                   sizeof(float) * n_hidden);
+        }
+    }
+}
+
+// backpropagation through time from the gradient of the outputs in delta,
+// fills the layer gradients, or adds to them with accumulate, and, when
+// prev_delta is given, the gradient of the input sequences. The weight
+// gradients are one product each over all steps
+static void recurrent_backward(const Layer *l, const Matrix *delta,
+                               Matrix *prev_delta, SeqBuffers *sb,
+                               bool accumulate) {
+    const RnnShape *s = &l->rnn;
+    int n_rows = matrix_get_n_rows(delta);
+    assert(n_rows == sb->n_rows);
+    int n_in = s->n_input;
+    int n_hidden = s->n_hidden;
+    for (int b = 0; b < n_rows; b++) {
+        memset(matrix_get_row_mut(sb->d_h, b), 0, sizeof(float) * n_hidden);
+        memset(matrix_get_row_mut(sb->d_c, b), 0, sizeof(float) * n_hidden);
+    }
+    for (int t = s->seq_len - 1; t >= 0; t--) {
+        for (int b = 0; b < n_rows; b++) {
+            float *d_h = matrix_get_row_mut(sb->d_h, b);
+            const float *d_out = matrix_get_row(delta, b);
+            if (s->return_sequences) {
+                float_add(d_h, d_h, &d_out[t * n_hidden], n_hidden);
+            } else if (t == s->seq_len - 1) {
+                float_add(d_h, d_h, d_out, n_hidden);
+            }
+            int prev = t * n_rows + b;
+            int next = prev + n_rows;
+            rnn_cell_backward(s, matrix_get_row_mut(sb->d_gates, prev),
+                              matrix_get_row_mut(sb->d_gates_h, prev), d_h,
+                              matrix_get_row_mut(sb->d_c, b),
+                              matrix_get_row(sb->gates, prev),
+                              matrix_get_row(sb->h, prev),
+                              matrix_get_row(sb->c, prev),
+                              matrix_get_row(sb->c, next));
+        }
+        if (t > 0) {
+            matrix_view_move_rows(sb->d_gates_h_step, sb->d_gates_h,
+                                  t * n_rows);
+            matrix_mul_blocked(sb->d_gates_h_step, l->w_hidden, sb->d_h_rec,
+                               l->mul_block);
+            for (int b = 0; b < n_rows; b++) {
+                float *d_h = matrix_get_row_mut(sb->d_h, b);
+                float_add(d_h, d_h, matrix_get_row(sb->d_h_rec, b), n_hidden);
+            }
+        }
+    }
+    if (!accumulate) {
+        matrix_T_mul_blocked(sb->d_gates, sb->x, l->dw_input, l->mul_block);
+        // the first step's recurrent term multiplies the zero initial state
+        matrix_T_mul_blocked(sb->d_gates_h, sb->h_prev, l->dw_hidden,
+                             l->mul_block);
+        matrix_sum_rows(sb->d_gates, l->d_bias);
+    } else {
+        matrix_T_mul_acc_blocked(sb->d_gates, sb->x, l->dw_input,
+                                 l->mul_block);
+        matrix_T_mul_acc_blocked(sb->d_gates_h, sb->h_prev, l->dw_hidden,
+                                 l->mul_block);
+        matrix_sum_rows_acc(sb->d_gates, l->d_bias);
+    }
+    if (prev_delta == NULL) {
+        return;
+    }
+    // x is not needed anymore and takes the gradient of every step
+    matrix_mul_blocked(sb->d_gates, l->w_input, sb->x, l->mul_block);
+    for (int b = 0; b < n_rows; b++) {
+        float *d_seq = matrix_get_row_mut(prev_delta, b);
+        for (int t = 0; t < s->seq_len; t++) {
+            memcpy(&d_seq[t * n_in], matrix_get_row(sb->x, t * n_rows + b),
+                   sizeof(float) * n_in);
+        }
+    }
+}
+
+// the indices come from the data, so unseen categories, negative and
+// non-finite values all share the reserved last row of the table
+static int embedding_index(const Layer *l, float value) {
+    int oov = matrix_get_n_rows(l->weights) - 1;
+    // false for NaN as well
+    if (!(value >= 0 && value < oov)) {
+        return oov;
+    }
+    return (int) value;
+}
+
+// gathers the table rows of the indices in one input row
+static void embedding_forward(const Layer *l, const float *indices,
+                              float *output) {
+    int dim = matrix_get_n_cols(l->weights);
+    for (int f = 0; f < l->n_input; f++) {
+        int index = embedding_index(l, indices[f]);
+        memcpy(&output[f * dim], matrix_get_row(l->weights, index),
+               sizeof(float) * dim);
+    }
+}
+
+// scatter-adds the output gradient of one row into the gradient rows of
+// its indices, only those are ever touched
+static void embedding_backward(Layer *l, const float *indices,
+                               const float *delta) {
+    int dim = matrix_get_n_cols(l->weights);
+    for (int f = 0; f < l->n_input; f++) {
+        int index = embedding_index(l, indices[f]);
+        if (!l->is_touched[index]) {
+            l->is_touched[index] = true;
+            l->touched[l->n_touched++] = index;
+        }
+        float *d_row = matrix_get_row_mut(l->d_weights, index);
+        float_add(d_row, d_row, &delta[f * dim], dim);
+    }
+}
+
+// steps the touched rows and clears their gradient. Replicas that summed
+// the whole gradient table step all of it, each only knows its own rows
+static void embedding_update(Layer *l, float lr, bool all_rows) {
+    int dim = matrix_get_n_cols(l->weights);
+    if (all_rows) {
+        matrix_scaled_sub(l->weights, l->d_weights, lr);
+        for (int i = 0; i < matrix_get_n_rows(l->weights); i++) {
+            memset(matrix_get_row_mut(l->d_weights, i), 0,
+                   sizeof(float) * dim);
+        }
+    }
+    for (int i = 0; i < l->n_touched; i++) {
+        int index = l->touched[i];
+        float *d_row = matrix_get_row_mut(l->d_weights, index);
+        if (!all_rows) {
+            float_axpy(matrix_get_row_mut(l->weights, index), d_row, -lr,
+                       dim);
+            memset(d_row, 0, sizeof(float) * dim);
+        }
+        l->is_touched[index] = false;
+    }
+    l->n_touched = 0;
+}
+
+// the whole padded table, rows included that no row of the batch used
+static int embedding_table_floats(const Layer *l) {
+    return matrix_get_n_rows(l->weights) * matrix_get_stride(l->weights);
+}
+
+// writes the layer's own output and cache with row_state, else its
+// predict slot. Returns the output
+static const Vector *layer_apply(const Network *net, int i,
+                                 const Vector *input, bool row_state) {
+    Layer *l = net->layers[i];
+    assert(input);
+    Vector *output = l->output;
+    Matrix *output_view = l->output_view;
+    Matrix *input_view = l->prev_view;
+    if (row_state) {
+        vector_copy(l->cache->prev, input);
+    } else {
+        const PredictSlots *s = net->predict_slots;
+        output = s->output[i];
+        output_view = s->output_view[i];
+        input_view = s->input_view[i];
+    }
+    switch (l->kind) {
+    case LAYER_DENSE:
+        if (net->predict_pool && net->predict_matrix[i] >= 0) {
+            gemv_pool_mul(net->predict_pool, net->predict_matrix[i], input,
+                          output);
+        } else if (l->sparse) {
+            sparse_matrix_vec_mul(l->sparse, input, output);
+        } else {
+            matrix_vec_mul_with(l->weights, input, output, l->gemv);
+        }
+        vector_add(output, l->bias, output);
+        break;
+    case LAYER_CONV2D:
+        conv_im2row(matrix_get_row_mut(l->patches, 0), vector_get_data(input),
+                    &l->shape);
+        matrix_mul_T_blocked(l->patches, l->weights, output_view,
+                             l->mul_block);
+        matrix_add_row_vec(output_view, l->bias);
+        break;
+    case LAYER_MAX_POOL2D:
+        max_pool_forward(vector_get_data_mut(output), l->argmax,
+                         vector_get_data(input), &l->shape);
+        break;
+    case LAYER_AVG_POOL2D:
+        avg_pool_forward(vector_get_data_mut(output),
+                         vector_get_data(input), &l->shape);
+        break;
+    case LAYER_BATCHNORM:
+        batchnorm_forward(l, vector_get_data(input),
+                          vector_get_data_mut(output));
+        break;
+    case LAYER_RECURRENT:
+        recurrent_forward(l, input_view, output_view, l->seq);
+        break;
+    case LAYER_EMBEDDING:
+        embedding_forward(l, vector_get_data(input),
+                          vector_get_data_mut(output));
+        break;
+    }
+    if (row_state) {
+        vector_copy(l->cache->pre_act, output);
+    }
+    if (l->act) {
+        l->act->forward(output);
+    }
+    return output;
+}
+
+// whether every layer has its own output and cache
+static bool net_has_row_state(const Network *net) {
+    for (int i = 0; i < net->n_layers; i++) {
+        if (net->layers[i]->cache == NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static const Vector *net_apply_layers(const Network *net,
+                                      const Vector *input, bool row_state) {
+    for (int i = 0; i < net->n_layers; i++) {
+        uint64_t start = trace_begin();
+        input = layer_apply(net, i, input, row_state);
+        trace_end("layer_apply", i, start);
+    }
+    return input;
+}
+
+// until net_backpropagation first runs, or while a layer set since has
+// none, the layers have no output or cache of their own and the
+// activations go through the predict slots, which keep a copy of the
+// input for it.
+// Returns 0 or -1 when out of memory
+int net_predict(const Network *net, const Vector *input, Vector *output) {
+    assert(net);
+    assert(input);
+    assert(output);
+    bool row_state = net_has_row_state(net);
+    if (!row_state) {
+        PredictSlots *s = net->predict_slots;
+        if (s->input == NULL && create_predict_slots(net, s) < 0) {
+            return -1;
+        }
+        vector_copy(s->input, input);
+        input = s->input;
+    }
+    const Vector *result = net_apply_layers(net, input, row_state);
+    assert(vector_get_n(output) == vector_get_n(result));
+    vector_copy_data(output, vector_get_data(result), vector_get_n(result));
+    return 0;
+}
+
+// splits the GEMV of every dense layer of at least PREDICT_SPLIT_WEIGHTS
+// weights over n_threads threads for net_predict, the calling one
+// included. The threads keep their own copies of the weights, so
+// training, pruning or loading new ones stops them; call it again
+// afterwards. 1 stops the threads.
+// Returns 0 or -1 when out of memory or a thread could not be started
+int net_set_predict_threads(Network *net, int n_threads) {
+    assert(net);
+    assert(n_threads > 0);
+    drop_predict_pool(net);
+    if (n_threads == 1) {
+        return 0;
+    }
+    GemvPool *pool = create_gemv_pool(n_threads);
+    int *predict_matrix = malloc(sizeof(int) * net->n_layers);
+    if (pool == NULL || predict_matrix == NULL) {
+        if (pool) {
+            destroy_gemv_pool(pool);
+        }
+        free(predict_matrix);
+        return -1;
+    }
+    for (int i = 0; i < net->n_layers; i++) {
+        const Layer *l = net->layers[i];
+        predict_matrix[i] = -1;
+        if (l->kind != LAYER_DENSE || l->sparse ||
+            layer_get_n_weights(l) < PREDICT_SPLIT_WEIGHTS) {
+            continue;
+        }
+        predict_matrix[i] = gemv_pool_add_matrix(pool, l->weights, l->gemv);
+        if (predict_matrix[i] < 0) {
+            destroy_gemv_pool(pool);
+            free(predict_matrix);
+            return -1;
+        }
+    }
+    for (int i = 0; i < net->n_layers; i++) {
+        net->layers[i]->predict_copy = predict_matrix[i] >= 0;
+    }
+    net->predict_pool = pool;
+    net->predict_matrix = predict_matrix;
+    return 0;
+}
+
+float net_forward_loss(const Network *net, const Vector *prediction,
+                        const Vector *target) {
+    assert(net);
+    assert(prediction);
+    assert(target);
+    assert(net->loss);
+    return net->loss->forward(prediction, target);
+}
+
+static void layer_update(const Layer *l, const Matrix *dW, const Vector *db,
+                        float lr) {
+    assert(l);
+    assert(dW);
+    assert(db);
+    matrix_scaled_sub(l->weights, dW, lr);
+    vector_scaled_sub(l->bias, db, lr);
+    if (l->mask) {
+        matrix_hadamard(l->weights, l->mask);
+    }
+}
+
+// fills the layer gradients from cache->delta and, when prev_delta is
+// given, propagates delta to the previous layer
+static void layer_backward(Layer *l, Vector *prev_delta) {
+    assert(l);
+    assert(l->sparse == NULL);
+    Cache *cache = l->cache;
+    Vector *delta = cache->delta;
+    switch (l->kind) {
+    case LAYER_DENSE:
+        vector_transpose(cache->prev);
+        matrix_outer_mul(l->d_weights, delta, cache->prev);
+        vector_transpose(cache->prev);
+        vector_copy(l->d_bias, delta);
+        if (prev_delta) {
+            matrix_T_vec_mul(l->weights, delta, prev_delta);
+        }
+        break;
+    case LAYER_CONV2D:
+        matrix_T_mul_blocked(l->delta_view, l->patches, l->d_weights,
+                             l->mul_block);
+        matrix_sum_rows(l->delta_view, l->d_bias);
+        if (prev_delta) {
+            // patches are rebuilt by the next forward pass, so they can
+            // hold the gradient with respect to each patch
+            matrix_mul_blocked(l->delta_view, l->weights, l->patches,
+                               l->mul_block);
+            float *d_input = vector_get_data_mut(prev_delta);
+            memset(d_input, 0, sizeof(float) * l->n_input);
+            conv_row2im(d_input, matrix_get_row(l->patches, 0), &l->shape);
+        }
+        break;
+    case LAYER_MAX_POOL2D:
+        if (prev_delta) {
+            float *d_input = vector_get_data_mut(prev_delta);
+            memset(d_input, 0, sizeof(float) * l->n_input);
+            max_pool_backward(d_input, vector_get_data(delta), l->argmax,
+                              &l->shape);
+        }
+        break;
+    case LAYER_AVG_POOL2D:
+        if (prev_delta) {
+            float *d_input = vector_get_data_mut(prev_delta);
+            memset(d_input, 0, sizeof(float) * l->n_input);
+            avg_pool_backward(d_input, vector_get_data(delta), &l->shape);
+        }
+        break;
+    case LAYER_BATCHNORM: {
+        // with the running statistics fixed the layer is a plain affine map
+        const float *x = vector_get_data(cache->prev);
+        const float *dy = vector_get_data(delta);
+        const float *gamma = matrix_get_row(l->weights, 0);
+        const float *mean = vector_get_data(l->running_mean);
+        const float *var = vector_get_data(l->running_var);
+        float *d_gamma = matrix_get_row_mut(l->d_weights, 0);
+        float *dx = prev_delta ? vector_get_data_mut(prev_delta) : NULL;
+        vector_copy(l->d_bias, delta);
+        for (int j = 0; j < l->n; j++) {
+            float inv_std = 1.0f / sqrtf(var[j] + BN_EPSILON);
+            d_gamma[j] = dy[j] * (x[j] - mean[j]) * inv_std;
+            if (dx) {
+                dx[j] = dy[j] * gamma[j] * inv_std;
+            }
+        }
+        break;
+    }
+    case LAYER_RECURRENT:
+        recurrent_backward(l, l->delta_view, prev_delta ? l->d_input : NULL,
+                           l->seq, false);
+        if (prev_delta) {
+            vector_copy_data(prev_delta, matrix_get_row(l->d_input, 0),
+                             l->n_input);
+        }
+        break;
+    case LAYER_EMBEDDING:
+        // indices have no gradient
+        embedding_backward(l, vector_get_data(cache->prev),
+                           vector_get_data(delta));
+        if (prev_delta) {
+            memset(vector_get_data_mut(prev_delta), 0,
+                   sizeof(float) * l->n_input);
+        }
+        break;
+    }
+}
+
+// whether the loss of layer i's output works on its logits, which
+// skips the layer's activation in the backward pass. The fused gradient
+// sigmoid(z) - y only holds for a sigmoid output
+static bool net_fused_output(const Network *net, int i) {
+    bool fused = net->loss->from_logits && i == net->n_layers - 1;
+    assert(!fused || activation_is_sigmoid(net->layers[i]->act));
+    return fused;
+}
+
+// the first call gives the layers their own output and cache and runs
+// the last net_predict again to fill them.
+// Returns 0 or -1 when out of memory
+int net_backpropagation(const Network *net, const Vector *prediciton,
+                        const Vector *target) {
+    assert(net);
+    assert(prediciton);
+    assert(target);
+    assert(net->loss);
+    // the predict threads would keep the old weights, stop them first
+    assert(net->predict_pool == NULL);
+    if (!net_has_row_state(net)) {
+        PredictSlots *s = net->predict_slots;
+        // the input of the net_predict this follows
+        assert(s->input);
+        for (int i = 0; i < net->n_layers; i++) {
+            Layer *l = net->layers[i];
+            if (l->cache == NULL && layer_create_row_state(l) < 0) {
+                return -1;
+            }
+        }
+        net_apply_layers(net, s->input, true);
+        drop_predict_slots(s);
+    }
+
+    int n_layers = net->n_layers;
+    int n_out = vector_get_n(target);
+    assert(n_out == vector_get_n(prediciton));
+
+    Vector *delta = net->layers[n_layers - 1]->cache->delta;
+    assert(n_out == vector_get_n(delta));
+
+    net->loss->backward(delta, prediciton, target);
+    for (int i = n_layers - 1; i >= 0; i--) {
+        Layer *current_layer = net->layers[i];
+        Cache *cache = current_layer->cache;
+        delta = cache->delta;
+        assert(delta);
+        uint64_t start = trace_begin();
+        bool fused = net_fused_output(net, i);
+        if (current_layer->act && !fused) {
+            current_layer->act->update_delta(delta, cache->pre_act,
+                                             current_layer->output);
+        }
+        layer_backward(current_layer,
+                       i > 0 ? net->layers[i - 1]->cache->delta : NULL);
+        if (current_layer->kind == LAYER_EMBEDDING) {
+            embedding_update(current_layer, net->learning_rate, false);
+        } else if (current_layer->weights) {
+            layer_update(current_layer, current_layer->d_weights,
+                         current_layer->d_bias, net->learning_rate);
+        }
+        trace_end("layer_backward", i, start);
+    }
+    return 0;
+}
+
+// Returns 0 or -1 when out of memory
+int net_predict_batch(const Network *net, const Matrix *X, Matrix *Y_hat) {
+    assert(net);
+    assert(X);
+    assert(Y_hat);
+    int n = matrix_get_n_rows(X);
+    assert(n == matrix_get_n_rows(Y_hat));
+    Vector *row = create_vector_view(NULL, matrix_get_n_cols(X), true);
+    Vector *pred = create_vector_view(NULL, matrix_get_n_cols(Y_hat), true);
+    int rc = row && pred ? 0 : -1;
+    for (int i = 0; i < n && rc == 0; i++) {
+        matrix_row_as_vec(row, X, i);
+        matrix_row_as_vec(pred, Y_hat, i);
+        rc = net_predict(net, row, pred);
+    }
+    if (row) {
+        destroy_vector(row);
+    }
+    if (pred) {
+        destroy_vector(pred);
+    }
+    return rc;
+}
+
+static const int EVAL_BLOCK_ROWS = 256;
+
+// mean loss over the rows, summed per block of EVAL_BLOCK_ROWS rows and
+// the blocks in order like net_evaluate, so both give the same bits
+float net_loss_batch(const Network *net, const Matrix *Y_hat, const Matrix *Y) {
+    assert(net);
+    assert(Y_hat);
+    assert(Y);
+    int n = matrix_get_n_rows(Y_hat);
+    assert(n == matrix_get_n_rows(Y));
+    int n_cols = matrix_get_n_cols(Y_hat);
+    assert(n_cols == matrix_get_n_cols(Y));
+    Vector *pred = create_vector_view(NULL, n_cols, true);
+    Vector *target = create_vector_view(NULL, n_cols, true);
+    double total = 0;
+    for (int b = 0; b < n; b += EVAL_BLOCK_ROWS) {
+        int end = b + EVAL_BLOCK_ROWS < n ? b + EVAL_BLOCK_ROWS : n;
+        double block = 0;
+        for (int i = b; i < end; i++) {
+            matrix_row_as_vec(pred, Y_hat, i);
+            matrix_row_as_vec(target, Y, i);
+            block += net_forward_loss(net, pred, target);
+        }
+        total += block;
+    }
+    destroy_vector(pred);
+    destroy_vector(target);
+    return total / n;
+}
+
+// activations of one layer for a block of rows, the training-only
+// members stay NULL for inference
+typedef struct {
+    // views into the arena of the block, see ActivationPlan
+    Matrix *output;
+    Matrix *pre_act;
+    Matrix *delta;
+    // conv im2row patches or batch norm normalized input
+    Matrix *scratch;
+    int *argmax;
+    SeqBuffers *seq;
+    // row views handed to the per-vector activation and loss callbacks
+    Vector *row;
+    Vector *pre_row;
+    Vector *delta_row;
+} LayerBuffers;
+
+// per-thread activations for one block of rows pushed through the network
+typedef struct {
+    LayerBuffers *layers;
+    int n_layers;
+    int n_rows;
+    bool training;
+    // the planned activations of every layer, arena is NULL when the
+    // block borrows the activations of a bigger one
+    float *activations;
+    Matrix *arena;
+} BatchBuffers;
+
+// the activation buffers of a layer the planner places
+enum {
+    PLAN_OUTPUT,
+    PLAN_PRE_ACT,
+    PLAN_DELTA,
+    PLAN_SCRATCH,
+    PLAN_N_BUFFERS,
+};
+
+// where the activation buffers of every layer live in one arena. Buffers
+// whose lifetimes do not overlap share a slot, so a forward pass only
+// alternates between two slots for the layer outputs. Offsets and sizes
+// are in floats per row of the block, the arena of n_rows rows holds
+// n_rows times arena_floats
+typedef struct {
+    // n_layers x PLAN_N_BUFFERS, -1 for buffers a layer does not have
+    long *offset;
+    long arena_floats;
+    // with a slot for every buffer
+    long unshared_floats;
+    int n_buffers;
+    int n_slots;
+} ActivationPlan;
+
+// shape of a planned buffer for one row of the block: rows x cols, packed
+// or padded like create_matrix. Returns false when the layer has no such
+// buffer
+static bool planned_shape(const Layer *l, int buffer, bool training,
+                          int *rows, int *cols, bool *packed) {
+    // conv output and delta are reshaped to one row per output pixel
+    *packed = l->kind == LAYER_CONV2D;
+    *rows = 1;
+    *cols = l->n;
+    switch (buffer) {
+    case PLAN_OUTPUT:
+        return true;
+    case PLAN_PRE_ACT:
+        // only the activation's backward pass and losses on logits read it
+        return training && l->act;
+    case PLAN_DELTA:
+        return training;
+    case PLAN_SCRATCH:
+        if (l->kind == LAYER_CONV2D) {
+            // one im2row patch per output pixel
+            *rows = conv_shape_get_n_patches(&l->shape);
+            *cols = conv_shape_get_patch_size(&l->shape);
+            return true;
+        }
+        return training && l->kind == LAYER_BATCHNORM;
+    }
+    return false;
+}
+
+// every slot starts on a cache line of the arena
+static long planned_floats(int rows, int cols, bool packed) {
+    long floats = packed ? (long) rows * cols
+                         : (long) matrix_storage_floats(rows, cols);
+    return (long) matrix_storage_floats(1, (int) floats);
+}
+
+// steps of a pass: the forward pass of layer i at i, the loss at n_layers
+// and the backward pass of layer i at 2 * n_layers - i. A buffer lives
+// from the step that writes it to the last one reading it
+static void planned_lifetime(int i, int buffer, int n_layers, bool training,
+                             int *first, int *last) {
+    if (!training) {
+        // outputs are read by the next layer or the caller, scratch only
+        // by its own layer
+        *first = i;
+        *last = buffer == PLAN_OUTPUT ? i + 1 : i;
+        return;
+    }
+    int backward = 2 * n_layers - i;
+    // the delta is written by the next layer's backward pass or the loss,
+    // the rest in the forward pass and read until the layer's backward
+    // pass, outputs also by the next layer's
+    *first = buffer == PLAN_DELTA ? backward - 1 : i;
+    *last = backward;
+}
+
+static void destroy_activation_plan(ActivationPlan *plan) {
+    assert(plan);
+    free(plan->offset);
+    free(plan);
+}
+
+// assigns the buffers in the order they are first written to the free
+// slot that fits them best, or that is the biggest when none fits
+static ActivationPlan *create_activation_plan(const Network *net,
+                                              bool training) {
+    assert(net);
+    int n = net->n_layers * PLAN_N_BUFFERS;
+    ActivationPlan *plan = calloc(1, sizeof(ActivationPlan));
+    int *slot_of = malloc(sizeof(int) * n);
+    int *slot_last = malloc(sizeof(int) * n);
+    long *slot_size = malloc(sizeof(long) * n);
+    if (plan) {
+        plan->offset = malloc(sizeof(long) * n);
+    }
+    if (plan == NULL || plan->offset == NULL || slot_of == NULL ||
+        slot_last == NULL || slot_size == NULL) {
+        if (plan) {
+            destroy_activation_plan(plan);
+        }
+        free(slot_of);
+        free(slot_last);
+        free(slot_size);
+        return NULL;
+    }
+    for (int k = 0; k < n; k++) {
+        slot_of[k] = -1;
+    }
+    for (int t = 0; t <= 2 * net->n_layers; t++) {
+        for (int k = 0; k < n; k++) {
+            const Layer *l = net->layers[k / PLAN_N_BUFFERS];
+            int buffer = k % PLAN_N_BUFFERS;
+            int rows, cols, first, last;
+            bool packed;
+            if (!planned_shape(l, buffer, training, &rows, &cols, &packed)) {
+                continue;
+            }
+            planned_lifetime(k / PLAN_N_BUFFERS, buffer, net->n_layers,
+                             training, &first, &last);
+            if (first != t) {
+                continue;
+            }
+            long floats = planned_floats(rows, cols, packed);
+            plan->unshared_floats += floats;
+            plan->n_buffers++;
+            int best = -1;
+            for (int s = 0; s < plan->n_slots; s++) {
+                if (slot_last[s] >= first) {
+                    continue;
+                }
+                bool fits = slot_size[s] >= floats;
+                bool best_fits = best >= 0 && slot_size[best] >= floats;
+                if (best < 0 ||
+                    (fits && (!best_fits || slot_size[s] < slot_size[best])) ||
+                    (!fits && !best_fits && slot_size[s] > slot_size[best])) {
+                    best = s;
+                }
+            }
+            if (best < 0) {
+                best = plan->n_slots++;
+                slot_size[best] = 0;
+            }
+            if (slot_size[best] < floats) {
+                slot_size[best] = floats;
+            }
+            slot_last[best] = last;
+            slot_of[k] = best;
+        }
+    }
+    // the slots are laid out back to back, slot_size turns into offsets
+    for (int s = 0; s < plan->n_slots; s++) {
+        long size = slot_size[s];
+        slot_size[s] = plan->arena_floats;
+        plan->arena_floats += size;
+    }
+    for (int k = 0; k < n; k++) {
+        plan->offset[k] = slot_of[k] < 0 ? -1 : slot_size[slot_of[k]];
+    }
+    free(slot_of);
+    free(slot_last);
+    free(slot_size);
+    return plan;
+}
+
+static void destroy_batch_buffers(BatchBuffers *buf) {
+    assert(buf);
+    for (int i = 0; i < buf->n_layers; i++) {
+        LayerBuffers *lb = &buf->layers[i];
+        Matrix *matrices[] = {lb->output, lb->pre_act, lb->delta, lb->scratch};
+        for (int j = 0; j < 4; j++) {
+            if (matrices[j]) {
+                destroy_matrix(matrices[j]);
+            }
+        }
+        free(lb->argmax);
+        if (lb->seq) {
+            destroy_seq_buffers(lb->seq);
+        }
+        Vector *views[] = {lb->row, lb->pre_row, lb->delta_row};
+        for (int j = 0; j < 3; j++) {
+            if (views[j]) {
+                destroy_vector(views[j]);
+            }
+        }
+    }
+    if (buf->arena) {
+        destroy_matrix(buf->arena);
+    }
+    free(buf->layers);
+    free(buf);
+}
+
+// offset holds the layer's PLAN_N_BUFFERS offsets into the arena. Buffers
+// that shared a slot with another layer hold its stale values and
+// padding, views keep the kernels from reading past n_cols
+static bool create_layer_buffers(LayerBuffers *lb, const Layer *l,
+                                 int n_rows, bool training,
+                                 const long *offset, float *activations) {
+    Matrix **planned[] = {&lb->output, &lb->pre_act, &lb->delta,
+                          &lb->scratch};
+    bool ok = true;
+    for (int b = 0; b < PLAN_N_BUFFERS; b++) {
+        int rows, cols;
+        bool packed;
+        if (offset[b] < 0 ||
+            !planned_shape(l, b, training, &rows, &cols, &packed)) {
+            continue;
+        }
+        int stride = packed ? cols : (int) matrix_storage_floats(1, cols);
+        *planned[b] = create_matrix_view(&activations[offset[b] * n_rows],
+                                         n_rows * rows, cols, stride);
+        ok = ok && *planned[b];
+    }
+    lb->row = create_vector_view(NULL, l->n, true);
+    ok = ok && lb->row;
+    if (l->kind == LAYER_RECURRENT) {
+        lb->seq = create_seq_buffers(&l->rnn, n_rows, training);
+        ok = ok && lb->seq;
+    }
+    if (!training) {
+        return ok;
+    }
+    lb->pre_row = create_vector_view(NULL, l->n, true);
+    lb->delta_row = create_vector_view(NULL, l->n, true);
+    ok = ok && lb->pre_row && lb->delta_row;
+    if (l->kind == LAYER_MAX_POOL2D) {
+        lb->argmax = malloc(sizeof(int) * n_rows * l->n);
+        ok = ok && lb->argmax;
+    }
+    return ok;
+}
+
+// borrow is NULL or a block of at least n_rows rows in the same mode whose
+// activations this one reuses, the two must not run at the same time
+static BatchBuffers *create_batch_buffers_in(const Network *net, int n_rows,
+                                             bool training,
+                                             const BatchBuffers *borrow) {
+    assert(net);
+    assert(!borrow || (borrow->n_rows >= n_rows &&
+                       borrow->training == training));
+    ActivationPlan *plan = create_activation_plan(net, training);
+    if (plan == NULL) {
+        return NULL;
+    }
+    BatchBuffers *buf = calloc(1, sizeof(BatchBuffers));
+    if (buf == NULL) {
+        destroy_activation_plan(plan);
+        return NULL;
+    }
+    buf->layers = calloc(net->n_layers, sizeof(LayerBuffers));
+    if (buf->layers == NULL) {
+        free(buf);
+        destroy_activation_plan(plan);
+        return NULL;
+    }
+    buf->n_layers = net->n_layers;
+    buf->n_rows = n_rows;
+    buf->training = training;
+    if (borrow) {
+        buf->activations = borrow->activations;
+    } else {
+        // an arena too large for one matrix row fails like any other
+        // allocation
+        long floats = plan->arena_floats * n_rows;
+        if (floats <= INT_MAX) {
+            buf->arena = create_matrix_packed(1, (int) floats);
+        }
+        buf->activations = buf->arena ? matrix_get_row_mut(buf->arena, 0)
+                                      : NULL;
+    }
+    bool ok = buf->activations != NULL;
+    for (int i = 0; ok && i < net->n_layers; i++) {
+        ok = create_layer_buffers(&buf->layers[i], net->layers[i], n_rows,
+                                  training,
+                                  &plan->offset[i * PLAN_N_BUFFERS],
+                                  buf->activations);
+    }
+    destroy_activation_plan(plan);
+    if (!ok) {
+        destroy_batch_buffers(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+static BatchBuffers *create_batch_buffers(const Network *net, int n_rows,
+                                          bool training) {
+    return create_batch_buffers_in(net, n_rows, training, NULL);
+}
+
+// fills plan with the activation memory of a block of n_rows rows, as
+// net_train (training) or net_evaluate and the inference server lay it
+// out. Returns 0 or -1
+int net_plan_memory(const Network *net, int n_rows, bool training,
+                    MemoryPlan *plan) {
+    assert(net);
+    assert(n_rows > 0);
+    assert(plan);
+    ActivationPlan *ap = create_activation_plan(net, training);
+    if (ap == NULL) {
+        return -1;
+    }
+    // workspace every block keeps to itself
+    size_t own = 0;
+    for (int i = 0; i < net->n_layers; i++) {
+        const Layer *l = net->layers[i];
+        if (l->kind == LAYER_RECURRENT) {
+            own += sizeof(float) * seq_buffers_floats(&l->rnn, n_rows,
+                                                      training);
+        }
+        if (training && l->kind == LAYER_MAX_POOL2D) {
+            own += sizeof(int) * n_rows * l->n;
+        }
+    }
+    plan->n_rows = n_rows;
+    plan->training = training;
+    plan->n_buffers = ap->n_buffers;
+    plan->n_slots = ap->n_slots;
+    plan->unshared_bytes = sizeof(float) * ap->unshared_floats * n_rows + own;
+    plan->planned_bytes = sizeof(float) * ap->arena_floats * n_rows + own;
+    destroy_activation_plan(ap);
+    return 0;
+}
+
+void memory_plan_print(const MemoryPlan *plan) {
+    assert(plan);
+    printf("Activations of %d rows (%s): %d buffers in %d slots\n",
+           plan->n_rows, plan->training ? "training" : "inference",
+           plan->n_buffers, plan->n_slots);
+    printf("Peak: %.2f MB planned, %.2f MB unshared\n",
+           plan->planned_bytes / 1e6, plan->unshared_bytes / 1e6);
+}
+
+// normalizes every column with the batch statistics while training on
+// more than one row and with the running statistics otherwise, x_hat is
+// only needed for training
+static void batchnorm_forward_batch(Layer *l, const Matrix *input,
+                                    Matrix *output, Matrix *x_hat,
+                                    bool training) {
+    int n_rows = matrix_get_n_rows(input);
+    int n = l->n;
+    const float *gamma = matrix_get_row(l->weights, 0);
+    const float *beta = vector_get_data(l->bias);
+    float *running_mean = vector_get_data_mut(l->running_mean);
+    float *running_var = vector_get_data_mut(l->running_var);
+    if (!training) {
+        for (int i = 0; i < n_rows; i++) {
+            const float *x = matrix_get_row(input, i);
+            float *y = matrix_get_row_mut(output, i);
+            for (int j = 0; j < n; j++) {
+                float inv_std = 1.0f / sqrtf(running_var[j] + BN_EPSILON);
+                y[j] = gamma[j] * (x[j] - running_mean[j]) * inv_std +
+                       beta[j];
+            }
+        }
+        return;
+    }
+    float *mean = vector_get_data_mut(l->batch_mean);
+    float *inv_std = vector_get_data_mut(l->batch_inv_std);
+    if (n_rows == 1) {
+        // a single row has no variance, it is normalized with the running
+        // statistics as in net_predict and leaves them as they are
+        for (int j = 0; j < n; j++) {
+            mean[j] = running_mean[j];
+            inv_std[j] = 1.0f / sqrtf(running_var[j] + BN_EPSILON);
+        }
+    } else {
+        matrix_sum_rows(input, l->batch_mean);
+        for (int j = 0; j < n; j++) {
+            mean[j] /= n_rows;
+            inv_std[j] = 0;
+        }
+        // inv_std accumulates the squared deviations first
+        for (int i = 0; i < n_rows; i++) {
+            const float *x = matrix_get_row(input, i);
+            for (int j = 0; j < n; j++) {
+                float diff = x[j] - mean[j];
+                inv_std[j] += diff * diff;
+            }
+        }
+        for (int j = 0; j < n; j++) {
+            float var = inv_std[j] / n_rows;
+            float unbiased = inv_std[j] / (n_rows - 1);
+            running_mean[j] = BN_MOMENTUM * running_mean[j] +
+                              (1 - BN_MOMENTUM) * mean[j];
+            running_var[j] = BN_MOMENTUM * running_var[j] +
+                             (1 - BN_MOMENTUM) * unbiased;
+            inv_std[j] = 1.0f / sqrtf(var + BN_EPSILON);
+        }
+    }
+    for (int i = 0; i < n_rows; i++) {
+        const float *x = matrix_get_row(input, i);
+        float *y = matrix_get_row_mut(output, i);
+        float *norm = matrix_get_row_mut(x_hat, i);
+        for (int j = 0; j < n; j++) {
+            norm[j] = (x[j] - mean[j]) * inv_std[j];
+            y[j] = gamma[j] * norm[j] + beta[j];
+        }
+    }
+}
+
+static void layer_apply_batch(Layer *l, const Matrix *input,
+                              LayerBuffers *lb, bool training) {
+    assert(l);
+    assert(input);
+    assert(lb);
+    Matrix *output = lb->output;
+    int n_rows = matrix_get_n_rows(input);
+    switch (l->kind) {
+    case LAYER_DENSE:
+        if (l->sparse) {
+            sparse_matrix_mul_T(input, l->sparse, output);
+        } else {
+            matrix_mul_T_blocked(input, l->weights, output, l->mul_block);
+        }
+        matrix_add_row_vec(output, l->bias);
+        break;
+    case LAYER_CONV2D: {
+        // all patches of the block go through a single product
+        int n_patches = conv_shape_get_n_patches(&l->shape);
+        for (int i = 0; i < n_rows; i++) {
+            conv_im2row(matrix_get_row_mut(lb->scratch, i * n_patches),
+                        matrix_get_row(input, i), &l->shape);
+        }
+        int n_filters = matrix_get_n_rows(l->weights);
+        matrix_reshape(output, n_rows * n_patches, n_filters);
+        matrix_mul_T_blocked(lb->scratch, l->weights, output, l->mul_block);
+        matrix_add_row_vec(output, l->bias);
+        matrix_reshape(output, n_rows, l->n);
+        break;
+    }
+    case LAYER_MAX_POOL2D:
+        for (int i = 0; i < n_rows; i++) {
+            int *argmax = lb->argmax ? &lb->argmax[i * l->n] : NULL;
+            max_pool_forward(matrix_get_row_mut(output, i), argmax,
+                             matrix_get_row(input, i), &l->shape);
+        }
+        break;
+    case LAYER_AVG_POOL2D:
+        for (int i = 0; i < n_rows; i++) {
+            avg_pool_forward(matrix_get_row_mut(output, i),
+                             matrix_get_row(input, i), &l->shape);
+        }
+        break;
+    case LAYER_BATCHNORM:
+        batchnorm_forward_batch(l, input, output, lb->scratch, training);
+        break;
+    case LAYER_RECURRENT:
+        recurrent_forward(l, input, output, lb->seq);
+        break;
+    case LAYER_EMBEDDING:
+        for (int i = 0; i < n_rows; i++) {
+            embedding_forward(l, matrix_get_row(input, i),
+                              matrix_get_row_mut(output, i));
+        }
+        break;
+    }
+    if (training && lb->pre_act) {
+        matrix_copy(lb->pre_act, output);
+    }
+    if (l->act) {
+        for (int i = 0; i < n_rows; i++) {
+            matrix_row_as_vec(lb->row, output, i);
+            l->act->forward(lb->row);
+        }
+    }
+}
+
+// forwards a block of rows through every layer. Outside of training no
+// layer state is touched, so several threads can share one network
+static const Matrix *net_forward_layers(const Network *net,
+                                        BatchBuffers *buf,
+                                        const Matrix *input, int first,
+                                        int last, bool training) {
+    assert(net);
+    assert(buf);
+    assert(input);
+    assert(0 <= first && first <= last && last <= net->n_layers);
+    for (int i = first; i < last; i++) {
+        uint64_t start = trace_begin();
+        layer_apply_batch(net->layers[i], input, &buf->layers[i], training);
+        trace_end("layer_apply", i, start);
+        input = buf->layers[i].output;
+    }
+    return input;
+}
+
+static const Matrix *net_forward_batch(const Network *net, BatchBuffers *buf,
+                                       const Matrix *input, bool training) {
+    return net_forward_layers(net, buf, input, 0, net->n_layers, training);
+}
+
+// fills the layer gradients summed over the block from lb->delta and,
+// when prev_delta is given, propagates the delta to the previous layer.
+// With accumulate the block's sums continue the ones already in the
+// gradients, row by row, as if both blocks had been one
+static void layer_backward_batch(Layer *l, const Matrix *input,
+                                 LayerBuffers *lb, Matrix *prev_delta,
+                                 bool accumulate) {
+    assert(l);
+    assert(l->sparse == NULL);
+    // batch statistics couple the rows of one block
+    assert(!accumulate || l->kind != LAYER_BATCHNORM);
+    assert(input);
+    assert(lb);
+    Matrix *delta = lb->delta;
+    int n_rows = matrix_get_n_rows(delta);
+    switch (l->kind) {
+    case LAYER_DENSE:
+        if (accumulate) {
+            matrix_T_mul_acc_blocked(delta, input, l->d_weights,
+                                     l->mul_block);
+            matrix_sum_rows_acc(delta, l->d_bias);
+        } else {
+            matrix_T_mul_blocked(delta, input, l->d_weights, l->mul_block);
+            matrix_sum_rows(delta, l->d_bias);
+        }
+        if (prev_delta) {
+            matrix_mul_blocked(delta, l->weights, prev_delta, l->mul_block);
+        }
+        break;
+    case LAYER_CONV2D: {
+        int n_patches = conv_shape_get_n_patches(&l->shape);
+        int n_filters = matrix_get_n_rows(l->weights);
+        matrix_reshape(delta, n_rows * n_patches, n_filters);
+        if (accumulate) {
+            matrix_T_mul_acc_blocked(delta, lb->scratch, l->d_weights,
+                                     l->mul_block);
+            matrix_sum_rows_acc(delta, l->d_bias);
+        } else {
+            matrix_T_mul_blocked(delta, lb->scratch, l->d_weights,
+                                 l->mul_block);
+            matrix_sum_rows(delta, l->d_bias);
+        }
+        if (prev_delta) {
+            matrix_mul_blocked(delta, l->weights, lb->scratch, l->mul_block);
+            for (int i = 0; i < n_rows; i++) {
+                float *d_input = matrix_get_row_mut(prev_delta, i);
+                memset(d_input, 0, sizeof(float) * l->n_input);
+                conv_row2im(d_input,
+                            matrix_get_row(lb->scratch, i * n_patches),
+                            &l->shape);
+            }
+        }
+        matrix_reshape(delta, n_rows, l->n);
+        break;
+    }
+    case LAYER_MAX_POOL2D:
+        for (int i = 0; prev_delta && i < n_rows; i++) {
+            float *d_input = matrix_get_row_mut(prev_delta, i);
+            memset(d_input, 0, sizeof(float) * l->n_input);
+            max_pool_backward(d_input, matrix_get_row(delta, i),
+                              &lb->argmax[i * l->n], &l->shape);
+        }
+        break;
+    case LAYER_AVG_POOL2D:
+        for (int i = 0; prev_delta && i < n_rows; i++) {
+            float *d_input = matrix_get_row_mut(prev_delta, i);
+            memset(d_input, 0, sizeof(float) * l->n_input);
+            avg_pool_backward(d_input, matrix_get_row(delta, i), &l->shape);
+        }
+        break;
+    case LAYER_BATCHNORM: {
+        int n = l->n;
+        float *d_gamma = matrix_get_row_mut(l->d_weights, 0);
+        float *d_beta = vector_get_data_mut(l->d_bias);
+        memset(d_gamma, 0, sizeof(float) * n);
+        matrix_sum_rows(delta, l->d_bias);
+        for (int i = 0; i < n_rows; i++) {
+            const float *dy = matrix_get_row(delta, i);
+            const float *x_hat = matrix_get_row(lb->scratch, i);
+            for (int j = 0; j < n; j++) {
+                d_gamma[j] += dy[j] * x_hat[j];
+            }
+        }
+        const float *gamma = matrix_get_row(l->weights, 0);
+        const float *inv_std = vector_get_data(l->batch_inv_std);
+        for (int i = 0; prev_delta && i < n_rows; i++) {
+            const float *dy = matrix_get_row(delta, i);
+            const float *x_hat = matrix_get_row(lb->scratch, i);
+            float *dx = matrix_get_row_mut(prev_delta, i);
+            for (int j = 0; j < n; j++) {
+                // the running statistics of a single row are constants
+                dx[j] = n_rows == 1 ? gamma[j] * inv_std[j] * dy[j]
+                                    : gamma[j] * inv_std[j] / n_rows *
+                                      (n_rows * dy[j] - d_beta[j] -
+                                       x_hat[j] * d_gamma[j]);
+            }
+        }
+        break;
+    }
+    case LAYER_RECURRENT:
+        recurrent_backward(l, delta, prev_delta, lb->seq, accumulate);
+        break;
+    case LAYER_EMBEDDING:
+        for (int i = 0; i < n_rows; i++) {
+            embedding_backward(l, matrix_get_row(input, i),
+                               matrix_get_row(delta, i));
+            if (prev_delta) {
+                memset(matrix_get_row_mut(prev_delta, i), 0,
+                       sizeof(float) * l->n_input);
+            }
+        }
+        break;
+    }
+}
+
+// one SGD step over the whole parameter arena. Each layer propagates its
+// delta with its weights before they change either way, so stepping once
+// after the backward pass matches stepping layer by layer
+static void net_apply_gradients(const Network *net, float lr) {
+    assert(net->params);
+    // the training entry points stop the predict threads
+    assert(net->predict_pool == NULL);
+    uint64_t start = trace_begin();
+    int n = matrix_get_n_cols(net->params);
+    float_axpy(matrix_get_row_mut(net->params, 0),
+               matrix_get_row(net->grads, 0), -lr, n);
+    for (int i = 0; i < net->n_layers; i++) {
+        Layer *l = net->layers[i];
+        if (l->mask) {
+            matrix_hadamard(l->weights, l->mask);
+        }
+        if (l->kind == LAYER_EMBEDDING) {
+            embedding_update(l, lr, net->transport != NULL);
+        }
+    }
+    trace_end("optimizer_step", -1, start);
+}
+
+// adds the loss of the block whose network output is out to total and
+// leaves its gradient in the delta of the output layer. In deterministic
+// mode the rows are added one by one, so the total does not depend on
+// how the rows were split into blocks
+static void net_batch_loss(const Network *net, BatchBuffers *buf,
+                           const Matrix *out, const Matrix *Y,
+                           Vector *target, double *total) {
+    int n_rows = matrix_get_n_rows(out);
+    LayerBuffers *last = &buf->layers[net->n_layers - 1];
+    const Loss *loss_fn = net->loss;
+    bool from_logits = net_fused_output(net, net->n_layers - 1);
+    float total_loss = 0;
+    uint64_t start = trace_begin();
+    if (loss_fn->forward_batch && net->deterministic) {
+        for (int i = 0; i < n_rows; i++) {
+            matrix_row_as_vec(last->row, out, i);
+            matrix_row_as_vec(target, Y, i);
+            *total += net_forward_loss(net, last->row, target);
+        }
+        loss_fn->backward_batch(last->delta, out, Y);
+    } else if (loss_fn->forward_batch) {
+        total_loss = loss_fn->forward_batch(from_logits ? last->pre_act : out,
+                                            Y);
+        loss_fn->backward_batch(last->delta, out, Y);
+    } else {
+        for (int i = 0; i < n_rows; i++) {
+            matrix_row_as_vec(last->row, out, i);
+            matrix_row_as_vec(target, Y, i);
+            matrix_row_as_vec(last->delta_row, last->delta, i);
+            float loss = net_forward_loss(net, last->row, target);
+            #ifdef DEBUG
+                printf("Predicted Vector:\n");
+                vector_print(last->row);
+                printf("Loss: %.2f\n", loss);
             #endif
-            total_loss += loss;
-            net_backpropagation(net, output, target);
+            if (net->deterministic) {
+                *total += loss;
+            } else {
+                total_loss += loss;
+            }
+            loss_fn->backward(last->delta_row, last->row, target);
+        }
+    }
+    if (!net->deterministic) {
+        *total += total_loss;
+    }
+    trace_end("loss", -1, start);
+}
+
+// takes the delta of layer i back through its activation and the layer,
+// filling its gradients, or adding to them with accumulate, and the delta
+// of layer i - 1. X is the block's network input
+static void net_backward_layer(const Network *net, BatchBuffers *buf,
+                               const Matrix *X, int i, bool accumulate) {
+    Layer *l = net->layers[i];
+    LayerBuffers *lb = &buf->layers[i];
+    int n_rows = matrix_get_n_rows(lb->delta);
+    uint64_t start = trace_begin();
+    // a loss on logits already gave the delta of the pre-activation
+    bool fused = net_fused_output(net, i);
+    if (l->act && !fused) {
+        for (int j = 0; j < n_rows; j++) {
+            matrix_row_as_vec(lb->delta_row, lb->delta, j);
+            matrix_row_as_vec(lb->pre_row, lb->pre_act, j);
+            matrix_row_as_vec(lb->row, lb->output, j);
+            l->act->update_delta(lb->delta_row, lb->pre_row, lb->row);
+        }
+    }
+    const Matrix *input = i > 0 ? buf->layers[i - 1].output : X;
+    Matrix *prev_delta = i > 0 ? buf->layers[i - 1].delta : NULL;
+    layer_backward_batch(l, input, lb, prev_delta, accumulate);
+    trace_end("layer_backward", i, start);
+}
+
+// one optimizer step on a mini-batch held in X and Y, adds the summed
+// loss of the batch to loss. Returns 0 or -1 when the transport failed
+// to sum the gradients, the weights are left as they were then
+static int net_train_step(const Network *net, BatchBuffers *buf,
+                           const Matrix *X, const Matrix *Y,
+                           Vector *target, double *loss) {
+    assert(net);
+    assert(buf);
+    assert(X);
+    assert(Y);
+    const Matrix *out = net_forward_batch(net, buf, X, true);
+    int n_layers = net->n_layers;
+    net_batch_loss(net, buf, out, Y, target, loss);
+    // the gradients are summed over the batch, step with their mean
+    float lr = net->learning_rate / matrix_get_n_rows(out);
+    for (int i = n_layers - 1; i >= 0; i--) {
+        net_backward_layer(net, buf, X, i, false);
+    }
+    if (net->transport) {
+        // every replica steps with the mean over all of their batches
+        uint64_t start = trace_begin();
+        int rc = transport_allreduce(net->transport,
+                                     matrix_get_row_mut(net->grads, 0),
+                                     matrix_get_n_cols(net->grads));
+        // the replicas touched different rows, their tables are summed
+        // whole
+        for (int i = 0; rc == 0 && i < n_layers; i++) {
+            Layer *l = net->layers[i];
+            if (l->kind == LAYER_EMBEDDING) {
+                rc = transport_allreduce(net->transport,
+                                         matrix_get_row_mut(l->d_weights, 0),
+                                         embedding_table_floats(l));
+            }
+        }
+        trace_end("allreduce", -1, start);
+        if (rc != 0) {
+            return -1;
+        }
+        lr /= net->transport->n_ranks;
+    }
+    net_apply_gradients(net, lr);
+    return 0;
+}
+
+typedef struct {
+    const Network *net;
+    const Matrix *X;
+    const Matrix *Y;
+    int start;
+    int end;
+    int top_k;
+    int n_classes;
+    // summed loss of every block of EVAL_BLOCK_ROWS rows of X, shared
+    // by the tasks, each writes the entries of its own blocks
+    double *block_loss;
+    int correct;
+    int top_k_correct;
+    int *confusion;
+    bool failed;
+} EvalTask;
+
+// input is a view of the rows of X starting at start, a multiple of
+// EVAL_BLOCK_ROWS
+static void eval_block(EvalTask *task, BatchBuffers *buf, const Matrix *input,
+                       int start, Vector *pred, Vector *target) {
+    uint64_t traced = trace_begin();
+    const Matrix *out = net_forward_batch(task->net, buf, input, false);
+    int n_out = matrix_get_n_cols(out);
+    double loss = 0;
+    for (int i = 0; i < matrix_get_n_rows(out); i++) {
+        const float *p = matrix_get_row(out, i);
+        const float *y = matrix_get_row(task->Y, start + i);
+        matrix_row_as_vec(pred, out, i);
+        matrix_row_as_vec(target, task->Y, start + i);
+        loss += net_forward_loss(task->net, pred, target);
+        int label = 0;
+        int guess = 0;
+        bool in_top_k = false;
+        if (n_out == 1) {
+            // single sigmoid output: threshold into two classes
+            label = y[0] >= 0.5f;
+            guess = p[0] >= 0.5f;
+            in_top_k = label == guess || task->top_k > 1;
+        } else {
+            label = float_argmax(y, n_out);
+            guess = float_argmax(p, n_out);
+            in_top_k = float_count_greater(p, p[label], n_out) < task->top_k;
+        }
+        task->correct += label == guess;
+        task->top_k_correct += in_top_k;
+        task->confusion[label * task->n_classes + guess]++;
+    }
+    task->block_loss[start / EVAL_BLOCK_ROWS] = loss;
+    trace_end("eval_block", start / EVAL_BLOCK_ROWS, traced);
+}
+
+static void *eval_worker(void *arg) {
+    EvalTask *task = arg;
+    int n_out = matrix_get_n_cols(task->Y);
+    int n_rows = task->end - task->start;
+    int block = n_rows < EVAL_BLOCK_ROWS ? n_rows : EVAL_BLOCK_ROWS;
+    BatchBuffers *buf = create_batch_buffers(task->net, block, false);
+    Matrix *input = matrix_view_rows(task->X, task->start, block);
+    Vector *pred = create_vector_view(NULL, n_out, true);
+    Vector *target = create_vector_view(NULL, n_out, true);
+    task->failed = buf == NULL || input == NULL || pred == NULL ||
+                   target == NULL;
+    int i = task->start;
+    for (; !task->failed && i + block <= task->end; i += block) {
+        matrix_view_move_rows(input, task->X, i);
+        eval_block(task, buf, input, i, pred, target);
+    }
+    if (!task->failed && i < task->end) {
+        BatchBuffers *tail = create_batch_buffers_in(task->net,
+                                                     task->end - i, false,
+                                                     buf);
+        Matrix *tail_input = matrix_view_rows(task->X, i, task->end - i);
+        if (tail == NULL || tail_input == NULL) {
+            task->failed = true;
+        } else {
+            eval_block(task, tail, tail_input, i, pred, target);
+        }
+        if (tail) {
+            destroy_batch_buffers(tail);
+        }
+        if (tail_input) {
+            destroy_matrix(tail_input);
+        }
+    }
+    if (buf) {
+        destroy_batch_buffers(buf);
+    }
+    if (input) {
+        destroy_matrix(input);
+    }
+    if (pred) {
+        destroy_vector(pred);
+    }
+    if (target) {
+        destroy_vector(target);
+    }
+    return NULL;
+}
+
+void destroy_evaluation(Evaluation *eval) {
+    assert(eval);
+    free(eval->confusion);
+    free(eval);
+}
+
+static Evaluation *create_evaluation(int n_classes, int top_k) {
+    Evaluation *eval = malloc(sizeof(Evaluation));
+    if (eval == NULL) {
+        return NULL;
+    }
+    eval->confusion = calloc(n_classes * n_classes, sizeof(int));
+    if (eval->confusion == NULL) {
+        free(eval);
+        return NULL;
+    }
+    eval->loss = 0;
+    eval->accuracy = 0;
+    eval->top_k_accuracy = 0;
+    eval->top_k = top_k;
+    eval->n_classes = n_classes;
+    eval->n_samples = 0;
+    return eval;
+}
+
+// streams X through the network in blocks of EVAL_BLOCK_ROWS rows,
+// splitting the blocks across n_threads (0 for the count net_autotune
+// picked), and reduces the loss, accuracy,
+// top-k accuracy and confusion matrix without materializing Y_hat.
+// The loss is summed per block and the blocks in order, so the result
+// has the same bits for any thread count
+Evaluation *net_evaluate(const Network *net, const Matrix *X, const Matrix *Y,
+                         int top_k, int n_threads) {
+    assert(net);
+    assert(X);
+    assert(Y);
+    assert(net->loss);
+    assert(top_k > 0);
+    assert(n_threads >= 0);
+    if (n_threads == 0) {
+        n_threads = net->eval_threads;
+    }
+    int n = matrix_get_n_rows(X);
+    assert(n == matrix_get_n_rows(Y));
+    assert(n > 0);
+    int n_out = matrix_get_n_cols(Y);
+    assert(n_out == net_get_n_output(net));
+    int n_classes = n_out == 1 ? 2 : n_out;
+    int n_blocks = (n + EVAL_BLOCK_ROWS - 1) / EVAL_BLOCK_ROWS;
+    if (n_threads > n_blocks) {
+        n_threads = n_blocks;
+    }
+    Evaluation *eval = create_evaluation(n_classes, top_k);
+    double *block_loss = calloc(n_blocks, sizeof(double));
+    EvalTask *tasks = calloc(n_threads, sizeof(EvalTask));
+    pthread_t *threads = malloc(sizeof(pthread_t) * n_threads);
+    bool *spawned = calloc(n_threads, sizeof(bool));
+    if (eval == NULL || block_loss == NULL || tasks == NULL ||
+        threads == NULL || spawned == NULL) {
+        if (eval) {
+            destroy_evaluation(eval);
+        }
+        free(block_loss);
+        free(tasks);
+        free(threads);
+        free(spawned);
+        return NULL;
+    }
+    bool failed = false;
+    for (int t = 0; t < n_threads; t++) {
+        EvalTask *task = &tasks[t];
+        task->net = net;
+        task->X = X;
+        task->Y = Y;
+        // shares end on block boundaries, so the blocks do not depend
+        // on n_threads
+        int first = (int) ((long) n_blocks * t / n_threads);
+        int last = (int) ((long) n_blocks * (t + 1) / n_threads);
+        task->start = first * EVAL_BLOCK_ROWS;
+        task->end = last * EVAL_BLOCK_ROWS < n ? last * EVAL_BLOCK_ROWS : n;
+        task->top_k = top_k;
+        task->n_classes = n_classes;
+        task->block_loss = block_loss;
+        task->confusion = calloc(n_classes * n_classes, sizeof(int));
+        if (task->confusion == NULL) {
+            failed = true;
+            break;
+        }
+    }
+    // the calling thread takes the first share itself
+    for (int t = 1; !failed && t < n_threads; t++) {
+        spawned[t] = pthread_create(&threads[t], NULL, eval_worker,
+                                    &tasks[t]) == 0;
+        if (!spawned[t]) {
+            eval_worker(&tasks[t]);
+        }
+    }
+    if (!failed) {
+        eval_worker(&tasks[0]);
+    }
+    int correct = 0;
+    int top_k_correct = 0;
+    for (int t = 0; t < n_threads; t++) {
+        EvalTask *task = &tasks[t];
+        if (spawned[t]) {
+            pthread_join(threads[t], NULL);
+        }
+        failed = failed || task->failed;
+        if (task->confusion == NULL) {
+            continue;
+        }
+        correct += task->correct;
+        top_k_correct += task->top_k_correct;
+        for (int i = 0; i < n_classes * n_classes; i++) {
+            eval->confusion[i] += task->confusion[i];
+        }
+        free(task->confusion);
+    }
+    free(tasks);
+    free(threads);
+    free(spawned);
+    double total_loss = 0;
+    for (int b = 0; b < n_blocks; b++) {
+        total_loss += block_loss[b];
+    }
+    free(block_loss);
+    if (failed) {
+        destroy_evaluation(eval);
+        return NULL;
+    }
+    eval->n_samples = n;
+    eval->loss = total_loss / n;
+    eval->accuracy = (float) correct / n;
+    eval->top_k_accuracy = (float) top_k_correct / n;
+    return eval;
+}
+
+void evaluation_print(const Evaluation *eval) {
+    assert(eval);
+    printf("Samples: %d\n", eval->n_samples);
+    printf("Loss: %.4f\n", eval->loss);
+    printf("Accuracy: %.4f\n", eval->accuracy);
+    printf("Top-%d Accuracy: %.4f\n", eval->top_k, eval->top_k_accuracy);
+    printf("Confusion Matrix:\n");
+    for (int i = 0; i < eval->n_classes; i++) {
+        for (int j = 0; j < eval->n_classes; j++) {
+            if (j > 0) {
+                printf(" ");
+            }
+            printf("%d", eval->confusion[i * eval->n_classes + j]);
+        }
+        printf("\n");
+    }
+}
+
+typedef struct inference_request {
+    const Vector *input;
+    Vector *output;
+    // NULL for requests waited on with inference_request_wait
+    void (*callback)(Vector *output, void *ctx);
+    void *ctx;
+    struct timespec arrival;
+    bool done;
+    struct inference_request *next;
+} InferenceRequest;
+
+typedef struct inference_server {
+    const Network *net;
+    int max_batch;
+    long max_wait_ns;
+    int n_input;
+    // pending requests in arrival order
+    InferenceRequest *head;
+    InferenceRequest *tail;
+    int n_pending;
+    bool stop;
+    pthread_mutex_t lock;
+    // signals new requests to the scheduler and finished ones to waiters
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_t thread;
+    // scheduler-owned: the batch being run, its rows, and activations for
+    // every batch size. Those of max_batch are created up front, smaller
+    // sizes borrow their arena the first time they run
+    InferenceRequest **batch;
+    Matrix *input;
+    BatchBuffers **buffers;
+} InferenceServer;
+
+static void timespec_add_ns(struct timespec *ts, long ns) {
+    ts->tv_sec += ns / 1000000000L;
+    ts->tv_nsec += ns % 1000000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+// gathers the inputs of the batch into rows, runs one batched forward
+// pass and scatters the output rows back to the requests. Out of memory
+// for the buffers of n rows or their view, the batch runs padded to
+// max_batch rows in the buffers made with the server, which needs none
+static void run_inference_batch(InferenceServer *s, int n) {
+    if (s->buffers[n] == NULL) {
+        s->buffers[n] = create_batch_buffers_in(s->net, n, false,
+                                                s->buffers[s->max_batch]);
+    }
+    uint64_t start = trace_begin();
+    for (int i = 0; i < n; i++) {
+        memcpy(matrix_get_row_mut(s->input, i),
+               vector_get_data(s->batch[i]->input),
+               sizeof(float) * s->n_input);
+    }
+    Matrix *rows = s->buffers[n] && n < s->max_batch
+                       ? matrix_view_rows(s->input, 0, n)
+                       : NULL;
+    BatchBuffers *buf = rows ? s->buffers[n] : s->buffers[s->max_batch];
+    const Matrix *out = net_forward_batch(s->net, buf, rows ? rows : s->input,
+                                          false);
+    int n_out = matrix_get_n_cols(out);
+    for (int i = 0; i < n; i++) {
+        vector_copy_data(s->batch[i]->output, matrix_get_row(out, i), n_out);
+    }
+    if (rows) {
+        destroy_matrix(rows);
+    }
+    trace_end("inference_batch", n, start);
+}
+
+// waits for a first request, then up to max_wait after its arrival for
+// the batch to fill to max_batch, and runs what has arrived
+static void *inference_scheduler(void *arg) {
+    InferenceServer *s = arg;
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (s->head == NULL && !s->stop) {
+            pthread_cond_wait(&s->work, &s->lock);
+        }
+        if (s->head == NULL) {
+            break;
+        }
+        struct timespec deadline = s->head->arrival;
+        timespec_add_ns(&deadline, s->max_wait_ns);
+        while (s->n_pending < s->max_batch && !s->stop) {
+            if (pthread_cond_timedwait(&s->work, &s->lock, &deadline) ==
+                ETIMEDOUT) {
+                break;
+            }
+        }
+        int n = 0;
+        while (s->head && n < s->max_batch) {
+            s->batch[n++] = s->head;
+            s->head = s->head->next;
+        }
+        if (s->head == NULL) {
+            s->tail = NULL;
+        }
+        s->n_pending -= n;
+        pthread_mutex_unlock(&s->lock);
+
+        run_inference_batch(s, n);
+        for (int i = 0; i < n; i++) {
+            InferenceRequest *r = s->batch[i];
+            if (r->callback) {
+                r->callback(r->output, r->ctx);
+                free(r);
+                s->batch[i] = NULL;
+            }
+        }
+        pthread_mutex_lock(&s->lock);
+        for (int i = 0; i < n; i++) {
+            if (s->batch[i]) {
+                s->batch[i]->done = true;
+            }
+        }
+        pthread_cond_broadcast(&s->done);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+static void free_inference_server(InferenceServer *s) {
+    if (s->buffers) {
+        for (int i = 0; i <= s->max_batch; i++) {
+            if (s->buffers[i]) {
+                destroy_batch_buffers(s->buffers[i]);
+            }
+        }
+    }
+    if (s->input) {
+        destroy_matrix(s->input);
+    }
+    free(s->buffers);
+    free(s->batch);
+    free(s);
+}
+
+// serves single-row predictions submitted from any thread by grouping
+// them into batches of at most max_batch rows. A batch runs once it is
+// full or max_wait_us after its oldest request arrived, whichever comes
+// first. The network must not change while the server runs
+InferenceServer *create_inference_server(const Network *net, int max_batch,
+                                         int max_wait_us) {
+    assert(net);
+    assert(max_batch > 0);
+    assert(max_wait_us >= 0);
+    InferenceServer *s = calloc(1, sizeof(InferenceServer));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->net = net;
+    s->max_batch = max_batch;
+    s->max_wait_ns = max_wait_us * 1000L;
+    s->n_input = net->layers[0]->n_input;
+    s->batch = calloc(max_batch, sizeof(InferenceRequest *));
+    s->buffers = calloc(max_batch + 1, sizeof(BatchBuffers *));
+    s->input = create_matrix(max_batch, s->n_input);
+    if (s->buffers) {
+        s->buffers[max_batch] = create_batch_buffers(net, max_batch, false);
+    }
+    if (s->batch == NULL || s->buffers == NULL || s->input == NULL ||
+        s->buffers[max_batch] == NULL) {
+        free_inference_server(s);
+        return NULL;
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->work, NULL);
+    pthread_cond_init(&s->done, NULL);
+    if (pthread_create(&s->thread, NULL, inference_scheduler, s) != 0) {
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->work);
+        pthread_cond_destroy(&s->done);
+        free_inference_server(s);
+        return NULL;
+    }
+    return s;
+}
+
+// answers every request already submitted, then stops the scheduler
+void destroy_inference_server(InferenceServer *s) {
+    assert(s);
+    pthread_mutex_lock(&s->lock);
+    s->stop = true;
+    pthread_cond_broadcast(&s->work);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->work);
+    pthread_cond_destroy(&s->done);
+    free_inference_server(s);
+}
+
+static InferenceRequest *enqueue_request(InferenceServer *s,
+                                         const Vector *input, Vector *output,
+                                         void (*callback)(Vector *, void *),
+                                         void *ctx) {
+    assert(s);
+    assert(input);
+    assert(output);
+    assert(vector_get_n(input) == s->n_input);
+    assert(vector_get_n(output) == net_get_n_output(s->net));
+    InferenceRequest *r = malloc(sizeof(InferenceRequest));
+    if (r == NULL) {
+        return NULL;
+    }
+    r->input = input;
+    r->output = output;
+    r->callback = callback;
+    r->ctx = ctx;
+    r->done = false;
+    r->next = NULL;
+    timespec_get(&r->arrival, TIME_UTC);
+    pthread_mutex_lock(&s->lock);
+    assert(!s->stop);
+    if (s->tail) {
+        s->tail->next = r;
+    } else {
+        s->head = r;
+    }
+    s->tail = r;
+    s->n_pending++;
+    pthread_cond_signal(&s->work);
+    pthread_mutex_unlock(&s->lock);
+    return r;
+}
+
+// queues a prediction of input into output and returns the request to
+// pass to inference_request_wait, or NULL when out of memory. Both
+// vectors must stay valid until the wait returns
+InferenceRequest *inference_server_submit(InferenceServer *s,
+                                          const Vector *input,
+                                          Vector *output) {
+    return enqueue_request(s, input, output, NULL, NULL);
+}
+
+// queues a prediction and calls callback(output, ctx) from the scheduler
+// thread once output holds it. Returns 0 or -1 when out of memory
+int inference_server_submit_callback(InferenceServer *s, const Vector *input,
+                                     Vector *output,
+                                     void (*callback)(Vector *, void *),
+                                     void *ctx) {
+    assert(callback);
+    return enqueue_request(s, input, output, callback, ctx) ? 0 : -1;
+}
+
+// blocks until the output of a submitted request is ready and frees it
+void inference_request_wait(InferenceServer *s, InferenceRequest *r) {
+    assert(s);
+    assert(r);
+    assert(r->callback == NULL);
+    pthread_mutex_lock(&s->lock);
+    while (!r->done) {
+        pthread_cond_wait(&s->done, &s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+    free(r);
+}
+
+// folds every batch norm layer that directly follows a dense layer
+// without activation into that layer's weights and bias using the running
+// statistics, the batch norm activation moves to the dense layer. The
+// folded layers are destroyed and removed from the network, returns how
+// many were folded
+int net_fold_batchnorm(Network *net) {
+    assert(net);
+    drop_predict_pool(net);
+    int folded = 0;
+    int n_kept = 0;
+    for (int i = 0; i < net->n_layers; i++) {
+        Layer *l = net->layers[i];
+        Layer *prev = n_kept > 0 ? net->layers[n_kept - 1] : NULL;
+        if (l->kind != LAYER_BATCHNORM || prev == NULL ||
+            prev->kind != LAYER_DENSE || prev->act != NULL ||
+            prev->sparse != NULL) {
+            net->layers[n_kept++] = l;
+            continue;
+        }
+        const float *gamma = matrix_get_row(l->weights, 0);
+        const float *beta = vector_get_data(l->bias);
+        const float *mean = vector_get_data(l->running_mean);
+        const float *var = vector_get_data(l->running_var);
+        float *bias = vector_get_data_mut(prev->bias);
+        int n_cols = matrix_get_n_cols(prev->weights);
+        for (int j = 0; j < l->n; j++) {
+            float scale = gamma[j] / sqrtf(var[j] + BN_EPSILON);
+            float *row = matrix_get_row_mut(prev->weights, j);
+            for (int k = 0; k < n_cols; k++) {
+                row[k] *= scale;
+            }
+            bias[j] = (bias[j] - mean[j]) * scale + beta[j];
+        }
+        prev->act = l->act;
+        destroy_layer(l);
+        folded++;
+    }
+    net->n_layers = n_kept;
+    return folded;
+}
+
+static int compare_floats(const void *a, const void *b) {
+    float x = *(const float *) a;
+    float y = *(const float *) b;
+    return (x > y) - (x < y);
+}
+
+// zeroes the weights with the smallest magnitude until a sparsity
+// fraction of them is zero. Pruned weights are masked out of every later
+// update, so pruning again only ever removes more. Returns the number of
+// zero weights or -1 when out of memory
+int layer_prune(Layer *l, float sparsity) {
+    assert(l);
+    assert(!l->predict_copy);
+    assert(l->kind == LAYER_DENSE || l->kind == LAYER_CONV2D);
+    assert(l->sparse == NULL);
+    assert(sparsity >= 0 && sparsity <= 1);
+    int n_rows = matrix_get_n_rows(l->weights);
+    int n_cols = matrix_get_n_cols(l->weights);
+    int n = n_rows * n_cols;
+    int k = (int) (sparsity * n);
+    if (l->mask == NULL) {
+        l->mask = create_matrix(n_rows, n_cols);
+        if (l->mask == NULL) {
+            return -1;
+        }
+        matrix_initialize(l->mask, &one_initializator);
+    }
+    if (k == 0) {
+        return 0;
+    }
+    float *magnitudes = malloc(sizeof(float) * n);
+    if (magnitudes == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < n_rows; i++) {
+        const float *row = matrix_get_row(l->weights, i);
+        for (int j = 0; j < n_cols; j++) {
+            magnitudes[i * n_cols + j] = fabsf(row[j]);
+        }
+    }
+    qsort(magnitudes, n, sizeof(float), compare_floats);
+    float threshold = magnitudes[k - 1];
+    // weights equal to the threshold are pruned only up to k in total
+    int ties = k;
+    for (int i = 0; i < k; i++) {
+        ties -= magnitudes[i] < threshold;
+    }
+    free(magnitudes);
+    for (int i = 0; i < n_rows; i++) {
+        float *row = matrix_get_row_mut(l->weights, i);
+        float *mask = matrix_get_row_mut(l->mask, i);
+        for (int j = 0; j < n_cols; j++) {
+            float a = fabsf(row[j]);
+            if (a < threshold || (a == threshold && ties-- > 0)) {
+                row[j] = 0;
+                mask[j] = 0;
+            }
+        }
+    }
+    return k;
+}
+
+// fraction of the weights that are zero
+float layer_get_sparsity(const Layer *l) {
+    assert(l);
+    if (l->sparse) {
+        int n = sparse_matrix_get_n_rows(l->sparse) *
+                sparse_matrix_get_n_cols(l->sparse);
+        return 1.0f - (float) sparse_matrix_get_nnz(l->sparse) / n;
+    }
+    if (l->weights == NULL) {
+        return 0;
+    }
+    int n_rows = matrix_get_n_rows(l->weights);
+    int n_cols = matrix_get_n_cols(l->weights);
+    int zeros = 0;
+    for (int i = 0; i < n_rows; i++) {
+        const float *row = matrix_get_row(l->weights, i);
+        for (int j = 0; j < n_cols; j++) {
+            zeros += row[j] == 0.0f;
+        }
+    }
+    return (float) zeros / (n_rows * n_cols);
+}
+
+static int prune_layers(const Network *net, float sparsity) {
+    int pruned = 0;
+    for (int i = 0; i < net->n_layers; i++) {
+        Layer *l = net->layers[i];
+        if ((l->kind != LAYER_DENSE && l->kind != LAYER_CONV2D) ||
+            l->sparse) {
+            continue;
+        }
+        int n = layer_prune(l, sparsity);
+        if (n < 0) {
+            return -1;
+        }
+        pruned += n;
+    }
+    return pruned;
+}
+
+// one-shot magnitude pruning of every dense and convolution layer,
+// returns the number of zero weights or -1 when out of memory
+int net_prune(Network *net, float sparsity) {
+    assert(net);
+    drop_predict_pool(net);
+    return prune_layers(net, sparsity);
+}
+
+// prunes at the end of every epoch from start_epoch to end_epoch during
+// net_train, rising along a cubic curve to final_sparsity so that most of
+// the pruning happens while the network can still recover
+void net_set_pruning(Network *net, float final_sparsity, int start_epoch,
+                     int end_epoch) {
+    assert(net);
+    assert(final_sparsity >= 0 && final_sparsity <= 1);
+    assert(start_epoch >= 0 && start_epoch <= end_epoch);
+    net->prune_sparsity = final_sparsity;
+    net->prune_start = start_epoch;
+    net->prune_end = end_epoch;
+}
+
+static float scheduled_sparsity(const Network *net, int epoch) {
+    float progress = (float) (epoch - net->prune_start + 1) /
+                     (net->prune_end - net->prune_start + 1);
+    float remaining = 1.0f - progress;
+    return net->prune_sparsity * (1.0f - remaining * remaining * remaining);
+}
+
+// replaces the weights of every dense layer with at least min_sparsity
+// zeros by a compressed sparse copy that inference multiplies without
+// touching the zeros. The dense weights, gradients and mask are freed,
+// so the network can no longer be trained. Returns the number of layers
+// converted or -1 when out of memory
+int net_sparsify(Network *net, float min_sparsity) {
+    assert(net);
+    drop_predict_pool(net);
+    int converted = 0;
+    for (int i = 0; i < net->n_layers; i++) {
+        Layer *l = net->layers[i];
+        if (l->kind != LAYER_DENSE || l->sparse ||
+            layer_get_sparsity(l) < min_sparsity) {
+            continue;
+        }
+        l->sparse = create_sparse_matrix(l->weights);
+        if (l->sparse == NULL) {
+            return -1;
+        }
+        destroy_matrix(l->weights);
+        destroy_matrix(l->d_weights);
+        l->weights = NULL;
+        l->d_weights = NULL;
+        if (l->mask) {
+            destroy_matrix(l->mask);
+            l->mask = NULL;
+        }
+        converted++;
+    }
+    return converted;
+}
+
+// candidate tile sizes of the blocked products
+static const int TUNE_BLOCKS[] = {16, 32, 64, 128, 256};
+#define N_TUNE_BLOCKS ((int) (sizeof(TUNE_BLOCKS) / sizeof(TUNE_BLOCKS[0])))
+
+typedef struct {
+    Layer *layer;
+    const Matrix *input;
+    LayerBuffers *lb;
+    const Vector *x;
+    Vector *y;
+    const Network *net;
+    const Matrix *X;
+    const Matrix *Y;
+    int n_threads;
+    // set when a benchmarked call ran out of memory
+    bool failed;
+} TuneTask;
+
+static void bench_layer_batch(void *arg) {
+    TuneTask *task = arg;
+    layer_apply_batch(task->layer, task->input, task->lb, false);
+}
+
+static void bench_layer_gemv(void *arg) {
+    TuneTask *task = arg;
+    matrix_vec_mul_with(task->layer->weights, task->x, task->y,
+                        task->layer->gemv);
+}
+
+static void bench_evaluate(void *arg) {
+    TuneTask *task = arg;
+    Evaluation *eval = net_evaluate(task->net, task->X, task->Y, 1,
+                                    task->n_threads);
+    if (eval == NULL) {
+        task->failed = true;
+        return;
+    }
+    destroy_evaluation(eval);
+}
+
+// deterministic inputs, so tuning does not advance the generator
+static void fill_tune_input(Matrix *m) {
+    for (int i = 0; i < matrix_get_n_rows(m); i++) {
+        float *row = matrix_get_row_mut(m, i);
+        for (int j = 0; j < matrix_get_n_cols(m); j++) {
+            row[j] = (float) ((i * 7919 + j * 104729) % 2001) / 1000 - 1;
+        }
+    }
+}
+
+static void layer_tune_key(const Layer *l, char *key, size_t len) {
+    const ConvShape *c = &l->shape;
+    if (l->kind == LAYER_CONV2D) {
+        snprintf(key, len, "conv %dx%dx%d f%d k%d s%d p%d b%d", c->height,
+                 c->width, c->channels, matrix_get_n_rows(l->weights),
+                 c->kernel, c->stride, c->padding, EVAL_BLOCK_ROWS);
+    } else {
+        snprintf(key, len, "dense %dx%d b%d", l->n_input, l->n,
+                 EVAL_BLOCK_ROWS);
+    }
+}
+
+// times every tile size, and for dense layers both GEMV kernels, on a
+// block of EVAL_BLOCK_ROWS rows and keeps the fastest
+static void tune_layer(Layer *l, const Matrix *input, LayerBuffers *lb,
+                       int *values) {
+    TuneTask task = {.layer = l, .input = input, .lb = lb};
+    double best = -1;
+    for (int i = 0; i < N_TUNE_BLOCKS; i++) {
+        l->mul_block = TUNE_BLOCKS[i];
+        double t = tune_bench(bench_layer_batch, &task);
+        if (best < 0 || t < best) {
+            best = t;
+            values[0] = TUNE_BLOCKS[i];
+        }
+    }
+    values[1] = GEMV_MULTI_ROW;
+    if (l->kind == LAYER_DENSE) {
+        Vector *x = matrix_row_view(input, 0);
+        Vector *y = matrix_row_view(lb->output, 0);
+        assert(x && y);
+        task.x = x;
+        task.y = y;
+        l->gemv = GEMV_MULTI_ROW;
+        double multi = tune_bench(bench_layer_gemv, &task);
+        l->gemv = GEMV_SINGLE_ROW;
+        double single = tune_bench(bench_layer_gemv, &task);
+        values[1] = single < multi ? GEMV_SINGLE_ROW : GEMV_MULTI_ROW;
+        destroy_vector(x);
+        destroy_vector(y);
+    }
+}
+
+// picks the evaluation thread count among powers of two up to the number
+// of CPUs, every thread gets at least one block of rows. Returns -1 when
+// out of memory
+static int tune_eval_threads(const Network *net, int n_input) {
+    int n_cpus = tune_get_n_cpus();
+    int n_rows = EVAL_BLOCK_ROWS * n_cpus;
+    Matrix *X = create_matrix(n_rows, n_input);
+    Matrix *Y = create_matrix(n_rows, net_get_n_output(net));
+    if (X == NULL || Y == NULL) {
+        if (X) {
+            destroy_matrix(X);
+        }
+        if (Y) {
+            destroy_matrix(Y);
+        }
+        return -1;
+    }
+    fill_tune_input(X);
+    TuneTask task = {.net = net, .X = X, .Y = Y};
+    double best = -1;
+    int best_threads = 1;
+    for (int t = 1; !task.failed && t <= n_cpus; t *= 2) {
+        task.n_threads = t;
+        double time = tune_bench(bench_evaluate, &task);
+        if (best < 0 || time < best) {
+            best = time;
+            best_threads = t;
+        }
+    }
+    destroy_matrix(X);
+    destroy_matrix(Y);
+    return task.failed ? -1 : best_threads;
+}
+
+// whether a cached layer entry can be used, the file may have been
+// edited or written by another version
+static bool layer_tune_valid(const int *values) {
+    return values[0] > 0 &&
+           (values[1] == GEMV_MULTI_ROW || values[1] == GEMV_SINGLE_ROW);
+}
+
+// benchmarks the kernel variants of every dense and conv layer and the
+// evaluation thread count on this machine, then dispatches to the
+// winners. Results are looked up in and added to the tuning cache at
+// cache_path (NULL to always benchmark), keyed by CPU model and shape.
+// Entries that are out of range are benchmarked again. Returns the
+// number of configurations benchmarked, or -1 when out of memory or the
+// cache could not be written; the chosen kernels are kept either way
+int net_autotune(Network *net, const char *cache_path) {
+    assert(net);
+    assert(net->loss);
+    assert(net->n_layers > 0);
+    TuneCache *cache = load_tune_cache(cache_path);
+    if (cache == NULL) {
+        return -1;
+    }
+    int n_input = net->layers[0]->n_input;
+    Matrix *input = create_matrix(EVAL_BLOCK_ROWS, n_input);
+    BatchBuffers *buf = create_batch_buffers(net, EVAL_BLOCK_ROWS, false);
+    if (input == NULL || buf == NULL) {
+        if (input) {
+            destroy_matrix(input);
+        }
+        if (buf) {
+            destroy_batch_buffers(buf);
+        }
+        destroy_tune_cache(cache);
+        return -1;
+    }
+    fill_tune_input(input);
+    int tuned = 0;
+    bool ok = true;
+    const Matrix *layer_input = input;
+    for (int i = 0; i < net->n_layers; i++) {
+        Layer *l = net->layers[i];
+        LayerBuffers *lb = &buf->layers[i];
+        bool tunable = (l->kind == LAYER_DENSE ||
+                        l->kind == LAYER_CONV2D) && l->sparse == NULL;
+        if (tunable) {
+            char key[128];
+            int values[2];
+            layer_tune_key(l, key, sizeof(key));
+            if (!tune_cache_lookup(cache, key, values, 2) ||
+                !layer_tune_valid(values)) {
+                tune_layer(l, layer_input, lb, values);
+                ok = ok && tune_cache_store(cache, key, values, 2) == 0;
+                tuned++;
+            }
+            l->mul_block = values[0];
+            l->gemv = (GemvKernel) values[1];
+        }
+        // the next layer is tuned on realistic activations
+        layer_apply_batch(l, layer_input, lb, false);
+        layer_input = lb->output;
+    }
+    destroy_batch_buffers(buf);
+    destroy_matrix(input);
+
+    char key[128];
+    long n_weights = 0;
+    for (int i = 0; i < net->n_layers; i++) {
+        n_weights += layer_get_n_weights(net->layers[i]);
+    }
+    snprintf(key, sizeof(key), "eval l%d i%d o%d w%ld", net->n_layers,
+             n_input, net_get_n_output(net), n_weights);
+    int threads;
+    if (!tune_cache_lookup(cache, key, &threads, 1) || threads < 1) {
+        threads = tune_eval_threads(net, n_input);
+        if (threads < 0) {
+            destroy_tune_cache(cache);
+            return -1;
+        }
+        ok = ok && tune_cache_store(cache, key, &threads, 1) == 0;
+        tuned++;
+    }
+    net->eval_threads = threads;
+    if (ok && cache_path && tuned > 0) {
+        ok = tune_cache_save(cache, cache_path) == 0;
+    }
+    destroy_tune_cache(cache);
+    return ok ? tuned : -1;
+}
+
+#define CHECKPOINT_MAGIC "NNCK"
+#define CHECKPOINT_VERSION 3
+
+// where net_train stands when a snapshot is taken. row == n means the
+// epoch's batches are done but its end-of-epoch pruning is not
+typedef struct {
+    int epoch;
+    int row;
+    long step;
+    const int *indices;
+    int n;
+} TrainPosition;
+
+// appends n bytes to *dst, or only counts them when *dst is NULL
+static void put_bytes(char **dst, size_t *size, const void *src, size_t n) {
+    if (*dst) {
+        memcpy(*dst, src, n);
+        *dst += n;
+    }
+    *size += n;
+}
+
+static void put_int(char **dst, size_t *size, int value) {
+    put_bytes(dst, size, &value, sizeof(int));
+}
+
+static void put_matrix(char **dst, size_t *size, const Matrix *m) {
+    for (int i = 0; i < matrix_get_n_rows(m); i++) {
+        put_bytes(dst, size, matrix_get_row(m, i),
+                  sizeof(float) * matrix_get_n_cols(m));
+    }
+}
+
+static void put_vector(char **dst, size_t *size, const Vector *v) {
+    put_bytes(dst, size, vector_get_data(v), sizeof(float) * vector_get_n(v));
+}
+
+// serializes the parameters, batch norm statistics, pruning masks, the
+// generator state and the training position into dst. With dst NULL only
+// the size is computed. A packed network's parameters go out as one copy
+// of the arena. Plain SGD keeps no optimizer state beyond the learning
+// rate
+static size_t net_snapshot(const Network *net, const TrainPosition *pos,
+                           char *dst) {
+    size_t size = 0;
+    uint64_t rng = rand_get_state();
+    put_bytes(&dst, &size, CHECKPOINT_MAGIC, 4);
+    put_int(&dst, &size, CHECKPOINT_VERSION);
+    put_int(&dst, &size, net->n_layers);
+    put_bytes(&dst, &size, &net->learning_rate, sizeof(float));
+    put_bytes(&dst, &size, &rng, sizeof(rng));
+    put_int(&dst, &size, pos->epoch);
+    put_int(&dst, &size, pos->row);
+    put_bytes(&dst, &size, &pos->step, sizeof(long));
+    put_int(&dst, &size, pos->n);
+    put_bytes(&dst, &size, pos->indices, sizeof(int) * pos->n);
+    put_int(&dst, &size, net->params != NULL);
+    if (net->params) {
+        put_int(&dst, &size, matrix_get_n_cols(net->params));
+        put_matrix(&dst, &size, net->params);
+    }
+    for (int i = 0; i < net->n_layers; i++) {
+        const Layer *l = net->layers[i];
+        assert(l->sparse == NULL);
+        put_int(&dst, &size, l->kind);
+        put_int(&dst, &size, l->n_input);
+        put_int(&dst, &size, l->n);
+        put_int(&dst, &size, l->mask != NULL);
+        if (l->kind == LAYER_RECURRENT) {
+            put_int(&dst, &size, l->rnn.cell);
+            put_int(&dst, &size, l->rnn.seq_len);
+            put_int(&dst, &size, l->rnn.n_hidden);
+        }
+        if (l->weights && (net->params == NULL || !layer_in_arena(l))) {
+            put_matrix(&dst, &size, l->weights);
+        }
+        if (l->bias && net->params == NULL) {
+            put_vector(&dst, &size, l->bias);
+        }
+        if (l->kind == LAYER_BATCHNORM) {
+            put_vector(&dst, &size, l->running_mean);
+            put_vector(&dst, &size, l->running_var);
+        }
+        if (l->mask) {
+            put_matrix(&dst, &size, l->mask);
+        }
+    }
+    return size;
+}
+
+// copies n bytes out of the snapshot, or skips them when dst is NULL.
+// False when the snapshot is too short
+static bool get_bytes(const char **src, const char *end, void *dst,
+                      size_t n) {
+    if ((size_t) (end - *src) < n) {
+        return false;
+    }
+    if (dst) {
+        memcpy(dst, *src, n);
+    }
+    *src += n;
+    return true;
+}
+
+static bool get_int(const char **src, const char *end, int *value) {
+    return get_bytes(src, end, value, sizeof(int));
+}
+
+static bool get_matrix(const char **src, const char *end, Matrix *m) {
+    for (int i = 0; i < matrix_get_n_rows(m); i++) {
+        if (!get_bytes(src, end, matrix_get_row_mut(m, i),
+                       sizeof(float) * matrix_get_n_cols(m))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool get_vector(const char **src, const char *end, Vector *v) {
+    return get_bytes(src, end, vector_get_data_mut(v),
+                     sizeof(float) * vector_get_n(v));
+}
+
+// reads the header of a layer record, false when it does not describe l
+static bool get_layer_header(const Layer *l, const char **src,
+                             const char *end, int *has_mask) {
+    int kind, n_input, n;
+    if (!get_int(src, end, &kind) || !get_int(src, end, &n_input) ||
+        !get_int(src, end, &n) || !get_int(src, end, has_mask) ||
+        kind != (int) l->kind || n_input != l->n_input || n != l->n ||
+        l->sparse != NULL || (*has_mask && l->weights == NULL)) {
+        return false;
+    }
+    int cell, seq_len, n_hidden;
+    return l->kind != LAYER_RECURRENT ||
+           (get_int(src, end, &cell) && get_int(src, end, &seq_len) &&
+            get_int(src, end, &n_hidden) && cell == (int) l->rnn.cell &&
+            seq_len == l->rnn.seq_len && n_hidden == l->rnn.n_hidden);
+}
+
+static size_t matrix_floats(const Matrix *m) {
+    return (size_t) matrix_get_n_rows(m) * matrix_get_n_cols(m);
+}
+
+// steps over the record of layer l without writing anything, false when
+// it does not match l or is cut short
+static bool check_layer(const Layer *l, const char **src, const char *end,
+                        bool packed, int *has_mask) {
+    if (!get_layer_header(l, src, end, has_mask)) {
+        return false;
+    }
+    size_t floats = 0;
+    if (l->weights && (!packed || !layer_in_arena(l))) {
+        floats += matrix_floats(l->weights);
+    }
+    if (l->bias && !packed) {
+        floats += vector_get_n(l->bias);
+    }
+    if (l->kind == LAYER_BATCHNORM) {
+        floats += 2 * (size_t) vector_get_n(l->running_mean);
+    }
+    if (*has_mask) {
+        floats += matrix_floats(l->weights);
+    }
+    return get_bytes(src, end, NULL, sizeof(float) * floats);
+}
+
+// copies the record of layer l, which check_layer accepted, into l. mask
+// is a new matrix for a record with a mask when l had none
+static void restore_layer(Layer *l, const char **src, const char *end,
+                          bool packed, Matrix *mask) {
+    int has_mask;
+    bool ok = get_layer_header(l, src, end, &has_mask);
+    if (l->weights && (!packed || !layer_in_arena(l))) {
+        ok = ok && get_matrix(src, end, l->weights);
+    }
+    if (l->bias && !packed) {
+        ok = ok && get_vector(src, end, l->bias);
+    }
+    if (l->kind == LAYER_BATCHNORM) {
+        ok = ok && get_vector(src, end, l->running_mean) &&
+             get_vector(src, end, l->running_var);
+    }
+    if (has_mask && l->mask == NULL) {
+        l->mask = mask;
+    } else if (!has_mask && l->mask) {
+        destroy_matrix(l->mask);
+        l->mask = NULL;
+    }
+    ok = ok && (!has_mask || get_matrix(src, end, l->mask));
+    assert(ok);
+    (void) ok;
+}
+
+// net_train writes a snapshot to path every every_steps mini-batches and
+// once more when it returns. The write runs on a background thread while
+// training goes on. Returns 0 or -1 when out of memory
+int net_set_checkpoint(Network *net, const char *path, int every_steps) {
+    assert(net);
+    assert(path);
+    assert(every_steps > 0);
+    size_t len = strlen(path) + 1;
+    char *copy = malloc(len);
+    if (copy == NULL) {
+        return -1;
+    }
+    memcpy(copy, path, len);
+    free(net->checkpoint_path);
+    net->checkpoint_path = copy;
+    net->checkpoint_every = every_steps;
+    return 0;
+}
+
+static void free_masks(Matrix **masks, int n) {
+    for (int i = 0; masks && i < n; i++) {
+        if (masks[i]) {
+            destroy_matrix(masks[i]);
+        }
+    }
+    free(masks);
+}
+
+// parses a snapshot into net, with resume also the training position.
+// The whole snapshot is checked and every allocation made before the
+// first value is written, a rejected one leaves net as it was
+static int net_restore(Network *net, const char *data, size_t size,
+                       bool resume) {
+    const char *src = data;
+    const char *end = data + size;
+    char magic[4];
+    int version, n_layers, epoch, row, n;
+    float lr;
+    uint64_t rng;
+    long step;
+    bool ok = get_bytes(&src, end, magic, 4) &&
+              memcmp(magic, CHECKPOINT_MAGIC, 4) == 0 &&
+              get_int(&src, end, &version) &&
+              version == CHECKPOINT_VERSION &&
+              get_int(&src, end, &n_layers) && n_layers == net->n_layers &&
+              get_bytes(&src, end, &lr, sizeof(float)) &&
+              get_bytes(&src, end, &rng, sizeof(rng)) && rng != 0 &&
+              get_int(&src, end, &epoch) && get_int(&src, end, &row) &&
+              get_bytes(&src, end, &step, sizeof(long)) &&
+              get_int(&src, end, &n) && n >= 0 && row >= 0 && row <= n;
+    int *indices = ok ? malloc(sizeof(int) * (n > 0 ? n : 1)) : NULL;
+    int packed = 0;
+    ok = ok && indices && get_bytes(&src, end, indices, sizeof(int) * n) &&
+         get_int(&src, end, &packed);
+    // the arena layout only depends on the architecture
+    const char *arena = NULL;
+    if (ok && packed) {
+        int n_floats;
+        ok = get_int(&src, end, &n_floats) &&
+             n_floats == net_arena_floats(net);
+        arena = src;
+        ok = ok && get_bytes(&src, end, NULL, sizeof(float) * n_floats);
+    }
+    // masks the snapshot has and the layers do not, made up front
+    Matrix **masks = ok ? calloc(net->n_layers, sizeof(Matrix *)) : NULL;
+    const char *layers = src;
+    ok = ok && masks;
+    for (int i = 0; ok && i < net->n_layers; i++) {
+        const Layer *l = net->layers[i];
+        int has_mask;
+        ok = check_layer(l, &src, end, packed, &has_mask);
+        if (ok && has_mask && l->mask == NULL) {
+            masks[i] = create_matrix(matrix_get_n_rows(l->weights),
+                                     matrix_get_n_cols(l->weights));
+            ok = masks[i] != NULL;
+        }
+    }
+    ok = ok && (!packed || net_pack_parameters(net) == 0);
+    if (!ok) {
+        free_masks(masks, net->n_layers);
+        free(indices);
+        return -1;
+    }
+    if (packed) {
+        get_matrix(&arena, end, net->params);
+    }
+    src = layers;
+    for (int i = 0; i < net->n_layers; i++) {
+        restore_layer(net->layers[i], &src, end, packed, masks[i]);
+        if (net->layers[i]->mask == masks[i]) {
+            masks[i] = NULL;
+        }
+    }
+    free_masks(masks, net->n_layers);
+    if (!resume) {
+        free(indices);
+        return 0;
+    }
+    net->learning_rate = lr;
+    rand_set_state(rng);
+    free(net->resume_indices);
+    net->resume_indices = indices;
+    net->resume_n = n;
+    net->resume_epoch = epoch;
+    net->resume_row = row;
+    net->resume_step = step;
+    return 0;
+}
+
+// restores a snapshot written by net_train into a network of the same
+// architecture, including the generator state, and makes the next
+// net_train on the same data continue exactly where the snapshot was
+// taken. Returns 0, or -1 when the file is unreadable, corrupted or does
+// not match the network
+int net_load_checkpoint(Network *net, const char *path) {
+    assert(net);
+    assert(path);
+    size_t size;
+    char *data = checkpoint_read(path, &size);
+    if (data == NULL) {
+        return -1;
+    }
+    drop_predict_pool(net);
+    int rc = net_restore(net, data, size, true);
+    free(data);
+    return rc;
+}
+
+// the copy on the training thread, the writer thread does the I/O. The
+// snapshot grows when pruning adds masks, then the writer is replaced by
+// one with larger buffers once its pending write is done. Returns 0, or
+// -1 with *writer NULL when the new writer could not be created
+static int take_checkpoint(const Network *net, CheckpointWriter **writer,
+                           const TrainPosition *pos) {
+    size_t size = net_snapshot(net, pos, NULL);
+    if (size > checkpoint_writer_get_capacity(*writer)) {
+        destroy_checkpoint_writer(*writer);
+        *writer = create_checkpoint_writer(net->checkpoint_path, size);
+        if (*writer == NULL) {
+            return -1;
+        }
+    }
+    uint64_t start = trace_begin();
+    char *dst = checkpoint_writer_begin(*writer);
+    net_snapshot(net, pos, dst);
+    checkpoint_writer_commit(*writer, size);
+    trace_end("checkpoint_snapshot", (int) pos->step, start);
+    return 0;
+}
+
+// replicas other than the first train in step with it, only it prints
+static bool net_reports(const Network *net) {
+    return net->transport == NULL || net->transport->rank == 0;
+}
+
+// frees what net_train allocated, members that failed are NULL
+static void free_train_buffers(BatchBuffers *buf, BatchBuffers *tail_buf,
+                               Matrix *input, Matrix *tail_input,
+                               Matrix *target, Matrix *tail_target,
+                               Vector *target_row) {
+    BatchBuffers *buffers[] = {tail_buf, buf};
+    for (int i = 0; i < 2; i++) {
+        if (buffers[i]) {
+            destroy_batch_buffers(buffers[i]);
+        }
+    }
+    Matrix *matrices[] = {input, tail_input, target, tail_target};
+    for (int i = 0; i < 4; i++) {
+        if (matrices[i]) {
+            destroy_matrix(matrices[i]);
+        }
+    }
+    if (target_row) {
+        destroy_vector(target_row);
+    }
+}
+
+// shuffles the rows every epoch and trains on mini-batches of
+// net->batch_size rows, the last batch of an epoch may be smaller. After
+// net_load_checkpoint, training resumes at the restored position.
+// Returns 0, or -1 when out of memory, when the transport failed to sum
+// a step's gradients or when the restored position was taken on a
+// different number of rows
+int net_train(Network *net, const Matrix *X, const Matrix *Y,
+              int epochs) {
+    assert(net);
+    assert(X);
+    assert(Y);
+    assert(net->loss);
+    int n = matrix_get_n_rows(X);
+    assert(n == matrix_get_n_rows(Y));
+    int batch = net->batch_size < n ? net->batch_size : n;
+    int tail = n % batch;
+    drop_predict_pool(net);
+    // a checkpoint only resumes on data of the size it was taken on
+    if ((net->resume_indices && net->resume_n != n) ||
+        net_pack_parameters(net) != 0) {
+        return -1;
+    }
+    int *indices = malloc(sizeof(int) * n);
+    if (indices == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        indices[i] = i;
+    }
+    TrainPosition pos = {.indices = indices, .n = n};
+    if (net->resume_indices) {
+        memcpy(indices, net->resume_indices, sizeof(int) * n);
+        pos.epoch = net->resume_epoch;
+        pos.row = net->resume_row;
+        pos.step = net->resume_step;
+        free(net->resume_indices);
+        net->resume_indices = NULL;
+    }
+    int x_cols = matrix_get_n_cols(X);
+    int y_cols = matrix_get_n_cols(Y);
+    BatchBuffers *buf = create_batch_buffers(net, batch, true);
+    BatchBuffers *tail_buf = tail && buf ? create_batch_buffers_in(
+                                               net, tail, true, buf)
+                                         : NULL;
+    Matrix *input = create_matrix(batch, x_cols);
+    Matrix *tail_input = tail ? create_matrix(tail, x_cols) : NULL;
+    Matrix *target = create_matrix(batch, y_cols);
+    Matrix *tail_target = tail ? create_matrix(tail, y_cols) : NULL;
+    Vector *target_row = create_vector_view(NULL, y_cols, true);
+    CheckpointWriter *writer = NULL;
+    bool ok = buf && input && target && target_row &&
+              (!tail || (tail_buf && tail_input && tail_target));
+    if (ok && net->checkpoint_path) {
+        writer = create_checkpoint_writer(net->checkpoint_path,
+                                          net_snapshot(net, &pos, NULL));
+        ok = writer != NULL;
+    }
+    if (!ok) {
+        free_train_buffers(buf, tail_buf, input, tail_input, target,
+                           tail_target, target_row);
+        free(indices);
+        return -1;
+    }
+    int rc = 0;
+    for (int i = pos.epoch; i < epochs; i++) {
+        #ifdef VERBOSE
+            if (net_reports(net)) {
+                printf("--------------\n");
+                printf("EPOCH: %d\n", i);
+            }
+        #endif
+        // a resumed epoch keeps the order it was interrupted in
+        if (pos.row == 0) {
+            net_shuffle(net, indices, n, i);
         }
+        pos.epoch = i;
+        double total_loss = 0;
+        for (int j = pos.row; rc == 0 && j < n; j += batch) {
+            bool is_tail = j + batch > n;
+            BatchBuffers *b = is_tail ? tail_buf : buf;
+            Matrix *x = is_tail ? tail_input : input;
+            Matrix *t = is_tail ? tail_target : target;
+            uint64_t start = trace_begin();
+            matrix_gather_rows(x, X, &indices[j]);
+            matrix_gather_rows(t, Y, &indices[j]);
+            trace_end("load_batch", (int) pos.step, start);
+            if (net_train_step(net, b, x, t, target_row, &total_loss) != 0) {
+                rc = -1;
+                break;
+            }
+            pos.step++;
+            if (writer && pos.step % net->checkpoint_every == 0) {
+                pos.row = is_tail ? n : j + batch;
+                if (take_checkpoint(net, &writer, &pos) != 0) {
+                    rc = -1;
+                    break;
+                }
+            }
+        }
+        if (rc != 0) {
+            break;
+        }
+        if (net->prune_sparsity > 0 && i >= net->prune_start &&
+            i <= net->prune_end) {
+            if (prune_layers(net, scheduled_sparsity(net, i)) < 0) {
+                rc = -1;
+                break;
+            }
+        }
+        pos.row = 0;
+        #ifdef VERBOSE
+            if (net_reports(net)) {
+                printf("Avg Loss: %.2f\n", total_loss / n);
+            }
+        #endif
+    }
+    // after a failed step the last checkpoint taken stays the latest
+    if (writer && rc == 0) {
+        pos.epoch = epochs > pos.epoch ? epochs : pos.epoch;
+        pos.row = 0;
+        rc = take_checkpoint(net, &writer, &pos);
+    }
+    if (writer && rc == 0) {
+        int written = checkpoint_writer_wait(writer);
         #ifdef VERBOSE
-            printf("Avg Loss: %.2f\n", total_loss / n);
+            if (written != 0) {
+                printf("Failed to write checkpoint %s\n",
+                       net->checkpoint_path);
+            }
         #endif
+        (void) written;
+    }
+    if (writer) {
+        destroy_checkpoint_writer(writer);
     }
-    free(input);
-    free(target);
-    destroy_vector(output);
+    free_train_buffers(buf, tail_buf, input, tail_input, target,
+                       tail_target, target_row);
     free(indices);
-}
\ No newline at end of file
+    return rc;
+}
+
+// a reusable barrier, macOS has no pthread_barrier_t
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int n;
+    int waiting;
+    long generation;
+} StepBarrier;
+
+static void step_barrier_release(StepBarrier *b) {
+    b->waiting = 0;
+    b->generation++;
+    pthread_cond_broadcast(&b->cond);
+}
+
+static void step_barrier_wait(StepBarrier *b) {
+    pthread_mutex_lock(&b->lock);
+    long generation = b->generation;
+    if (++b->waiting == b->n) {
+        step_barrier_release(b);
+    } else {
+        while (generation == b->generation) {
+            pthread_cond_wait(&b->cond, &b->lock);
+        }
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+// for a thread that never arrives, one that failed to start
+static void step_barrier_leave(StepBarrier *b) {
+    pthread_mutex_lock(&b->lock);
+    b->n--;
+    if (b->waiting > 0 && b->waiting == b->n) {
+        step_barrier_release(b);
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+// the activations of one model of net_train_many
+typedef struct {
+    Network *net;
+    BatchBuffers *buf;
+    BatchBuffers *tail_buf;
+    Vector *target_row;
+    // set when pruning ran out of memory, the model trains no further
+    bool failed;
+} ModelTraining;
+
+// the mini-batches are gathered once into two slots: while the models
+// train on the batch of step k in one, the next batch is loaded into the
+// other
+typedef struct {
+    ModelTraining *models;
+    int n_models;
+    const Matrix *X;
+    const Matrix *Y;
+    int *indices;
+    int batch;
+    int steps_per_epoch;
+    long n_steps;
+    Matrix *input[2];
+    Matrix *target[2];
+    // row views of the slots for the smaller last batch of an epoch
+    Matrix *tail_input[2];
+    Matrix *tail_target[2];
+    // models of the step in each slot handed out so far
+    atomic_int next_model[2];
+    // n_models losses summed per epoch
+    double *epoch_loss;
+    StepBarrier barrier;
+} ManyTraining;
+
+typedef struct {
+    ManyTraining *mt;
+    // thread 0 loads the batches
+    int tid;
+} ManyWorker;
+
+static int step_rows(const ManyTraining *mt, long step) {
+    int n = matrix_get_n_rows(mt->X);
+    int row = (int) (step % mt->steps_per_epoch) * mt->batch;
+    return row + mt->batch <= n ? mt->batch : n - row;
+}
+
+// gathers the batch of step into its slot, shuffling first at the start
+// of an epoch like net_train
+static void load_many_step(ManyTraining *mt, long step) {
+    int row = (int) (step % mt->steps_per_epoch) * mt->batch;
+    if (row == 0) {
+        net_shuffle(mt->models[0].net, mt->indices, matrix_get_n_rows(mt->X),
+                    step / mt->steps_per_epoch);
+    }
+    int slot = step % 2;
+    bool is_tail = step_rows(mt, step) < mt->batch;
+    uint64_t start = trace_begin();
+    matrix_gather_rows(is_tail ? mt->tail_input[slot] : mt->input[slot],
+                       mt->X, &mt->indices[row]);
+    matrix_gather_rows(is_tail ? mt->tail_target[slot] : mt->target[slot],
+                       mt->Y, &mt->indices[row]);
+    trace_end("load_batch", (int) step, start);
+}
+
+static void *many_worker(void *arg) {
+    ManyWorker *w = arg;
+    ManyTraining *mt = w->mt;
+    for (long step = 0; step < mt->n_steps; step++) {
+        int slot = step % 2;
+        int epoch = (int) (step / mt->steps_per_epoch);
+        bool is_tail = step_rows(mt, step) < mt->batch;
+        bool epoch_end = (step + 1) % mt->steps_per_epoch == 0;
+        if (w->tid == 0 && step + 1 < mt->n_steps) {
+            // the other slot was freed by the last barrier
+            load_many_step(mt, step + 1);
+            atomic_store(&mt->next_model[1 - slot], 0);
+        }
+        // models are handed out one at a time, so a thread that drew
+        // small ones takes more of them
+        int m;
+        while ((m = atomic_fetch_add(&mt->next_model[slot], 1)) <
+               mt->n_models) {
+            ModelTraining *model = &mt->models[m];
+            Network *net = model->net;
+            if (model->failed) {
+                continue;
+            }
+            // without a transport a step does not fail
+            net_train_step(net, is_tail ? model->tail_buf : model->buf,
+                           is_tail ? mt->tail_input[slot] : mt->input[slot],
+                           is_tail ? mt->tail_target[slot] : mt->target[slot],
+                           model->target_row,
+                           &mt->epoch_loss[(long) epoch * mt->n_models + m]);
+            if (epoch_end && net->prune_sparsity > 0 &&
+                epoch >= net->prune_start && epoch <= net->prune_end) {
+                float sparsity = scheduled_sparsity(net, epoch);
+                model->failed = prune_layers(net, sparsity) < 0;
+            }
+        }
+        step_barrier_wait(&mt->barrier);
+        #ifdef VERBOSE
+            if (w->tid == 0 && epoch_end) {
+                int n = matrix_get_n_rows(mt->X);
+                printf("--------------\n");
+                printf("EPOCH: %d\n", epoch);
+                printf("Avg Loss:");
+                for (int i = 0; i < mt->n_models; i++) {
+                    printf(" %.2f", mt->epoch_loss[(long) epoch *
+                                                   mt->n_models + i] / n);
+                }
+                printf("\n");
+            }
+        #endif
+    }
+    return NULL;
+}
+
+static void free_many_training(ManyTraining *mt) {
+    for (int i = 0; mt->models && i < mt->n_models; i++) {
+        ModelTraining *model = &mt->models[i];
+        if (model->tail_buf) {
+            destroy_batch_buffers(model->tail_buf);
+        }
+        if (model->buf) {
+            destroy_batch_buffers(model->buf);
+        }
+        if (model->target_row) {
+            destroy_vector(model->target_row);
+        }
+    }
+    Matrix *matrices[] = {mt->tail_input[0], mt->tail_input[1],
+                          mt->tail_target[0], mt->tail_target[1],
+                          mt->input[0], mt->input[1], mt->target[0],
+                          mt->target[1]};
+    for (int i = 0; i < 8; i++) {
+        if (matrices[i]) {
+            destroy_matrix(matrices[i]);
+        }
+    }
+    free(mt->models);
+    free(mt->indices);
+    free(mt->epoch_loss);
+}
+
+// trains every network of nets on X and Y on n_threads threads for a
+// sweep or an ensemble. Each mini-batch is gathered once and every model
+// takes one step on it, so the rows are shuffled once per epoch for all
+// of them and they must share one batch size. Every model sees all rows,
+// so the folds of a cross-validation each need their own call. Pruning
+// schedules apply, checkpoints and transports do not. Returns 0 or -1
+// when out of memory; a model whose pruning ran out of memory stops
+// there, the others finish
+int net_train_many(Network **nets, int n_nets, const Matrix *X,
+                   const Matrix *Y, int epochs, int n_threads) {
+    assert(nets);
+    assert(n_nets > 0);
+    assert(X);
+    assert(Y);
+    assert(n_threads > 0);
+    int n = matrix_get_n_rows(X);
+    assert(n == matrix_get_n_rows(Y));
+    int batch = nets[0]->batch_size < n ? nets[0]->batch_size : n;
+    int tail = n % batch;
+    for (int i = 0; i < n_nets; i++) {
+        assert(nets[i]->loss);
+        assert(nets[i]->batch_size == nets[0]->batch_size);
+        // the models share one sample order
+        assert(nets[i]->deterministic == nets[0]->deterministic);
+        assert(nets[i]->seed == nets[0]->seed);
+        assert(nets[i]->checkpoint_path == NULL);
+        assert(nets[i]->transport == NULL);
+        drop_predict_pool(nets[i]);
+        if (net_pack_parameters(nets[i]) != 0) {
+            return -1;
+        }
+    }
+    if (n_threads > n_nets) {
+        n_threads = n_nets;
+    }
+    ManyTraining mt = {
+        .n_models = n_nets,
+        .X = X,
+        .Y = Y,
+        .batch = batch,
+        .steps_per_epoch = (n + batch - 1) / batch,
+    };
+    mt.n_steps = (long) epochs * mt.steps_per_epoch;
+    mt.models = calloc(n_nets, sizeof(ModelTraining));
+    mt.indices = malloc(sizeof(int) * n);
+    mt.epoch_loss = calloc((size_t) epochs * n_nets + 1, sizeof(double));
+    bool ok = mt.models && mt.indices && mt.epoch_loss;
+    for (int s = 0; ok && s < 2; s++) {
+        mt.input[s] = create_matrix(batch, matrix_get_n_cols(X));
+        mt.target[s] = create_matrix(batch, matrix_get_n_cols(Y));
+        ok = mt.input[s] && mt.target[s];
+        if (ok && tail) {
+            mt.tail_input[s] = matrix_view_rows(mt.input[s], 0, tail);
+            mt.tail_target[s] = matrix_view_rows(mt.target[s], 0, tail);
+            ok = mt.tail_input[s] && mt.tail_target[s];
+        }
+    }
+    for (int i = 0; ok && i < n_nets; i++) {
+        ModelTraining *model = &mt.models[i];
+        model->net = nets[i];
+        model->buf = create_batch_buffers(nets[i], batch, true);
+        model->target_row = create_vector_view(NULL, matrix_get_n_cols(Y),
+                                               true);
+        ok = model->buf && model->target_row;
+        if (ok && tail) {
+            model->tail_buf = create_batch_buffers_in(nets[i], tail, true,
+                                                      model->buf);
+            ok = model->tail_buf != NULL;
+        }
+    }
+    ManyWorker *workers = malloc(sizeof(ManyWorker) * n_threads);
+    pthread_t *threads = malloc(sizeof(pthread_t) * n_threads);
+    bool *spawned = calloc(n_threads, sizeof(bool));
+    if (!ok || workers == NULL || threads == NULL || spawned == NULL) {
+        free(workers);
+        free(threads);
+        free(spawned);
+        free_many_training(&mt);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        mt.indices[i] = i;
+    }
+    pthread_mutex_init(&mt.barrier.lock, NULL);
+    pthread_cond_init(&mt.barrier.cond, NULL);
+    mt.barrier.n = n_threads;
+    atomic_init(&mt.next_model[0], 0);
+    atomic_init(&mt.next_model[1], 0);
+    if (mt.n_steps > 0) {
+        load_many_step(&mt, 0);
+    }
+    for (int t = 0; t < n_threads; t++) {
+        workers[t] = (ManyWorker) {.mt = &mt, .tid = t};
+    }
+    // the calling thread is thread 0, the steps go on with fewer threads
+    // when some cannot be started
+    for (int t = 1; t < n_threads; t++) {
+        spawned[t] = pthread_create(&threads[t], NULL, many_worker,
+                                    &workers[t]) == 0;
+        if (!spawned[t]) {
+            step_barrier_leave(&mt.barrier);
+        }
+    }
+    many_worker(&workers[0]);
+    for (int t = 1; t < n_threads; t++) {
+        if (spawned[t]) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+    pthread_mutex_destroy(&mt.barrier.lock);
+    pthread_cond_destroy(&mt.barrier.cond);
+    int rc = 0;
+    for (int i = 0; i < n_nets; i++) {
+        rc = mt.models[i].failed ? -1 : rc;
+    }
+    free(workers);
+    free(threads);
+    free(spawned);
+    free_many_training(&mt);
+    return rc;
+}
+
+// multiply-adds per row of a forward pass, what pipeline stages are
+// balanced on
+static long layer_cost(const Layer *l) {
+    switch (l->kind) {
+    case LAYER_DENSE:
+        return (long) l->n * l->n_input;
+    case LAYER_CONV2D:
+        return (long) matrix_get_n_rows(l->weights) *
+               matrix_get_n_cols(l->weights) *
+               conv_shape_get_n_patches(&l->shape);
+    case LAYER_RECURRENT:
+        return (long) matrix_get_n_rows(l->weights) *
+               matrix_get_n_cols(l->weights) * l->rnn.seq_len;
+    default:
+        return l->n;
+    }
+}
+
+// splits the layers into n_stages contiguous groups so that the most
+// expensive group costs as little as possible. Stage s runs layers
+// first[s] to first[s + 1] - 1. Returns 0 or -1
+static int partition_stages(const Network *net, int n_stages, int *first) {
+    int n = net->n_layers;
+    assert(n_stages > 0 && n_stages <= n);
+    long *prefix = malloc(sizeof(long) * (n + 1));
+    // best[s * (n + 1) + i]: the cost of the layers before i split into
+    // s + 1 stages, cut[...] where the last of them starts
+    long *best = malloc(sizeof(long) * n_stages * (n + 1));
+    int *cut = malloc(sizeof(int) * n_stages * (n + 1));
+    if (prefix == NULL || best == NULL || cut == NULL) {
+        free(prefix);
+        free(best);
+        free(cut);
+        return -1;
+    }
+    prefix[0] = 0;
+    for (int i = 0; i < n; i++) {
+        prefix[i + 1] = prefix[i] + layer_cost(net->layers[i]);
+    }
+    for (int i = 0; i <= n; i++) {
+        best[i] = prefix[i];
+        cut[i] = 0;
+    }
+    for (int s = 1; s < n_stages; s++) {
+        for (int i = s + 1; i <= n; i++) {
+            long *b = &best[s * (n + 1) + i];
+            *b = -1;
+            for (int j = s; j < i; j++) {
+                long before = best[(s - 1) * (n + 1) + j];
+                long cost = prefix[i] - prefix[j];
+                long worst = before > cost ? before : cost;
+                if (*b < 0 || worst < *b) {
+                    *b = worst;
+                    cut[s * (n + 1) + i] = j;
+                }
+            }
+        }
+    }
+    first[n_stages] = n;
+    for (int s = n_stages - 1; s >= 0; s--) {
+        first[s] = cut[s * (n + 1) + first[s + 1]];
+    }
+    free(prefix);
+    free(best);
+    free(cut);
+    return 0;
+}
+
+// spins before a waiting stage yields its core
+#define PIPELINE_SPINS 4096
+
+// micro-batch numbers handed from one stage to its neighbour. Only one
+// thread pushes and only one pops, so the counters need no lock
+typedef struct {
+    int *slots;
+    int capacity;
+    atomic_long pushed;
+    // keeps the two counters on separate cache lines
+    char pad[64];
+    atomic_long popped;
+} StageQueue;
+
+// m's activations and deltas, written before the push, become visible
+// to the thread that pops it
+static void stage_queue_push(StageQueue *q, int m) {
+    long n = atomic_load_explicit(&q->pushed, memory_order_relaxed);
+    assert(n - atomic_load(&q->popped) < q->capacity);
+    q->slots[n % q->capacity] = m;
+    atomic_store_explicit(&q->pushed, n + 1, memory_order_release);
+}
+
+static int stage_queue_pop(StageQueue *q) {
+    long n = atomic_load_explicit(&q->popped, memory_order_relaxed);
+    int spins = 0;
+    while (atomic_load_explicit(&q->pushed, memory_order_acquire) == n) {
+        if (++spins > PIPELINE_SPINS) {
+            sched_yield();
+        }
+    }
+    int m = q->slots[n % q->capacity];
+    atomic_store_explicit(&q->popped, n + 1, memory_order_release);
+    return m;
+}
+
+// a mini-batch is split into micro-batches of micro_rows rows, which go
+// through the stages one after the other. Batches [0] are the full
+// mini-batches, [1] the smaller last one of an epoch
+typedef struct {
+    Network *net;
+    const Matrix *X;
+    const Matrix *Y;
+    int n_stages;
+    int *first;
+    int batch;
+    int steps_per_epoch;
+    long n_steps;
+    int *indices;
+    // the gathered mini-batch, stage 0 loads it once the last one is done,
+    // the smaller last one of an epoch into the first rows
+    Matrix *input;
+    Matrix *target;
+    Matrix *tail_input;
+    Matrix *tail_target;
+    int n_micro[2];
+    BatchBuffers **micro[2];
+    Matrix **micro_input[2];
+    Matrix **micro_target[2];
+    // between stage s and s + 1
+    StageQueue *forward;
+    StageQueue *backward;
+    Vector *target_row;
+    // the stages start at 1 and give up at -1
+    atomic_int go;
+} Pipeline;
+
+typedef struct {
+    Pipeline *p;
+    int stage;
+} PipelineStage;
+
+static int pipeline_step_rows(const Pipeline *p, long step) {
+    int n = matrix_get_n_rows(p->X);
+    int row = (int) (step % p->steps_per_epoch) * p->batch;
+    return row + p->batch <= n ? p->batch : n - row;
+}
+
+static void pipeline_forward(Pipeline *p, int s, int kind, int m) {
+    if (s > 0) {
+        int got = stage_queue_pop(&p->forward[s - 1]);
+        assert(got == m);
+        (void) got;
+    }
+    BatchBuffers *buf = p->micro[kind][m];
+    int first = p->first[s];
+    const Matrix *input = first > 0 ? buf->layers[first - 1].output
+                                    : p->micro_input[kind][m];
+    net_forward_layers(p->net, buf, input, first, p->first[s + 1], true);
+    if (s < p->n_stages - 1) {
+        stage_queue_push(&p->forward[s], m);
+    }
+}
+
+// the last stage adds the loss of the micro-batch to loss. Micro-batch
+// m > 0 adds its gradients to those of the ones before, so the stage
+// ends with the sums over the mini-batch in the order net_train has them
+static void pipeline_backward(Pipeline *p, int s, int kind, int m,
+                              double *loss) {
+    const Network *net = p->net;
+    BatchBuffers *buf = p->micro[kind][m];
+    if (s == p->n_stages - 1) {
+        const Matrix *out = buf->layers[net->n_layers - 1].output;
+        net_batch_loss(net, buf, out, p->micro_target[kind][m],
+                       p->target_row, loss);
+    } else {
+        int got = stage_queue_pop(&p->backward[s]);
+        assert(got == m);
+        (void) got;
+    }
+    for (int i = p->first[s + 1] - 1; i >= p->first[s]; i--) {
+        net_backward_layer(net, buf, p->micro_input[kind][m], i, m > 0);
+    }
+    if (s > 0) {
+        stage_queue_push(&p->backward[s - 1], m);
+    }
+}
+
+static void *pipeline_stage(void *arg) {
+    PipelineStage *ps = arg;
+    Pipeline *p = ps->p;
+    int s = ps->stage;
+    Network *net = p->net;
+    int spins = 0;
+    while (atomic_load(&p->go) == 0) {
+        if (++spins > PIPELINE_SPINS) {
+            sched_yield();
+        }
+    }
+    if (atomic_load(&p->go) < 0) {
+        return NULL;
+    }
+    // the stage's layers are one contiguous slice of each arena
+    size_t offset = 0;
+    size_t n_floats = 0;
+    for (int i = 0; i < p->first[s + 1]; i++) {
+        size_t floats = layer_arena_floats(net->layers[i]);
+        if (i < p->first[s]) {
+            offset += floats;
+        } else {
+            n_floats += floats;
+        }
+    }
+    float *params = matrix_get_row_mut(net->params, 0) + offset;
+    const float *grads = matrix_get_row(net->grads, 0) + offset;
+    double epoch_loss = 0;
+    for (long step = 0; step < p->n_steps; step++) {
+        int rows = pipeline_step_rows(p, step);
+        int kind = rows < p->batch;
+        int n_micro = p->n_micro[kind];
+        if (s == 0) {
+            int row = (int) (step % p->steps_per_epoch) * p->batch;
+            if (row == 0) {
+                net_shuffle(net, p->indices, matrix_get_n_rows(p->X),
+                            step / p->steps_per_epoch);
+            }
+            uint64_t start = trace_begin();
+            matrix_gather_rows(kind ? p->tail_input : p->input, p->X,
+                               &p->indices[row]);
+            matrix_gather_rows(kind ? p->tail_target : p->target, p->Y,
+                               &p->indices[row]);
+            trace_end("load_batch", (int) step, start);
+        }
+        // 1F1B: the forwards that fill the later stages, then one forward
+        // and one backward in turn, then the backwards left
+        int warmup = p->n_stages - s - 1;
+        int forwards = 0;
+        for (; forwards < warmup && forwards < n_micro; forwards++) {
+            pipeline_forward(p, s, kind, forwards);
+        }
+        for (int m = 0; m < n_micro; m++) {
+            if (forwards < n_micro) {
+                pipeline_forward(p, s, kind, forwards++);
+            }
+            pipeline_backward(p, s, kind, m, &epoch_loss);
+        }
+        // the stage's weights step with the mean over the mini-batch once
+        // its micro-batches are through, before it runs the next one
+        uint64_t start = trace_begin();
+        float lr = net->learning_rate / rows;
+        if (n_floats > 0) {
+            float_axpy(params, grads, -lr, (int) n_floats);
+        }
+        for (int i = p->first[s]; i < p->first[s + 1]; i++) {
+            Layer *l = net->layers[i];
+            if (l->mask) {
+                matrix_hadamard(l->weights, l->mask);
+            }
+            if (l->kind == LAYER_EMBEDDING) {
+                embedding_update(l, lr, false);
+            }
+        }
+        trace_end("optimizer_step", s, start);
+        #ifdef VERBOSE
+            if (s == p->n_stages - 1 &&
+                (step + 1) % p->steps_per_epoch == 0) {
+                printf("--------------\n");
+                printf("EPOCH: %ld\n", step / p->steps_per_epoch);
+                printf("Avg Loss: %.2f\n",
+                       epoch_loss / matrix_get_n_rows(p->X));
+            }
+        #endif
+        if ((step + 1) % p->steps_per_epoch == 0) {
+            epoch_loss = 0;
+        }
+    }
+    return NULL;
+}
+
+static void free_pipeline(Pipeline *p) {
+    for (int k = 0; k < 2; k++) {
+        for (int m = 0; m < p->n_micro[k]; m++) {
+            if (p->micro[k] && p->micro[k][m]) {
+                destroy_batch_buffers(p->micro[k][m]);
+            }
+            Matrix *views[] = {p->micro_input[k] ? p->micro_input[k][m]
+                                                 : NULL,
+                               p->micro_target[k] ? p->micro_target[k][m]
+                                                  : NULL};
+            for (int j = 0; j < 2; j++) {
+                if (views[j]) {
+                    destroy_matrix(views[j]);
+                }
+            }
+        }
+        free(p->micro[k]);
+        free(p->micro_input[k]);
+        free(p->micro_target[k]);
+    }
+    for (int s = 0; s < p->n_stages - 1; s++) {
+        if (p->forward) {
+            free(p->forward[s].slots);
+        }
+        if (p->backward) {
+            free(p->backward[s].slots);
+        }
+    }
+    Matrix *batches[] = {p->tail_input, p->tail_target, p->input,
+                         p->target};
+    for (int i = 0; i < 4; i++) {
+        if (batches[i]) {
+            destroy_matrix(batches[i]);
+        }
+    }
+    if (p->target_row) {
+        destroy_vector(p->target_row);
+    }
+    free(p->forward);
+    free(p->backward);
+    free(p->first);
+    free(p->indices);
+}
+
+// the micro-batches of a mini-batch of rows rows, each with its
+// activations and its rows of the gathered batch
+static bool create_pipeline_micro(Pipeline *p, int kind, int rows,
+                                  int micro_rows) {
+    int n_micro = (rows + micro_rows - 1) / micro_rows;
+    p->micro[kind] = calloc(n_micro, sizeof(BatchBuffers *));
+    p->micro_input[kind] = calloc(n_micro, sizeof(Matrix *));
+    p->micro_target[kind] = calloc(n_micro, sizeof(Matrix *));
+    if (p->micro[kind] == NULL || p->micro_input[kind] == NULL ||
+        p->micro_target[kind] == NULL) {
+        return false;
+    }
+    p->n_micro[kind] = n_micro;
+    for (int m = 0; m < n_micro; m++) {
+        int start = m * micro_rows;
+        int n = start + micro_rows <= rows ? micro_rows : rows - start;
+        // the last batch of an epoch runs after the full ones are done,
+        // so its micro-batches reuse their arenas
+        const BatchBuffers *borrow = NULL;
+        if (kind == 1 && m < p->n_micro[0] &&
+            p->micro[0][m]->n_rows >= n) {
+            borrow = p->micro[0][m];
+        }
+        p->micro[kind][m] = create_batch_buffers_in(p->net, n, true, borrow);
+        p->micro_input[kind][m] = matrix_view_rows(p->input, start, n);
+        p->micro_target[kind][m] = matrix_view_rows(p->target, start, n);
+        if (p->micro[kind][m] == NULL || p->micro_input[kind][m] == NULL ||
+            p->micro_target[kind][m] == NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// trains like net_train with the layers split into n_stages groups of
+// about equal cost, each run by its own thread. Every mini-batch is cut
+// into n_micro micro-batches that flow forward through the stages and
+// back in a one-forward-one-backward schedule, each stage sums their
+// gradients and steps its weights once the mini-batch is through, so
+// the weights every micro-batch sees are consistent. The gradients are
+// summed row by row like in net_train, which the result matches bit for
+// bit unless recurrent layers sum over steps first. Those are rejected
+// in deterministic mode. Batch norm, pruning schedules, checkpoints and
+// transports are not supported. Returns 0 or -1 when out of memory or a
+// thread could not be started
+int net_train_pipeline(Network *net, const Matrix *X, const Matrix *Y,
+                       int epochs, int n_stages, int n_micro) {
+    assert(net);
+    assert(X);
+    assert(Y);
+    assert(net->loss);
+    assert(n_stages > 0);
+    assert(n_micro > 0);
+    assert(net->checkpoint_path == NULL);
+    assert(net->transport == NULL);
+    assert(net->prune_sparsity == 0);
+    for (int i = 0; i < net->n_layers; i++) {
+        // batch statistics live in the layer until its backward pass,
+        // by which time later micro-batches have replaced them
+        assert(net->layers[i]->kind != LAYER_BATCHNORM);
+        // their gradients depend on where the micro-batches split
+        assert(!net->deterministic ||
+               net->layers[i]->kind != LAYER_RECURRENT);
+    }
+    int n = matrix_get_n_rows(X);
+    assert(n == matrix_get_n_rows(Y));
+    drop_predict_pool(net);
+    if (net_pack_parameters(net) != 0) {
+        return -1;
+    }
+    if (n_stages > net->n_layers) {
+        n_stages = net->n_layers;
+    }
+    int batch = net->batch_size < n ? net->batch_size : n;
+    if (n_micro > batch) {
+        n_micro = batch;
+    }
+    int micro_rows = (batch + n_micro - 1) / n_micro;
+    Pipeline p = {
+        .net = net,
+        .X = X,
+        .Y = Y,
+        .n_stages = n_stages,
+        .batch = batch,
+        .steps_per_epoch = (n + batch - 1) / batch,
+    };
+    p.n_steps = (long) epochs * p.steps_per_epoch;
+    p.first = malloc(sizeof(int) * (n_stages + 1));
+    p.indices = malloc(sizeof(int) * n);
+    p.input = create_matrix(batch, matrix_get_n_cols(X));
+    p.target = create_matrix(batch, matrix_get_n_cols(Y));
+    p.target_row = create_vector_view(NULL, matrix_get_n_cols(Y), true);
+    p.forward = calloc(n_stages, sizeof(StageQueue));
+    p.backward = calloc(n_stages, sizeof(StageQueue));
+    bool ok = p.first && p.indices && p.input && p.target && p.target_row &&
+              p.forward && p.backward &&
+              partition_stages(net, n_stages, p.first) == 0;
+    ok = ok && create_pipeline_micro(&p, 0, batch, micro_rows);
+    if (ok && n % batch) {
+        p.tail_input = matrix_view_rows(p.input, 0, n % batch);
+        p.tail_target = matrix_view_rows(p.target, 0, n % batch);
+        ok = p.tail_input && p.tail_target &&
+             create_pipeline_micro(&p, 1, n % batch, micro_rows);
+    }
+    // at most one mini-batch is in flight between two stages
+    for (int s = 0; ok && s < n_stages - 1; s++) {
+        StageQueue *queues[] = {&p.forward[s], &p.backward[s]};
+        for (int j = 0; j < 2; j++) {
+            queues[j]->capacity = p.n_micro[0];
+            queues[j]->slots = malloc(sizeof(int) * p.n_micro[0]);
+            atomic_init(&queues[j]->pushed, 0);
+            atomic_init(&queues[j]->popped, 0);
+            ok = ok && queues[j]->slots;
+        }
+    }
+    PipelineStage *stages = malloc(sizeof(PipelineStage) * n_stages);
+    pthread_t *threads = malloc(sizeof(pthread_t) * n_stages);
+    if (!ok || stages == NULL || threads == NULL) {
+        free(stages);
+        free(threads);
+        free_pipeline(&p);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        p.indices[i] = i;
+    }
+    atomic_init(&p.go, 0);
+    // every stage needs its own thread, the calling one runs stage 0
+    int started = 1;
+    for (; started < n_stages; started++) {
+        stages[started] = (PipelineStage) {.p = &p, .stage = started};
+        if (pthread_create(&threads[started], NULL, pipeline_stage,
+                           &stages[started]) != 0) {
+            break;
+        }
+    }
+    bool failed = started < n_stages;
+    atomic_store(&p.go, failed ? -1 : 1);
+    if (!failed) {
+        stages[0] = (PipelineStage) {.p = &p, .stage = 0};
+        pipeline_stage(&stages[0]);
+    }
+    for (int s = 1; s < started; s++) {
+        pthread_join(threads[s], NULL);
+    }
+    free(stages);
+    free(threads);
+    free_pipeline(&p);
+    return failed ? -1 : 0;
+}
+
+// averages the gradients with the other ranks of t every training step.
+// The replicas must start from the same parameters and take the same
+// number of steps. t stays the caller's, NULL trains alone again
+void net_set_transport(Network *net, Transport *t) {
+    assert(net);
+    net->transport = t;
+}
+
+typedef struct {
+    Network *net;
+    const Matrix *X;
+    const Matrix *Y;
+    int epochs;
+    const char *group;
+    // the first worker leaves its snapshot here, after its size
+    char *result;
+    size_t result_capacity;
+} ParallelTraining;
+
+// pruning may still add a mask to every dense and convolution layer
+static size_t snapshot_bound(const Network *net, const TrainPosition *pos) {
+    size_t size = net_snapshot(net, pos, NULL);
+    for (int i = 0; i < net->n_layers; i++) {
+        const Layer *l = net->layers[i];
+        if ((l->kind == LAYER_DENSE || l->kind == LAYER_CONV2D) &&
+            l->mask == NULL) {
+            size += sizeof(float) * matrix_get_n_rows(l->weights) *
+                    matrix_get_n_cols(l->weights);
+        }
+    }
+    return size;
+}
+
+// runs in a forked process on its own copy of the network. All ranks
+// draw the same permutation of the rows and take consecutive slices of
+// it, so sorted data is spread evenly. The generator state is put back
+// afterwards: every rank shuffles its shard with the same state and the
+// first one's checkpoints resume all of them
+static int train_worker(int rank, void *ctx) {
+    ParallelTraining *p = ctx;
+    Network *net = p->net;
+    Transport *t = create_shm_transport(p->group, rank);
+    if (t == NULL) {
+        return -1;
+    }
+    int n = matrix_get_n_rows(p->X);
+    int shard = n / t->n_ranks;
+    int *rows = malloc(sizeof(int) * n);
+    Matrix *X = create_matrix(shard, matrix_get_n_cols(p->X));
+    Matrix *Y = create_matrix(shard, matrix_get_n_cols(p->Y));
+    if (rows == NULL || X == NULL || Y == NULL) {
+        free(rows);
+        if (X) {
+            destroy_matrix(X);
+        }
+        if (Y) {
+            destroy_matrix(Y);
+        }
+        destroy_transport(t);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        rows[i] = i;
+    }
+    uint64_t state = rand_get_state();
+    net_shuffle(net, rows, n, -1);
+    rand_set_state(state);
+    matrix_gather_rows(X, p->X, &rows[rank * shard]);
+    matrix_gather_rows(Y, p->Y, &rows[rank * shard]);
+    if (rank != 0) {
+        free(net->checkpoint_path);
+        net->checkpoint_path = NULL;
+    }
+    net_set_transport(net, t);
+    int rc = net_train(net, X, Y, p->epochs);
+    net_set_transport(net, NULL);
+    if (rc == 0 && rank == 0) {
+        int none = 0;
+        TrainPosition pos = {.epoch = p->epochs, .indices = &none};
+        size_t size = net_snapshot(net, &pos, NULL);
+        // a snapshot snapshot_bound did not foresee fails the worker
+        // rather than writing past the shared buffer
+        if (sizeof(size_t) + size > p->result_capacity) {
+            rc = -1;
+        } else {
+            memcpy(p->result, &size, sizeof(size_t));
+            net_snapshot(net, &pos, p->result + sizeof(size_t));
+        }
+    }
+    free(rows);
+    destroy_matrix(X);
+    destroy_matrix(Y);
+    destroy_transport(t);
+    return rc;
+}
+
+// data parallel net_train on one host: n_workers forked copies of net
+// train in step on random shards of X and Y and average their
+// gradients over shared memory every step, so the effective batch is
+// n_workers times the batch size. The n % n_workers rows that do not
+// fill a shard are left out. Batch norm statistics stay per worker. The
+// first worker's parameters, statistics and masks end up in net. Returns
+// 0, or -1 when a worker failed or the shared memory could not be set up
+int net_train_parallel(Network *net, const Matrix *X, const Matrix *Y,
+                       int epochs, int n_workers) {
+    assert(net);
+    assert(X);
+    assert(Y);
+    assert(n_workers > 0);
+    assert(matrix_get_n_rows(X) == matrix_get_n_rows(Y));
+    assert(matrix_get_n_rows(X) >= n_workers);
+    // before the fork, the children would not have the threads
+    drop_predict_pool(net);
+    if (net_pack_parameters(net) != 0) {
+        return -1;
+    }
+    // embedding gradient tables are summed in one call each as well
+    int max_floats = matrix_get_n_cols(net->grads);
+    for (int i = 0; i < net->n_layers; i++) {
+        const Layer *l = net->layers[i];
+        if (l->kind == LAYER_EMBEDDING &&
+            embedding_table_floats(l) > max_floats) {
+            max_floats = embedding_table_floats(l);
+        }
+    }
+    ShmGroup *g = create_shm_group(NULL, n_workers, max_floats);
+    if (g == NULL) {
+        return -1;
+    }
+    int none = 0;
+    TrainPosition pos = {.epoch = epochs, .indices = &none};
+    size_t capacity = sizeof(size_t) + snapshot_bound(net, &pos);
+    char *result = create_shared_buffer(capacity);
+    if (result == NULL) {
+        destroy_shm_group(g);
+        return -1;
+    }
+    ParallelTraining p = {
+        .net = net,
+        .X = X,
+        .Y = Y,
+        .epochs = epochs,
+        .group = shm_group_get_name(g),
+        .result = result,
+        .result_capacity = capacity,
+    };
+    int rc = run_workers(n_workers, train_worker, &p);
+    if (rc == 0) {
+        size_t size;
+        memcpy(&size, result, sizeof(size_t));
+        rc = net_restore(net, result + sizeof(size_t), size, false);
+    }
+    destroy_shared_buffer(result, capacity);
+    destroy_shm_group(g);
+    return rc;
+}
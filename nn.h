@@ -1,16 +1,62 @@
 #ifndef _NN_HEADER_
 #define _NN_HEADER_
 
+#include <stdint.h>
+
 #include "vector.h"
 #include "matrix.h"
 #include "loss.h"
 #include "activation.h"
+#include "allreduce.h"
+#include "rnn.h"
 
 typedef struct layer Layer;
 typedef struct network Network;
+typedef struct inference_server InferenceServer;
+typedef struct inference_request InferenceRequest;
+
+typedef struct evaluation {
+    float loss;
+    float accuracy;
+    float top_k_accuracy;
+    int top_k;
+    int n_classes;
+    int n_samples;
+    // n_classes x n_classes counts, row = target class, col = predicted class
+    int *confusion;
+} Evaluation;
+
+// activation memory of one block of rows pushed through the network
+typedef struct memory_plan {
+    int n_rows;
+    bool training;
+    // activation buffers of all layers and the slots they share
+    int n_buffers;
+    int n_slots;
+    // with the shared slots and with a slot for every buffer, workspace
+    // that is never shared included in both
+    size_t planned_bytes;
+    size_t unshared_bytes;
+} MemoryPlan;
 
 Layer *create_layer(int n_input, int n_output);
 
+Layer *create_conv_layer(int channels, int height, int width, int n_filters,
+                         int kernel, int stride, int padding);
+
+Layer *create_max_pool_layer(int channels, int height, int width, int size,
+                             int stride);
+
+Layer *create_avg_pool_layer(int channels, int height, int width, int size,
+                             int stride);
+
+Layer *create_batchnorm_layer(int n);
+
+Layer *create_recurrent_layer(CellKind cell, int seq_len, int n_input,
+                              int n_hidden, bool return_sequences);
+
+Layer *create_embedding_layer(int n_fields, int n_categories, int dim);
+
 void destroy_layer(Layer *l);
 
 Network *create_network(int n_layers, float lr);
@@ -35,20 +81,95 @@ void layer_initialize_bias(const Layer *l);
 
 void layer_initialize(const Layer *l, float (*const method) (int, int));
 
+void net_set_batch_size(Network *net, int batch_size);
+
+void net_set_deterministic(Network *net, bool on, uint64_t seed);
+
 void net_set_layer(Network *net, Layer *l, int index);
 
-void net_predict(const Network *net, const Vector *input, Vector *output);
+int net_pack_parameters(Network *net);
+
+float *net_get_parameters(Network *net, int *n_floats);
+
+float *net_get_gradients(Network *net, int *n_floats);
+
+// inference only networks keep no per-layer activations; the first
+// net_backpropagation gives every layer its own output and cache
+int net_predict(const Network *net, const Vector *input, Vector *output);
+
+// the threads copy the weights of the wide layers. Training, pruning and
+// loading a network stop them; net_backpropagation, layer_set_weights,
+// layer_initialize_weights and layer_prune must not run while they are up
+int net_set_predict_threads(Network *net, int n_threads);
 
 float net_forward_loss(const Network *net, const Vector *prediciton,
                         const Vector *target);
 
-void net_backpropagation(const Network *net, const Vector *prediciton,
-                         const Vector *target);
+int net_backpropagation(const Network *net, const Vector *prediciton,
+                        const Vector *target);
 
-void net_predict_batch(const Network *net, const Matrix *X, Matrix *Y_hat);
+int net_predict_batch(const Network *net, const Matrix *X, Matrix *Y_hat);
 
 float net_loss_batch(const Network *net, const Matrix *Y_hat, const Matrix *Y);
 
-void net_train(const Network *net, const Matrix *X, const Matrix *Y,
-               int epochs);
+Evaluation *net_evaluate(const Network *net, const Matrix *X, const Matrix *Y,
+                         int top_k, int n_threads);
+
+void destroy_evaluation(Evaluation *eval);
+
+void evaluation_print(const Evaluation *eval);
+
+int net_plan_memory(const Network *net, int n_rows, bool training,
+                    MemoryPlan *plan);
+
+void memory_plan_print(const MemoryPlan *plan);
+
+InferenceServer *create_inference_server(const Network *net, int max_batch,
+                                         int max_wait_us);
+
+void destroy_inference_server(InferenceServer *s);
+
+InferenceRequest *inference_server_submit(InferenceServer *s,
+                                          const Vector *input,
+                                          Vector *output);
+
+int inference_server_submit_callback(InferenceServer *s, const Vector *input,
+                                     Vector *output,
+                                     void (*callback)(Vector *, void *),
+                                     void *ctx);
+
+void inference_request_wait(InferenceServer *s, InferenceRequest *r);
+
+int net_fold_batchnorm(Network *net);
+
+int layer_prune(Layer *l, float sparsity);
+
+float layer_get_sparsity(const Layer *l);
+
+int net_prune(Network *net, float sparsity);
+
+void net_set_pruning(Network *net, float final_sparsity, int start_epoch,
+                     int end_epoch);
+
+int net_sparsify(Network *net, float min_sparsity);
+
+int net_autotune(Network *net, const char *cache_path);
+
+int net_set_checkpoint(Network *net, const char *path, int every_steps);
+
+int net_load_checkpoint(Network *net, const char *path);
+
+int net_train(Network *net, const Matrix *X, const Matrix *Y,
+              int epochs);
+
+int net_train_many(Network **nets, int n_nets, const Matrix *X,
+                   const Matrix *Y, int epochs, int n_threads);
+
+int net_train_pipeline(Network *net, const Matrix *X, const Matrix *Y,
+                       int epochs, int n_stages, int n_micro);
+
+void net_set_transport(Network *net, Transport *t);
+
+int net_train_parallel(Network *net, const Matrix *X, const Matrix *Y,
+                       int epochs, int n_workers);
 #endif
\ No newline at end of file
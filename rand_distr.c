@@ -1,23 +1,54 @@
 #include <math.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h> 
 
 #include "rand_distr.h"
 
+// xorshift64* state, kept here instead of in libc so that checkpoints can
+// save and restore it exactly
+static uint64_t rng_state = 0x853c49e6748fea9bULL;
+
+// the state must never be zero, so zero seeds map to the default state
+void rand_seed(uint64_t seed) {
+    rng_state = seed ? seed : 0x853c49e6748fea9bULL;
+}
+
+uint64_t rand_get_state(void) {
+    return rng_state;
+}
+
+void rand_set_state(uint64_t state) {
+    assert(state != 0);
+    rng_state = state;
+}
+
+static uint32_t rand_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t) ((rng_state * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+// uniform in [0, 1) with the 24 bits a float can hold
+static float rand_unit(void) {
+    return (rand_next() >> 8) * (1.0f / 16777216.0f);
+}
+
 int rand_int(int a, int b) {
     assert(a <= b);
-    return a + rand() % (b - a + 1);
+    return a + (int) (rand_next() % (uint32_t) (b - a + 1));
 }
 
 float rand_uniform(float left, float right) {
     assert(left <= right);
-    float uniform_number = rand();
-    return (right - left) * (uniform_number / (float) RAND_MAX) + left;
+    return (right - left) * rand_unit() + left;
 }
 
 float rand_normal(float mean, float std) {
-    float u1 = rand() / (float) RAND_MAX;
-    float u2 = rand() / (float) RAND_MAX;
+    // 1 - u keeps log away from zero
+    float u1 = 1.0f - rand_unit();
+    float u2 = rand_unit();
     float z0 = sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
     return z0 * std + mean;
 }
@@ -51,4 +82,27 @@ void shuffle(int *data, int n) {
         data[i] = data[idx];
         data[idx] = temp;
     }
-}
\ No newline at end of file
+}
+// splitmix64 of key and counter, a stateless stream: number counter of
+// stream key is the same whichever thread draws it and in whatever order
+uint64_t rand_hash(uint64_t key, uint64_t counter) {
+    uint64_t z = key + (counter + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// fills data with a permutation of 0..n-1 that depends on key alone, draw
+// i of the shuffle is number i of stream key
+void shuffle_keyed(int *data, int n, uint64_t key) {
+    assert(data);
+    for (int i = 0; i < n; i++) {
+        data[i] = i;
+    }
+    for (int i = 0; i < n; i++) {
+        int idx = i + (int) (rand_hash(key, i) % (uint64_t) (n - i));
+        int temp = data[i];
+        data[i] = data[idx];
+        data[idx] = temp;
+    }
+}
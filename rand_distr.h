@@ -1,6 +1,14 @@
 #ifndef _RAND_DISTR_
 #define _RAND_DISTR_
 
+#include <stdint.h>
+
+void rand_seed(uint64_t seed);
+
+uint64_t rand_get_state(void);
+
+void rand_set_state(uint64_t state);
+
 int rand_int(int a, int b);
 
 float rand_uniform(float left, float right);
@@ -17,4 +25,8 @@ float normal_he(int n_input, int n_output);
 
 void shuffle(int *data, int n);
 
+uint64_t rand_hash(uint64_t key, uint64_t counter);
+
+void shuffle_keyed(int *data, int n, uint64_t key);
+
 #endif
\ No newline at end of file
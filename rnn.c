@@ -0,0 +1,165 @@
+#include <assert.h>
+#include <math.h>
+
+#include "rnn.h"
+
+RnnShape make_rnn_shape(CellKind cell, int seq_len, int n_input,
+                        int n_hidden, bool return_sequences) {
+    assert(seq_len > 0);
+    assert(n_input > 0);
+    assert(n_hidden > 0);
+    RnnShape s = {
+        .cell = cell,
+        .seq_len = seq_len,
+        .n_input = n_input,
+        .n_hidden = n_hidden,
+        .return_sequences = return_sequences,
+    };
+    return s;
+}
+
+// gate blocks of n_hidden rows in the weights: h for a plain RNN, update,
+// reset and candidate for a GRU, input, forget, cell and output for LSTM
+int rnn_shape_get_n_gates(const RnnShape *s) {
+    assert(s);
+    switch (s->cell) {
+    case CELL_RNN:
+        return 1;
+    case CELL_GRU:
+        return 3;
+    case CELL_LSTM:
+        return 4;
+    }
+    return 0;
+}
+
+int rnn_shape_get_n_input(const RnnShape *s) {
+    assert(s);
+    return s->seq_len * s->n_input;
+}
+
+int rnn_shape_get_n_output(const RnnShape *s) {
+    assert(s);
+    return s->return_sequences ? s->seq_len * s->n_hidden : s->n_hidden;
+}
+
+static float sigmoid(float x) {
+    return 1.0f / (1.0f + expf(-x));
+}
+
+// one step of one row. gates holds the input projections plus bias and
+// is overwritten with the activated gates, gates_h the projections of
+// h_prev. c is the LSTM cell state, a GRU keeps its candidate's recurrent
+// term there for the backward pass, a plain RNN does not use it
+void rnn_cell_forward(const RnnShape *s, float *gates, const float *gates_h,
+                      const float *h_prev, float *h, const float *c_prev,
+                      float *c) {
+    assert(s);
+    assert(gates);
+    assert(gates_h);
+    assert(h_prev);
+    assert(h);
+    int n = s->n_hidden;
+    switch (s->cell) {
+    case CELL_RNN:
+        for (int j = 0; j < n; j++) {
+            gates[j] = tanhf(gates[j] + gates_h[j]);
+            h[j] = gates[j];
+        }
+        break;
+    case CELL_GRU: {
+        float *z = gates;
+        float *r = gates + n;
+        float *cand = gates + 2 * n;
+        for (int j = 0; j < n; j++) {
+            z[j] = sigmoid(z[j] + gates_h[j]);
+            r[j] = sigmoid(r[j] + gates_h[n + j]);
+            c[j] = gates_h[2 * n + j];
+            cand[j] = tanhf(cand[j] + r[j] * c[j]);
+            h[j] = (1 - z[j]) * cand[j] + z[j] * h_prev[j];
+        }
+        break;
+    }
+    case CELL_LSTM: {
+        float *in = gates;
+        float *forget = gates + n;
+        float *cand = gates + 2 * n;
+        float *out = gates + 3 * n;
+        for (int j = 0; j < n; j++) {
+            in[j] = sigmoid(in[j] + gates_h[j]);
+            forget[j] = sigmoid(forget[j] + gates_h[n + j]);
+            cand[j] = tanhf(cand[j] + gates_h[2 * n + j]);
+            out[j] = sigmoid(out[j] + gates_h[3 * n + j]);
+            c[j] = forget[j] * c_prev[j] + in[j] * cand[j];
+            h[j] = out[j] * tanhf(c[j]);
+        }
+        break;
+    }
+    }
+}
+
+// takes the gradient of the loss with respect to h in d_h and that of the
+// next step's cell state in d_c. Writes the gradients of the gate inputs
+// (d_gates) and of their recurrent projections (d_gates_h), leaves in d_h
+// the part of the gradient of h_prev that does not go through the
+// recurrent weights and in d_c that of c_prev
+void rnn_cell_backward(const RnnShape *s, float *d_gates, float *d_gates_h,
+                       float *d_h, float *d_c, const float *gates,
+                       const float *h_prev, const float *c_prev,
+                       const float *c) {
+    assert(s);
+    assert(d_gates);
+    assert(d_gates_h);
+    assert(d_h);
+    assert(gates);
+    int n = s->n_hidden;
+    switch (s->cell) {
+    case CELL_RNN:
+        for (int j = 0; j < n; j++) {
+            d_gates[j] = d_h[j] * (1 - gates[j] * gates[j]);
+            d_gates_h[j] = d_gates[j];
+            d_h[j] = 0;
+        }
+        break;
+    case CELL_GRU: {
+        const float *z = gates;
+        const float *r = gates + n;
+        const float *cand = gates + 2 * n;
+        for (int j = 0; j < n; j++) {
+            float d_cand = d_h[j] * (1 - z[j]) * (1 - cand[j] * cand[j]);
+            float d_z = d_h[j] * (h_prev[j] - cand[j]) * z[j] * (1 - z[j]);
+            float d_r = d_cand * c[j] * r[j] * (1 - r[j]);
+            d_gates[j] = d_z;
+            d_gates[n + j] = d_r;
+            d_gates[2 * n + j] = d_cand;
+            d_gates_h[j] = d_z;
+            d_gates_h[n + j] = d_r;
+            d_gates_h[2 * n + j] = d_cand * r[j];
+            d_h[j] *= z[j];
+        }
+        break;
+    }
+    case CELL_LSTM: {
+        const float *in = gates;
+        const float *forget = gates + n;
+        const float *cand = gates + 2 * n;
+        const float *out = gates + 3 * n;
+        for (int j = 0; j < n; j++) {
+            float tanh_c = tanhf(c[j]);
+            float d_cell = d_c[j] +
+                           d_h[j] * out[j] * (1 - tanh_c * tanh_c);
+            d_gates[j] = d_cell * cand[j] * in[j] * (1 - in[j]);
+            d_gates[n + j] = d_cell * c_prev[j] * forget[j] *
+                             (1 - forget[j]);
+            d_gates[2 * n + j] = d_cell * in[j] * (1 - cand[j] * cand[j]);
+            d_gates[3 * n + j] = d_h[j] * tanh_c * out[j] * (1 - out[j]);
+            for (int g = 0; g < 4; g++) {
+                d_gates_h[g * n + j] = d_gates[g * n + j];
+            }
+            d_c[j] = d_cell * forget[j];
+            d_h[j] = 0;
+        }
+        break;
+    }
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef _RNN_HEADER_
+#define _RNN_HEADER_
+
+#include <stdbool.h>
+
+typedef enum {
+    CELL_RNN,
+    CELL_GRU,
+    CELL_LSTM,
+} CellKind;
+
+// Sequences are flattened step by step: element (t, i) of a sequence of
+// seq_len steps of n_input features lives at t * n_input + i, and so do
+// the hidden states of all steps when return_sequences is set.
+typedef struct rnn_shape {
+    CellKind cell;
+    int seq_len;
+    int n_input;
+    int n_hidden;
+    bool return_sequences;
+} RnnShape;
+
+RnnShape make_rnn_shape(CellKind cell, int seq_len, int n_input,
+                        int n_hidden, bool return_sequences);
+
+int rnn_shape_get_n_gates(const RnnShape *s);
+
+int rnn_shape_get_n_input(const RnnShape *s);
+
+int rnn_shape_get_n_output(const RnnShape *s);
+
+void rnn_cell_forward(const RnnShape *s, float *gates, const float *gates_h,
+                      const float *h_prev, float *h, const float *c_prev,
+                      float *c);
+
+void rnn_cell_backward(const RnnShape *s, float *d_gates, float *d_gates_h,
+                       float *d_h, float *d_c, const float *gates,
+                       const float *h_prev, const float *c_prev,
+                       const float *c);
+
+#endif
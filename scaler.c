@@ -0,0 +1,156 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "scaler.h"
+#include "simd_neon.h"
+
+typedef struct scaler {
+    ScaleKind kind;
+    int n;
+    float *offsets;
+    float *scales;
+} Scaler;
+
+static const char *const KIND_NAMES[] = {
+    [SCALE_STANDARD] = "standard",
+    [SCALE_MIN_MAX] = "minmax",
+};
+
+Scaler *create_scaler(ScaleKind kind, const float *offsets,
+                      const float *scales, int n) {
+    assert(offsets);
+    assert(scales);
+    assert(n > 0);
+    Scaler *s = malloc(sizeof(Scaler));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->kind = kind;
+    s->n = n;
+    s->offsets = malloc(sizeof(float) * n);
+    s->scales = malloc(sizeof(float) * n);
+    if (s->offsets == NULL || s->scales == NULL) {
+        destroy_scaler(s);
+        return NULL;
+    }
+    memcpy(s->offsets, offsets, sizeof(float) * n);
+    memcpy(s->scales, scales, sizeof(float) * n);
+    return s;
+}
+
+void destroy_scaler(Scaler *s) {
+    assert(s);
+    free(s->offsets);
+    free(s->scales);
+    free(s);
+}
+
+int scaler_get_n(const Scaler *s) {
+    assert(s);
+    return s->n;
+}
+
+ScaleKind scaler_get_kind(const Scaler *s) {
+    assert(s);
+    return s->kind;
+}
+
+float scaler_get_offset(const Scaler *s, int i) {
+    assert(s);
+    assert(i >= 0 && i < s->n);
+    return s->offsets[i];
+}
+
+float scaler_get_scale(const Scaler *s, int i) {
+    assert(s);
+    assert(i >= 0 && i < s->n);
+    return s->scales[i];
+}
+
+void scaler_apply(const Scaler *s, Vector *v) {
+    assert(s);
+    assert(v);
+    assert(vector_get_n(v) == s->n);
+    float *data = vector_get_data_mut(v);
+    float_sub(data, data, s->offsets, s->n);
+    float_mul(data, data, s->scales, s->n);
+}
+
+// scales every row of m, one feature per column. Subtracting first keeps
+// features far from zero exact, and matches csv_as_matrix_scaled bit for
+// bit
+void scaler_apply_matrix(const Scaler *s, Matrix *m) {
+    assert(s);
+    assert(m);
+    assert(matrix_get_n_cols(m) == s->n);
+    for (int i = 0; i < matrix_get_n_rows(m); i++) {
+        float *row = matrix_get_row_mut(m, i);
+        float_sub(row, row, s->offsets, s->n);
+        float_mul(row, row, s->scales, s->n);
+    }
+}
+
+// a "kind n" line and one "offset scale" line per feature, written to a
+// temporary file renamed over path. Returns 0 or -1
+int scaler_save(const Scaler *s, const char *path) {
+    assert(s);
+    assert(path);
+    size_t len = strlen(path) + sizeof(".tmp");
+    char *tmp_path = malloc(len);
+    if (tmp_path == NULL) {
+        return -1;
+    }
+    snprintf(tmp_path, len, "%s.tmp", path);
+    FILE *f = fopen(tmp_path, "w");
+    if (f == NULL) {
+        free(tmp_path);
+        return -1;
+    }
+    fprintf(f, "%s %d\n", KIND_NAMES[s->kind], s->n);
+    for (int i = 0; i < s->n; i++) {
+        // 9 significant digits read back as the same float
+        fprintf(f, "%.9g %.9g\n", s->offsets[i], s->scales[i]);
+    }
+    int rc = 0;
+    if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        rc = -1;
+    }
+    free(tmp_path);
+    return rc;
+}
+
+// NULL when path cannot be read or is not a saved scaler
+Scaler *load_scaler(const char *path) {
+    assert(path);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return NULL;
+    }
+    char kind_name[16];
+    int n = 0;
+    if (fscanf(f, "%15s %d", kind_name, &n) != 2 || n <= 0) {
+        fclose(f);
+        return NULL;
+    }
+    int kind = 0;
+    while (kind <= SCALE_MIN_MAX && strcmp(kind_name, KIND_NAMES[kind]) != 0) {
+        kind++;
+    }
+    float *offsets = malloc(sizeof(float) * n);
+    float *scales = malloc(sizeof(float) * n);
+    bool ok = kind <= SCALE_MIN_MAX && offsets && scales;
+    for (int i = 0; ok && i < n; i++) {
+        ok = fscanf(f, "%f %f", &offsets[i], &scales[i]) == 2;
+    }
+    fclose(f);
+    Scaler *s = ok ? create_scaler((ScaleKind) kind, offsets, scales, n)
+                   : NULL;
+    free(offsets);
+    free(scales);
+    return s;
+}
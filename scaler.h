@@ -0,0 +1,39 @@
+#ifndef _SCALER_HEADER_
+#define _SCALER_HEADER_
+
+#include "vector.h"
+#include "matrix.h"
+
+typedef enum {
+    // (x - mean) / standard deviation
+    SCALE_STANDARD,
+    // (x - min) / (max - min)
+    SCALE_MIN_MAX,
+} ScaleKind;
+
+// A fitted per-feature transform x' = (x - offset) * scale, kept so that
+// inputs at predict time are scaled the way the training data was.
+typedef struct scaler Scaler;
+
+Scaler *create_scaler(ScaleKind kind, const float *offsets,
+                      const float *scales, int n);
+
+void destroy_scaler(Scaler *s);
+
+int scaler_get_n(const Scaler *s);
+
+ScaleKind scaler_get_kind(const Scaler *s);
+
+float scaler_get_offset(const Scaler *s, int i);
+
+float scaler_get_scale(const Scaler *s, int i);
+
+void scaler_apply(const Scaler *s, Vector *v);
+
+void scaler_apply_matrix(const Scaler *s, Matrix *m);
+
+int scaler_save(const Scaler *s, const char *path);
+
+Scaler *load_scaler(const char *path);
+
+#endif
@@ -8,7 +8,7 @@ void float_add(float* output, const float* input1, const float* input2,
     assert(output);
     assert(input1);
     assert(input2);
-    for (int i = 0; i < len; i += 4) {
+    for (int i = 0; i + 4 <= len; i += 4) {
         float32x4_t v1 = vld1q_f32(&input1[i]);
         float32x4_t v2 = vld1q_f32(&input2[i]);
         float32x4_t res = vaddq_f32(v1, v2);
@@ -19,12 +19,28 @@ void float_add(float* output, const float* input1, const float* input2,
     }
 }
 
+void float_sub(float* output, const float* input1, const float* input2,
+               int len) {
+    assert(output);
+    assert(input1);
+    assert(input2);
+    for (int i = 0; i + 4 <= len; i += 4) {
+        float32x4_t v1 = vld1q_f32(&input1[i]);
+        float32x4_t v2 = vld1q_f32(&input2[i]);
+        float32x4_t res = vsubq_f32(v1, v2);
+        vst1q_f32(&output[i], res);
+    }
+    for (int i = len - (len % 4); i < len; i++) {
+        output[i] = input1[i] - input2[i];
+    }
+}
+
 void float_mul(float* output, const float* input1, const float* input2,
     int len) {
     assert(output);
     assert(input1);
     assert(input2);
-    for (int i = 0; i < len; i += 4) {
+    for (int i = 0; i + 4 <= len; i += 4) {
         float32x4_t v1 = vld1q_f32(&input1[i]);
         float32x4_t v2 = vld1q_f32(&input2[i]);
         float32x4_t res = vmulq_f32(v1, v2);
@@ -38,19 +54,261 @@ void float_mul(float* output, const float* input1, const float* input2,
 float float_dot(const float *input1, const float *input2, int len) {
     assert(input1);
     assert(input2);
-    float32x4_t total = vdupq_n_f32(0.0f);
+    // two accumulators so consecutive FMAs do not wait on each other
+    float32x4_t total0 = vdupq_n_f32(0.0f);
+    float32x4_t total1 = vdupq_n_f32(0.0f);
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+        total0 = vfmaq_f32(total0, vld1q_f32(&input1[i]),
+                           vld1q_f32(&input2[i]));
+        total1 = vfmaq_f32(total1, vld1q_f32(&input1[i + 4]),
+                           vld1q_f32(&input2[i + 4]));
+    }
+    if (i + 4 <= len) {
+        total0 = vfmaq_f32(total0, vld1q_f32(&input1[i]),
+                           vld1q_f32(&input2[i]));
+        i += 4;
+    }
+    // the tail is one zero padded step into the accumulator a whole step
+    // would have gone to, so a row sums to the same bits with or without
+    // its zero padding, and in the order float_gemv sums it
+    if (i < len) {
+        float tail1[4] = {0};
+        float tail2[4] = {0};
+        for (int j = i; j < len; j++) {
+            tail1[j - i] = input1[j];
+            tail2[j - i] = input2[j];
+        }
+        if (i % 8 == 0) {
+            total0 = vfmaq_f32(total0, vld1q_f32(tail1), vld1q_f32(tail2));
+        } else {
+            total1 = vfmaq_f32(total1, vld1q_f32(tail1), vld1q_f32(tail2));
+        }
+    }
+    return vaddvq_f32(vaddq_f32(total0, total1));
+}
 
-    for (int i = 0; i < len; i += 4) {
-        float32x4_t v1 = vld1q_f32(&input1[i]);
-        float32x4_t v2 = vld1q_f32(&input2[i]);
-        float32x4_t res = vmulq_f32(v1, v2);
-        total = vmlaq_f32(total, v1, v2);
+// rows of the GEMV kernel sharing every load of the input vector
+#define GEMV_ROWS 4
+// floats ahead of the current column to prefetch in each weight row
+#define GEMV_PREFETCH 64
+
+// output[r] = dot(rows + r * stride, input) for r < n_rows. Each row must
+// be readable and zero up to len rounded to 4, input is read only up to
+// len, so the tail is one vector step against a zero filled copy
+void float_gemv(float *output, const float *rows, int stride,
+                int n_rows, const float *input, int len) {
+    assert(output);
+    assert(rows);
+    assert(input);
+    int body = len - len % 4;
+    float tail[4] = {0};
+    for (int i = body; i < len; i++) {
+        tail[i - body] = input[i];
     }
-    float output[4] = {0};
-    vst1q_f32(output, total);
-    float result = output[0] + output[1] + output[2] + output[3];
-    for (int i = len - (len % 4); i < len; i++) {
-        result += input1[i] * input2[i];
+    float32x4_t x_tail = vld1q_f32(tail);
+
+    int r = 0;
+    for (; r + GEMV_ROWS <= n_rows; r += GEMV_ROWS) {
+        const float *w0 = &rows[r * stride];
+        const float *w1 = w0 + stride;
+        const float *w2 = w1 + stride;
+        const float *w3 = w2 + stride;
+        float32x4_t a0 = vdupq_n_f32(0.0f), b0 = vdupq_n_f32(0.0f);
+        float32x4_t a1 = vdupq_n_f32(0.0f), b1 = vdupq_n_f32(0.0f);
+        float32x4_t a2 = vdupq_n_f32(0.0f), b2 = vdupq_n_f32(0.0f);
+        float32x4_t a3 = vdupq_n_f32(0.0f), b3 = vdupq_n_f32(0.0f);
+        int i = 0;
+        for (; i + 8 <= body; i += 8) {
+            __builtin_prefetch(&w0[i + GEMV_PREFETCH]);
+            __builtin_prefetch(&w1[i + GEMV_PREFETCH]);
+            __builtin_prefetch(&w2[i + GEMV_PREFETCH]);
+            __builtin_prefetch(&w3[i + GEMV_PREFETCH]);
+            float32x4_t x0 = vld1q_f32(&input[i]);
+            float32x4_t x1 = vld1q_f32(&input[i + 4]);
+            a0 = vfmaq_f32(a0, vld1q_f32(&w0[i]), x0);
+            a1 = vfmaq_f32(a1, vld1q_f32(&w1[i]), x0);
+            a2 = vfmaq_f32(a2, vld1q_f32(&w2[i]), x0);
+            a3 = vfmaq_f32(a3, vld1q_f32(&w3[i]), x0);
+            b0 = vfmaq_f32(b0, vld1q_f32(&w0[i + 4]), x1);
+            b1 = vfmaq_f32(b1, vld1q_f32(&w1[i + 4]), x1);
+            b2 = vfmaq_f32(b2, vld1q_f32(&w2[i + 4]), x1);
+            b3 = vfmaq_f32(b3, vld1q_f32(&w3[i + 4]), x1);
+        }
+        if (i < body) {
+            float32x4_t x0 = vld1q_f32(&input[i]);
+            a0 = vfmaq_f32(a0, vld1q_f32(&w0[i]), x0);
+            a1 = vfmaq_f32(a1, vld1q_f32(&w1[i]), x0);
+            a2 = vfmaq_f32(a2, vld1q_f32(&w2[i]), x0);
+            a3 = vfmaq_f32(a3, vld1q_f32(&w3[i]), x0);
+            i += 4;
+        }
+        // like float_dot, the tail continues the alternation of a and b
+        if (i < len && i % 8 == 0) {
+            a0 = vfmaq_f32(a0, vld1q_f32(&w0[i]), x_tail);
+            a1 = vfmaq_f32(a1, vld1q_f32(&w1[i]), x_tail);
+            a2 = vfmaq_f32(a2, vld1q_f32(&w2[i]), x_tail);
+            a3 = vfmaq_f32(a3, vld1q_f32(&w3[i]), x_tail);
+        } else if (i < len) {
+            b0 = vfmaq_f32(b0, vld1q_f32(&w0[i]), x_tail);
+            b1 = vfmaq_f32(b1, vld1q_f32(&w1[i]), x_tail);
+            b2 = vfmaq_f32(b2, vld1q_f32(&w2[i]), x_tail);
+            b3 = vfmaq_f32(b3, vld1q_f32(&w3[i]), x_tail);
+        }
+        output[r] = vaddvq_f32(vaddq_f32(a0, b0));
+        output[r + 1] = vaddvq_f32(vaddq_f32(a1, b1));
+        output[r + 2] = vaddvq_f32(vaddq_f32(a2, b2));
+        output[r + 3] = vaddvq_f32(vaddq_f32(a3, b3));
+    }
+    for (; r < n_rows; r++) {
+        const float *w = &rows[r * stride];
+        float32x4_t a = vdupq_n_f32(0.0f), b = vdupq_n_f32(0.0f);
+        int i = 0;
+        for (; i + 8 <= body; i += 8) {
+            a = vfmaq_f32(a, vld1q_f32(&w[i]), vld1q_f32(&input[i]));
+            b = vfmaq_f32(b, vld1q_f32(&w[i + 4]), vld1q_f32(&input[i + 4]));
+        }
+        if (i < body) {
+            a = vfmaq_f32(a, vld1q_f32(&w[i]), vld1q_f32(&input[i]));
+            i += 4;
+        }
+        if (i < len && i % 8 == 0) {
+            a = vfmaq_f32(a, vld1q_f32(&w[i]), x_tail);
+        } else if (i < len) {
+            b = vfmaq_f32(b, vld1q_f32(&w[i]), x_tail);
+        }
+        output[r] = vaddvq_f32(vaddq_f32(a, b));
+    }
+}
+
+// output += scale * input
+void float_axpy(float *output, const float *input, float scale, int len) {
+    assert(output);
+    assert(input);
+    float32x4_t factor = vdupq_n_f32(scale);
+    int i = 0;
+    for (; i + 4 <= len; i += 4) {
+        float32x4_t acc = vld1q_f32(&output[i]);
+        acc = vfmaq_f32(acc, vld1q_f32(&input[i]), factor);
+        vst1q_f32(&output[i], acc);
+    }
+    for (; i < len; i++) {
+        output[i] += scale * input[i];
+    }
+}
+
+// sum of (input1[i] - input2[i])^2
+float float_sq_dist(const float *input1, const float *input2, int len) {
+    assert(input1);
+    assert(input2);
+    float32x4_t total0 = vdupq_n_f32(0.0f);
+    float32x4_t total1 = vdupq_n_f32(0.0f);
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+        float32x4_t d0 = vsubq_f32(vld1q_f32(&input1[i]),
+                                   vld1q_f32(&input2[i]));
+        float32x4_t d1 = vsubq_f32(vld1q_f32(&input1[i + 4]),
+                                   vld1q_f32(&input2[i + 4]));
+        total0 = vfmaq_f32(total0, d0, d0);
+        total1 = vfmaq_f32(total1, d1, d1);
+    }
+    if (i + 4 <= len) {
+        float32x4_t d0 = vsubq_f32(vld1q_f32(&input1[i]),
+                                   vld1q_f32(&input2[i]));
+        total0 = vfmaq_f32(total0, d0, d0);
+        i += 4;
+    }
+    float result = vaddvq_f32(vaddq_f32(total0, total1));
+    for (; i < len; i++) {
+        float d = input1[i] - input2[i];
+        result += d * d;
     }
     return result;
-}
\ No newline at end of file
+}
+
+// output = (input1 - input2) * scale
+void float_sub_scaled(float *output, const float *input1,
+                      const float *input2, float scale, int len) {
+    assert(output);
+    assert(input1);
+    assert(input2);
+    int i = 0;
+    for (; i + 4 <= len; i += 4) {
+        float32x4_t d = vsubq_f32(vld1q_f32(&input1[i]),
+                                  vld1q_f32(&input2[i]));
+        vst1q_f32(&output[i], vmulq_n_f32(d, scale));
+    }
+    for (; i < len; i++) {
+        output[i] = (input1[i] - input2[i]) * scale;
+    }
+}
+
+// gradient of binary cross-entropy with respect to the predictions,
+// (p - y) / (p (1 - p)) * scale with p clamped to [eps, 1 - eps]. One
+// division instead of the two of y / p - (1 - y) / (1 - p)
+void float_bce_grad(float *output, const float *pred, const float *target,
+                    float eps, float scale, int len) {
+    assert(output);
+    assert(pred);
+    assert(target);
+    float32x4_t lo = vdupq_n_f32(eps);
+    float32x4_t hi = vdupq_n_f32(1.0f - eps);
+    float32x4_t one = vdupq_n_f32(1.0f);
+    int i = 0;
+    for (; i + 4 <= len; i += 4) {
+        float32x4_t p = vminq_f32(vmaxq_f32(vld1q_f32(&pred[i]), lo), hi);
+        float32x4_t d = vsubq_f32(p, vld1q_f32(&target[i]));
+        float32x4_t var = vmulq_f32(p, vsubq_f32(one, p));
+        vst1q_f32(&output[i], vmulq_n_f32(vdivq_f32(d, var), scale));
+    }
+    for (; i < len; i++) {
+        float p = pred[i] < eps ? eps : pred[i] > 1.0f - eps ? 1.0f - eps
+                                                               : pred[i];
+        output[i] = (p - target[i]) / (p * (1.0f - p)) * scale;
+    }
+}
+
+// index of the first maximum element
+int float_argmax(const float *input, int len) {
+    assert(input);
+    assert(len > 0);
+    float max_val = input[0];
+    int i = 0;
+    if (len >= 4) {
+        float32x4_t max_vec = vld1q_f32(input);
+        for (i = 4; i + 4 <= len; i += 4) {
+            max_vec = vmaxq_f32(max_vec, vld1q_f32(&input[i]));
+        }
+        max_val = vmaxvq_f32(max_vec);
+    }
+    for (; i < len; i++) {
+        if (input[i] > max_val) {
+            max_val = input[i];
+        }
+    }
+    for (i = 0; i < len; i++) {
+        if (input[i] == max_val) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+// number of elements strictly greater than threshold
+int float_count_greater(const float *input, float threshold, int len) {
+    assert(input);
+    uint32x4_t counts = vdupq_n_u32(0);
+    float32x4_t limit = vdupq_n_f32(threshold);
+    int i = 0;
+    for (; i + 4 <= len; i += 4) {
+        uint32x4_t mask = vcgtq_f32(vld1q_f32(&input[i]), limit);
+        counts = vaddq_u32(counts, vshrq_n_u32(mask, 31));
+    }
+    int result = vaddvq_u32(counts);
+    for (; i < len; i++) {
+        if (input[i] > threshold) {
+            result++;
+        }
+    }
+    return result;
+}
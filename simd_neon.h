@@ -4,9 +4,29 @@
 void float_add(float *output, const float *input1,
                const float *input2, int len);
 
+void float_sub(float *output, const float *input1,
+               const float *input2, int len);
+
 void float_mul(float *output, const float *input1,
                const float *input2, int len);
 
 float float_dot(const float *input1, const float *input2, int len);
 
+void float_gemv(float *output, const float *rows, int stride,
+                int n_rows, const float *input, int len);
+
+void float_axpy(float *output, const float *input, float scale, int len);
+
+float float_sq_dist(const float *input1, const float *input2, int len);
+
+void float_sub_scaled(float *output, const float *input1,
+                      const float *input2, float scale, int len);
+
+void float_bce_grad(float *output, const float *pred, const float *target,
+                    float eps, float scale, int len);
+
+int float_argmax(const float *input, int len);
+
+int float_count_greater(const float *input, float threshold, int len);
+
 #endif
\ No newline at end of file
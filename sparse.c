@@ -0,0 +1,179 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <memory.h>
+
+#include "sparse.h"
+
+typedef struct sparse_matrix {
+    int n_rows;
+    int n_cols;
+    int nnz;
+    int *row_ptr;
+    int *col_idx;
+    float *values;
+} SparseMatrix;
+
+// keeps the nonzero entries of m, so pruned weights cost neither memory
+// nor multiplies
+SparseMatrix *create_sparse_matrix(const Matrix *m) {
+    assert(m);
+    int n_rows = matrix_get_n_rows(m);
+    int n_cols = matrix_get_n_cols(m);
+    int nnz = 0;
+    for (int i = 0; i < n_rows; i++) {
+        const float *row = matrix_get_row(m, i);
+        for (int j = 0; j < n_cols; j++) {
+            nnz += row[j] != 0.0f;
+        }
+    }
+    SparseMatrix *s = malloc(sizeof(SparseMatrix));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->n_rows = n_rows;
+    s->n_cols = n_cols;
+    s->nnz = nnz;
+    s->row_ptr = malloc(sizeof(int) * (n_rows + 1));
+    // never ask malloc for zero bytes, a fully pruned matrix is valid
+    s->col_idx = malloc(sizeof(int) * (nnz > 0 ? nnz : 1));
+    s->values = malloc(sizeof(float) * (nnz > 0 ? nnz : 1));
+    if (s->row_ptr == NULL || s->col_idx == NULL || s->values == NULL) {
+        destroy_sparse_matrix(s);
+        return NULL;
+    }
+    int k = 0;
+    for (int i = 0; i < n_rows; i++) {
+        s->row_ptr[i] = k;
+        const float *row = matrix_get_row(m, i);
+        for (int j = 0; j < n_cols; j++) {
+            if (row[j] != 0.0f) {
+                s->col_idx[k] = j;
+                s->values[k] = row[j];
+                k++;
+            }
+        }
+    }
+    s->row_ptr[n_rows] = k;
+    return s;
+}
+
+// copies CSR arrays built elsewhere, row_ptr has n_rows + 1 entries
+SparseMatrix *create_sparse_matrix_csr(int n_rows, int n_cols,
+                                       const int *row_ptr, const int *col_idx,
+                                       const float *values) {
+    assert(row_ptr);
+    assert(n_rows >= 0 && n_cols > 0);
+    int nnz = row_ptr[n_rows];
+    SparseMatrix *s = malloc(sizeof(SparseMatrix));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->n_rows = n_rows;
+    s->n_cols = n_cols;
+    s->nnz = nnz;
+    s->row_ptr = malloc(sizeof(int) * (n_rows + 1));
+    s->col_idx = malloc(sizeof(int) * (nnz > 0 ? nnz : 1));
+    s->values = malloc(sizeof(float) * (nnz > 0 ? nnz : 1));
+    if (s->row_ptr == NULL || s->col_idx == NULL || s->values == NULL) {
+        destroy_sparse_matrix(s);
+        return NULL;
+    }
+    memcpy(s->row_ptr, row_ptr, sizeof(int) * (n_rows + 1));
+    memcpy(s->col_idx, col_idx, sizeof(int) * nnz);
+    memcpy(s->values, values, sizeof(float) * nnz);
+    return s;
+}
+
+void destroy_sparse_matrix(SparseMatrix *s) {
+    assert(s);
+    free(s->row_ptr);
+    free(s->col_idx);
+    free(s->values);
+    free(s);
+}
+
+int sparse_matrix_get_n_rows(const SparseMatrix *s) {
+    assert(s);
+    return s->n_rows;
+}
+
+int sparse_matrix_get_n_cols(const SparseMatrix *s) {
+    assert(s);
+    return s->n_cols;
+}
+
+int sparse_matrix_get_nnz(const SparseMatrix *s) {
+    assert(s);
+    return s->nnz;
+}
+
+void sparse_matrix_to_dense(const SparseMatrix *s, Matrix *dst) {
+    assert(s);
+    assert(dst);
+    assert(matrix_get_n_rows(dst) == s->n_rows);
+    assert(matrix_get_n_cols(dst) == s->n_cols);
+    for (int i = 0; i < s->n_rows; i++) {
+        float *row = matrix_get_row_mut(dst, i);
+        memset(row, 0, sizeof(float) * s->n_cols);
+        for (int k = s->row_ptr[i]; k < s->row_ptr[i + 1]; k++) {
+            row[s->col_idx[k]] = s->values[k];
+        }
+    }
+}
+
+// dot product of row i of s with the dense x, four independent partial
+// sums keep the gathered loads from serializing on one add chain
+static float sparse_row_dot(const SparseMatrix *s, int i, const float *x) {
+    const int *cols = s->col_idx;
+    const float *vals = s->values;
+    int k = s->row_ptr[i];
+    int end = s->row_ptr[i + 1];
+    float t0 = 0, t1 = 0, t2 = 0, t3 = 0;
+    for (; k + 4 <= end; k += 4) {
+        t0 += vals[k] * x[cols[k]];
+        t1 += vals[k + 1] * x[cols[k + 1]];
+        t2 += vals[k + 2] * x[cols[k + 2]];
+        t3 += vals[k + 3] * x[cols[k + 3]];
+    }
+    for (; k < end; k++) {
+        t0 += vals[k] * x[cols[k]];
+    }
+    return (t0 + t1) + (t2 + t3);
+}
+
+// res = s * v
+void sparse_matrix_vec_mul(const SparseMatrix *s, const Vector *v,
+                           Vector *res) {
+    assert(s);
+    assert(v);
+    assert(res);
+    assert(v != res);
+    assert(s->n_cols == vector_get_n(v));
+    assert(s->n_rows == vector_get_n(res));
+    const float *x = vector_get_data(v);
+    float *out = vector_get_data_mut(res);
+    for (int i = 0; i < s->n_rows; i++) {
+        out[i] = sparse_row_dot(s, i, x);
+    }
+}
+
+// res = a * s^T, the batched form of sparse_matrix_vec_mul with one input
+// per row of a
+void sparse_matrix_mul_T(const Matrix *a, const SparseMatrix *s,
+                         Matrix *res) {
+    assert(a);
+    assert(s);
+    assert(res);
+    assert(matrix_get_n_cols(a) == s->n_cols);
+    assert(matrix_get_n_rows(res) == matrix_get_n_rows(a));
+    assert(matrix_get_n_cols(res) == s->n_rows);
+    int n_rows = matrix_get_n_rows(a);
+    for (int b = 0; b < n_rows; b++) {
+        const float *x = matrix_get_row(a, b);
+        float *out = matrix_get_row_mut(res, b);
+        for (int i = 0; i < s->n_rows; i++) {
+            out[i] = sparse_row_dot(s, i, x);
+        }
+    }
+}
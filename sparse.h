@@ -0,0 +1,33 @@
+#ifndef _SPARSE_HEADER_
+#define _SPARSE_HEADER_
+
+#include "vector.h"
+#include "matrix.h"
+
+// Compressed sparse rows: the nonzeros of row i are values[k] at column
+// col_idx[k] for row_ptr[i] <= k < row_ptr[i + 1].
+typedef struct sparse_matrix SparseMatrix;
+
+SparseMatrix *create_sparse_matrix(const Matrix *m);
+
+SparseMatrix *create_sparse_matrix_csr(int n_rows, int n_cols,
+                                       const int *row_ptr, const int *col_idx,
+                                       const float *values);
+
+void destroy_sparse_matrix(SparseMatrix *s);
+
+int sparse_matrix_get_n_rows(const SparseMatrix *s);
+
+int sparse_matrix_get_n_cols(const SparseMatrix *s);
+
+int sparse_matrix_get_nnz(const SparseMatrix *s);
+
+void sparse_matrix_to_dense(const SparseMatrix *s, Matrix *dst);
+
+void sparse_matrix_vec_mul(const SparseMatrix *s, const Vector *v,
+                           Vector *res);
+
+void sparse_matrix_mul_T(const Matrix *a, const SparseMatrix *s,
+                         Matrix *res);
+
+#endif
@@ -0,0 +1,172 @@
+// clock_gettime and getpid under -std=c11
+#ifndef __APPLE__
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+typedef struct {
+    const char *name;
+    int arg;
+    uint64_t start;
+    uint64_t end;
+} TraceEvent;
+
+// one thread's ring, only that thread writes it
+typedef struct trace_buffer {
+    struct trace_buffer *next;
+    int tid;
+    int capacity;
+    // events ever recorded, the ring holds the last capacity of them
+    atomic_ullong count;
+    TraceEvent events[];
+} TraceBuffer;
+
+atomic_bool trace_on = false;
+// every ring created since the last reset, pushed without a lock
+static _Atomic(TraceBuffer *) trace_buffers = NULL;
+static atomic_int trace_capacity = 0;
+static atomic_int trace_next_tid = 0;
+// bumped by trace_reset, so threads drop their pointer to a freed ring
+static atomic_int trace_generation = 0;
+
+static _Thread_local TraceBuffer *thread_buffer = NULL;
+static _Thread_local int thread_generation = -1;
+
+// monotonic nanoseconds, never 0 so that 0 can mean not traced
+uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec + 1;
+}
+
+// the calling thread's ring, created on its first event after a reset.
+// NULL when it could not be allocated, the thread then records nothing
+static TraceBuffer *get_thread_buffer(void) {
+    int generation = atomic_load(&trace_generation);
+    if (thread_generation == generation) {
+        return thread_buffer;
+    }
+    thread_generation = generation;
+    thread_buffer = NULL;
+    int capacity = atomic_load(&trace_capacity);
+    if (capacity <= 0) {
+        return NULL;
+    }
+    TraceBuffer *b = malloc(sizeof(TraceBuffer) +
+                            sizeof(TraceEvent) * capacity);
+    if (b == NULL) {
+        return NULL;
+    }
+    b->tid = atomic_fetch_add(&trace_next_tid, 1);
+    b->capacity = capacity;
+    atomic_init(&b->count, 0);
+    TraceBuffer *head = atomic_load(&trace_buffers);
+    do {
+        b->next = head;
+    } while (!atomic_compare_exchange_weak(&trace_buffers, &head, b));
+    thread_buffer = b;
+    return b;
+}
+
+// closes the region opened at start, called by trace_end
+void trace_record(const char *name, int arg, uint64_t start) {
+    uint64_t end = trace_now();
+    TraceBuffer *b = get_thread_buffer();
+    if (b == NULL) {
+        return;
+    }
+    unsigned long long i = atomic_load_explicit(&b->count,
+                                                memory_order_relaxed);
+    b->events[i % b->capacity] = (TraceEvent) {name, arg, start, end};
+    // publishes the event to trace_dump
+    atomic_store_explicit(&b->count, i + 1, memory_order_release);
+}
+
+// drops every recorded event and frees the rings. No thread may be
+// inside a traced region, call it after trace_stop once they are idle
+void trace_reset(void) {
+    assert(!atomic_load(&trace_on));
+    TraceBuffer *b = atomic_exchange(&trace_buffers, NULL);
+    while (b) {
+        TraceBuffer *next = b->next;
+        free(b);
+        b = next;
+    }
+    atomic_store(&trace_next_tid, 0);
+    atomic_fetch_add(&trace_generation, 1);
+}
+
+// starts a new trace keeping the last events_per_thread regions of
+// every thread. Returns 0 or -1
+int trace_start(int events_per_thread) {
+    assert(events_per_thread > 0);
+    if (atomic_load(&trace_on)) {
+        return -1;
+    }
+    trace_reset();
+    atomic_store(&trace_capacity, events_per_thread);
+    atomic_store(&trace_on, true);
+    return 0;
+}
+
+// regions already open still complete, no new ones are recorded
+void trace_stop(void) {
+    atomic_store(&trace_on, false);
+}
+
+bool trace_is_on(void) {
+    return atomic_load(&trace_on);
+}
+
+// writes the rings as complete ("X") events of the Chrome JSON trace
+// format, timestamps are monotonic microseconds shared by the processes
+// of one host, so the dumps of data parallel workers can be merged.
+// Call after trace_stop. Returns 0 or -1
+int trace_dump(const char *path) {
+    assert(path);
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        return -1;
+    }
+    long pid = (long) getpid();
+    unsigned long long dropped = 0;
+    fprintf(f, "{\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%ld,"
+               "\"args\":{\"name\":\"nn %ld\"}}", pid, pid);
+    for (TraceBuffer *b = atomic_load(&trace_buffers); b; b = b->next) {
+        unsigned long long count = atomic_load_explicit(&b->count,
+                                                        memory_order_acquire);
+        unsigned long long first = 0;
+        if (count > (unsigned long long) b->capacity) {
+            first = count - b->capacity;
+            dropped += first;
+        }
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,"
+                   "\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+                pid, b->tid, b->tid);
+        for (unsigned long long i = first; i < count; i++) {
+            const TraceEvent *e = &b->events[i % b->capacity];
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%ld,"
+                       "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                    e->name, pid, b->tid, e->start * 1e-3,
+                    (e->end - e->start) * 1e-3);
+            if (e->arg >= 0) {
+                fprintf(f, ",\"args\":{\"i\":%d}", e->arg);
+            }
+            fprintf(f, "}");
+        }
+    }
+    fprintf(f, "\n],\"otherData\":{\"dropped_events\":%llu}}\n", dropped);
+    bool failed = ferror(f) != 0;
+    if (fclose(f) != 0) {
+        failed = true;
+    }
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,52 @@
+#ifndef _TRACE_HEADER_
+#define _TRACE_HEADER_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Timeline of the library's hot regions for chrome://tracing and
+// Perfetto. Every thread records into its own ring of the last
+// events_per_thread regions, so recording takes no lock, and the
+// rings are written out as one JSON trace by trace_dump.
+//
+//     uint64_t start = trace_begin();
+//     ...
+//     trace_end("region", -1, start);
+//
+// While tracing is off trace_begin returns 0 and trace_end ignores it,
+// each costs one predicted branch.
+
+extern atomic_bool trace_on;
+
+uint64_t trace_now(void);
+
+void trace_record(const char *name, int arg, uint64_t start);
+
+static inline uint64_t trace_begin(void) {
+    if (__builtin_expect(atomic_load_explicit(&trace_on,
+                                              memory_order_relaxed), 0)) {
+        return trace_now();
+    }
+    return 0;
+}
+
+// name must outlive the trace (a string literal), arg is shown with the
+// region when it is not negative (a layer index, a chunk number)
+static inline void trace_end(const char *name, int arg, uint64_t start) {
+    if (__builtin_expect(start != 0, 0)) {
+        trace_record(name, arg, start);
+    }
+}
+
+int trace_start(int events_per_thread);
+
+void trace_stop(void);
+
+bool trace_is_on(void);
+
+int trace_dump(const char *path);
+
+void trace_reset(void);
+
+#endif
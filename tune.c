@@ -0,0 +1,295 @@
+// clock_gettime and sysconf under -std=c11, Apple headers hide
+// sysctlbyname when it is set
+#ifndef __APPLE__
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#include <sys/sysctl.h>
+#endif
+
+#include "tune.h"
+
+#define TUNE_FIELD_LEN 128
+#define TUNE_LINE_LEN 512
+// a timed run repeats the kernel until it takes at least this long
+#define TUNE_MIN_RUN_SECONDS 1e-3
+// best of this many runs, to filter out preemption and frequency ramps
+#define TUNE_RUNS 5
+
+typedef struct {
+    char cpu[TUNE_FIELD_LEN];
+    char key[TUNE_FIELD_LEN];
+    int values[TUNE_MAX_VALUES];
+    int n_values;
+} TuneEntry;
+
+typedef struct tune_cache {
+    char cpu[TUNE_FIELD_LEN];
+    TuneEntry *entries;
+    int n_entries;
+    int capacity;
+} TuneCache;
+
+// copies the part of line after prefix, without surrounding blanks and
+// the trailing newline
+static bool match_field(const char *line, const char *prefix, char *dst,
+                        size_t len) {
+    size_t n = strlen(prefix);
+    if (strncmp(line, prefix, n) != 0) {
+        return false;
+    }
+    const char *value = strchr(line + n, ':');
+    if (value == NULL) {
+        return false;
+    }
+    value++;
+    while (*value == ' ' || *value == '\t') {
+        value++;
+    }
+    snprintf(dst, len, "%s", value);
+    dst[strcspn(dst, "\n")] = '\0';
+    return true;
+}
+
+// x86 reports a "model name", ARM Linux only the implementer and part
+// numbers, macOS the brand string
+static void read_cpu_model(char *dst, size_t len) {
+    snprintf(dst, len, "unknown");
+#ifdef __APPLE__
+    size_t size = len;
+    if (sysctlbyname("machdep.cpu.brand_string", dst, &size, NULL, 0) == 0) {
+        return;
+    }
+#endif
+    FILE *f = fopen("/proc/cpuinfo", "r");
+    if (f == NULL) {
+        return;
+    }
+    char line[TUNE_LINE_LEN];
+    char implementer[TUNE_FIELD_LEN] = "";
+    char part[TUNE_FIELD_LEN] = "";
+    char model[TUNE_FIELD_LEN] = "";
+    while (fgets(line, sizeof(line), f)) {
+        if (model[0] == '\0') {
+            match_field(line, "model name", model, sizeof(model));
+        }
+        if (implementer[0] == '\0') {
+            match_field(line, "CPU implementer", implementer,
+                        sizeof(implementer));
+        }
+        if (part[0] == '\0') {
+            match_field(line, "CPU part", part, sizeof(part));
+        }
+    }
+    fclose(f);
+    if (model[0] != '\0') {
+        snprintf(dst, len, "%s", model);
+    } else if (implementer[0] != '\0') {
+        snprintf(dst, len, "arm %s %s", implementer, part);
+    }
+    // '|' separates the fields of a cache line
+    for (char *c = dst; *c; c++) {
+        if (*c == '|') {
+            *c = ' ';
+        }
+    }
+}
+
+static TuneEntry *find_entry(const TuneCache *cache, const char *cpu,
+                             const char *key) {
+    for (int i = 0; i < cache->n_entries; i++) {
+        TuneEntry *e = &cache->entries[i];
+        if (strcmp(e->cpu, cpu) == 0 && strcmp(e->key, key) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static TuneEntry *add_entry(TuneCache *cache, const char *cpu,
+                            const char *key) {
+    TuneEntry *e = find_entry(cache, cpu, key);
+    if (e) {
+        return e;
+    }
+    if (cache->n_entries == cache->capacity) {
+        int capacity = cache->capacity ? cache->capacity * 2 : 16;
+        TuneEntry *entries = realloc(cache->entries,
+                                     sizeof(TuneEntry) * capacity);
+        if (entries == NULL) {
+            return NULL;
+        }
+        cache->entries = entries;
+        cache->capacity = capacity;
+    }
+    e = &cache->entries[cache->n_entries++];
+    snprintf(e->cpu, sizeof(e->cpu), "%s", cpu);
+    snprintf(e->key, sizeof(e->key), "%s", key);
+    e->n_values = 0;
+    return e;
+}
+
+// reads the entries of every CPU from path, a missing or unreadable file
+// gives an empty cache. Returns NULL only when out of memory
+TuneCache *load_tune_cache(const char *path) {
+    TuneCache *cache = calloc(1, sizeof(TuneCache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    read_cpu_model(cache->cpu, sizeof(cache->cpu));
+    FILE *f = path ? fopen(path, "r") : NULL;
+    if (f == NULL) {
+        return cache;
+    }
+    char line[TUNE_LINE_LEN];
+    while (fgets(line, sizeof(line), f)) {
+        char *cpu = strtok(line, "|");
+        char *key = strtok(NULL, "|");
+        char *values = strtok(NULL, "\n");
+        if (cpu == NULL || key == NULL || values == NULL) {
+            // skip malformed lines instead of trusting them
+            continue;
+        }
+        TuneEntry *e = add_entry(cache, cpu, key);
+        if (e == NULL) {
+            fclose(f);
+            destroy_tune_cache(cache);
+            return NULL;
+        }
+        e->n_values = 0;
+        char *end = values;
+        while (e->n_values < TUNE_MAX_VALUES) {
+            char *start = end;
+            long v = strtol(start, &end, 10);
+            if (end == start) {
+                break;
+            }
+            e->values[e->n_values++] = (int) v;
+        }
+    }
+    fclose(f);
+    return cache;
+}
+
+// writes to a temporary file renamed over path, so a crash never leaves
+// a truncated cache behind. Returns 0 on success and -1 on failure
+int tune_cache_save(const TuneCache *cache, const char *path) {
+    assert(cache);
+    assert(path);
+    size_t len = strlen(path) + sizeof(".tmp");
+    char *tmp_path = malloc(len);
+    if (tmp_path == NULL) {
+        return -1;
+    }
+    snprintf(tmp_path, len, "%s.tmp", path);
+    FILE *f = fopen(tmp_path, "w");
+    if (f == NULL) {
+        free(tmp_path);
+        return -1;
+    }
+    for (int i = 0; i < cache->n_entries; i++) {
+        const TuneEntry *e = &cache->entries[i];
+        fprintf(f, "%s|%s|", e->cpu, e->key);
+        for (int j = 0; j < e->n_values; j++) {
+            fprintf(f, j > 0 ? " %d" : "%d", e->values[j]);
+        }
+        fprintf(f, "\n");
+    }
+    int rc = 0;
+    if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        rc = -1;
+    }
+    free(tmp_path);
+    return rc;
+}
+
+void destroy_tune_cache(TuneCache *cache) {
+    assert(cache);
+    free(cache->entries);
+    free(cache);
+}
+
+// fills values with the entry recorded for key on this CPU, returns false
+// when there is none or it holds a different number of values
+bool tune_cache_lookup(const TuneCache *cache, const char *key, int *values,
+                       int n_values) {
+    assert(cache);
+    assert(key);
+    assert(values);
+    const TuneEntry *e = find_entry(cache, cache->cpu, key);
+    if (e == NULL || e->n_values != n_values) {
+        return false;
+    }
+    memcpy(values, e->values, sizeof(int) * n_values);
+    return true;
+}
+
+// records values for key on this CPU, returns 0 or -1 when out of memory
+int tune_cache_store(TuneCache *cache, const char *key, const int *values,
+                     int n_values) {
+    assert(cache);
+    assert(key);
+    assert(values);
+    assert(n_values > 0 && n_values <= TUNE_MAX_VALUES);
+    assert(strchr(key, '|') == NULL);
+    TuneEntry *e = add_entry(cache, cache->cpu, key);
+    if (e == NULL) {
+        return -1;
+    }
+    memcpy(e->values, values, sizeof(int) * n_values);
+    e->n_values = n_values;
+    return 0;
+}
+
+const char *tune_cache_get_cpu_model(const TuneCache *cache) {
+    assert(cache);
+    return cache->cpu;
+}
+
+int tune_get_n_cpus(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int) n : 1;
+}
+
+// monotonic seconds for timing kernels
+double tune_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// seconds per call of fn(ctx), the best of TUNE_RUNS timed runs
+double tune_bench(void (*fn)(void *), void *ctx) {
+    assert(fn);
+    // the first call warms caches and is not timed
+    fn(ctx);
+    int reps = 1;
+    double start = tune_now();
+    fn(ctx);
+    double once = tune_now() - start;
+    if (once < TUNE_MIN_RUN_SECONDS) {
+        reps = (int) (TUNE_MIN_RUN_SECONDS / (once > 1e-9 ? once : 1e-9)) + 1;
+    }
+    double best = once;
+    for (int run = 0; run < TUNE_RUNS; run++) {
+        start = tune_now();
+        for (int i = 0; i < reps; i++) {
+            fn(ctx);
+        }
+        double t = (tune_now() - start) / reps;
+        if (t < best) {
+            best = t;
+        }
+    }
+    return best;
+}
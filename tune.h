@@ -0,0 +1,34 @@
+#ifndef _TUNE_HEADER_
+#define _TUNE_HEADER_
+
+#include <stdbool.h>
+
+// most integers recorded for one tuned configuration
+#define TUNE_MAX_VALUES 4
+
+// Tuning results keyed by CPU model and a caller chosen key, stored on
+// disk as one "cpu model|key|values..." line per entry so that one file
+// can serve several machines.
+typedef struct tune_cache TuneCache;
+
+TuneCache *load_tune_cache(const char *path);
+
+int tune_cache_save(const TuneCache *cache, const char *path);
+
+void destroy_tune_cache(TuneCache *cache);
+
+bool tune_cache_lookup(const TuneCache *cache, const char *key, int *values,
+                       int n_values);
+
+int tune_cache_store(TuneCache *cache, const char *key, const int *values,
+                     int n_values);
+
+const char *tune_cache_get_cpu_model(const TuneCache *cache);
+
+int tune_get_n_cpus(void);
+
+double tune_now(void);
+
+double tune_bench(void (*fn)(void *), void *ctx);
+
+#endif
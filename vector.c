@@ -8,10 +8,14 @@
 #include "vector.h"
 #include "simd_neon.h"
 
+#define VECTOR_ALIGN 64
+
 typedef struct vector {
     float *data;
     int n;
     bool is_column;
+    // views borrow data from a matrix or another vector
+    bool owns_data;
 } Vector;
 
 Vector *create_vector(int n, bool is_column) {
@@ -19,29 +23,65 @@ Vector *create_vector(int n, bool is_column) {
     if (v == NULL) {
         return NULL;
     }
+    // whole zeroed cache lines, so a SIMD load never crosses the end
+    size_t bytes = (sizeof(float) * n + VECTOR_ALIGN - 1) / VECTOR_ALIGN *
+                   VECTOR_ALIGN;
     float *data = NULL;
-    if (posix_memalign((void **) &data, 16, sizeof(float) * n) != 0 ||
-        data == NULL) {
+    if (posix_memalign((void **) &data, VECTOR_ALIGN,
+        bytes > 0 ? bytes : VECTOR_ALIGN) != 0 || data == NULL) {
         free(v);
         return NULL;
     }
+    memset(data, 0, bytes);
     v->data = data;
     v->n = n;
     v->is_column = is_column;
+    v->owns_data = true;
     return v;
 }
 
+// a vector over n floats it does not own, data may be NULL and bound
+// later with vector_set_data or matrix_row_as_vec
+Vector *create_vector_view(float *data, int n, bool is_column) {
+    Vector *v = malloc(sizeof(Vector));
+    if (v == NULL) {
+        return NULL;
+    }
+    v->data = data;
+    v->n = n;
+    v->is_column = is_column;
+    v->owns_data = false;
+    return v;
+}
+
+// elements [start, start + n) of v without copying
+Vector *vector_view_range(const Vector *v, int start, int n) {
+    assert(v);
+    assert(start >= 0 && n >= 0 && start + n <= v->n);
+    return create_vector_view(&v->data[start], n, v->is_column);
+}
+
 void destroy_vector(Vector *v) {
     assert(v);
-    assert(v->data);
-    free(v->data);
+    if (v->owns_data) {
+        free(v->data);
+    }
     free(v);
 }
 
 void vector_free_data(Vector *v) {
     assert(v);
     assert(v->data);
-    free(v->data);
+    if (v->owns_data) {
+        free(v->data);
+    }
+    v->data = NULL;
+    v->owns_data = false;
+}
+
+bool vector_is_view(const Vector *v) {
+    assert(v);
+    return !v->owns_data;
 }
 
 void vector_copy(Vector *dst, const Vector *src) {
@@ -68,6 +108,11 @@ const float *vector_get_data(const Vector *v) {
     return v->data;
 }
 
+float *vector_get_data_mut(Vector *v) {
+    assert(v);
+    return v->data;
+}
+
 bool vector_get_is_column(const Vector *v) {
     assert(v);
     return v->is_column;
@@ -85,10 +130,15 @@ void vector_copy_data(Vector *v, const float *data, int n_elem) {
     memcpy(v->data, data, sizeof(float) * n_elem);
 }
 
+// turns v into a view of data, releasing any storage it owned
 void vector_set_data(Vector *v, float *data, int n_elem) {
     assert(v);
     assert(data);
     assert(n_elem == v->n);
+    if (v->owns_data) {
+        free(v->data);
+        v->owns_data = false;
+    }
     v->data = data;
 }
 
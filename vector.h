@@ -7,8 +7,14 @@ typedef struct vector Vector;
 
 Vector *create_vector(int n, bool is_column);
 
+Vector *create_vector_view(float *data, int n, bool is_column);
+
+Vector *vector_view_range(const Vector *v, int start, int n);
+
 void destroy_vector(Vector *v);
 
+bool vector_is_view(const Vector *v);
+
 void vector_free_data(Vector *v);
 
 void vector_copy(Vector *dst, const Vector *src);
@@ -19,6 +25,8 @@ float vector_get(const Vector *v, int index);
 
 const float *vector_get_data(const Vector *v);
 
+float *vector_get_data_mut(Vector *v);
+
 bool vector_get_is_column(const Vector *v);
 
 void vector_transpose(Vector *v);